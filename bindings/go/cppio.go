@@ -13,12 +13,29 @@ import ("unsafe"
 	"fmt")
 
 const (OReceiveTimeout = int(C.cppio_receive_timeout)
-	OSendTimeout = int(C.cppio_send_timeout))
+	OSendTimeout = int(C.cppio_send_timeout)
+	ONoDelay = int(C.cppio_nodelay)
+	OSendBufferSize = int(C.cppio_send_buffer_size)
+	OReceiveBufferSize = int(C.cppio_receive_buffer_size)
+	OQuickAck = int(C.cppio_quickack)
+	OCork = int(C.cppio_cork)
+	OBusyPoll = int(C.cppio_busy_poll)
+	OPriority = int(C.cppio_priority)
+	OUserTimeout = int(C.cppio_user_timeout)
+	OZeroCopyThreshold = int(C.cppio_zerocopy_threshold)
+	OSendBatch = int(C.cppio_send_batch)
+	OReceiveBatch = int(C.cppio_receive_batch)
+	OSequenceNumbers = int(C.cppio_sequence_numbers)
+	OMulticastTtl = int(C.cppio_multicast_ttl)
+	OMulticastLoop = int(C.cppio_multicast_loop)
+	OSequenceGaps = int(C.cppio_sequence_gaps)
+	OVmspliceThreshold = int(C.cppio_vmsplice_threshold))
 
 const (
 	eTimeout = -1
 	eConnectionLost = -2
 	eBufferTooBig = -3
+	eChecksumMismatch = -4
 )
 
 type Error interface {
@@ -128,11 +145,33 @@ func (line *IoLine) SetOptionInt(option int, value int) error {
 		return line.setReceiveTimeout(value)
 	case OSendTimeout:
 		return line.setSendTimeout(value)
+	case ONoDelay, OSendBufferSize, OReceiveBufferSize, OQuickAck, OCork, OBusyPoll, OPriority, OUserTimeout, OZeroCopyThreshold,
+		OSendBatch, OReceiveBatch, OSequenceNumbers, OMulticastTtl, OMulticastLoop, OVmspliceThreshold:
+		cvalue := C.int(value)
+		if C.cppio_line_set_option(line.ptr, C.enum_cppio_line_option(option), unsafe.Pointer(&cvalue)) != 0 {
+			return errors.New("Unable to set option")
+		}
+		return nil
 	default:
 		return errors.New("Unknown option")
 	}
 }
 
+func (line *IoLine) GetOptionInt(option int) (int, error) {
+	var cvalue C.int
+	if C.cppio_line_get_option(line.ptr, C.enum_cppio_line_option(option), unsafe.Pointer(&cvalue)) != 0 {
+		return 0, errors.New("Unable to get option")
+	}
+	return int(cvalue), nil
+}
+
+func (line *IoLine) Flush() error {
+	if C.cppio_line_flush(line.ptr) < 0 {
+		return errors.New("Unable to flush line")
+	}
+	return nil
+}
+
 func (acceptor *IoAcceptor) WaitConnection(milliseconds uint) IoLine {
 	return IoLine { unsafe.Pointer(C.cppio_acceptor_wait_connection(acceptor.ptr, C.int(milliseconds)))}
 }
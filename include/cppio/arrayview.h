@@ -0,0 +1,71 @@
+
+#ifndef ARRAYVIEW_H
+#define ARRAYVIEW_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace cppio
+{
+
+/*
+ * Non-owning view of contiguous array, like std::span (which is not available in C++11)
+ */
+template <typename T>
+class ArrayView
+{
+public:
+	ArrayView() : m_data(nullptr), m_size(0) {}
+	ArrayView(T* data, size_t size) : m_data(data), m_size(size) {}
+
+	template <size_t N>
+	ArrayView(T (&array)[N]) : m_data(array), m_size(N) {}
+
+	/*
+	 * Any container with data() and size(), e.g. std::vector or std::array
+	 */
+	template <typename Container, typename = typename std::enable_if<
+		std::is_convertible<decltype(std::declval<Container&>().data()), T*>::value>::type>
+	ArrayView(Container& container) : m_data(container.data()), m_size(container.size()) {}
+
+	T* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	size_t sizeInBytes() const { return m_size * sizeof(T); }
+	bool empty() const { return m_size == 0; }
+
+	T& operator[](size_t index) const { return m_data[index]; }
+
+	T* begin() const { return m_data; }
+	T* end() const { return m_data + m_size; }
+
+private:
+	T* m_data;
+	size_t m_size;
+};
+
+namespace detail
+{
+
+/*
+ * Views frame payload as array of T. Throws std::length_error if payload size is not multiple of sizeof(T),
+ * std::invalid_argument if payload is not aligned for T.
+ */
+template <typename T>
+ArrayView<const T> arrayOf(const void* data, size_t size)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only arrays of trivially copyable types can be viewed");
+	if(size % sizeof(T) != 0)
+		throw std::length_error("Frame size is not multiple of array element size");
+	if(reinterpret_cast<uintptr_t>(data) % alignof(T) != 0)
+		throw std::invalid_argument("Frame is not aligned for array element type");
+	return ArrayView<const T>(static_cast<const T*>(data), size / sizeof(T));
+}
+
+}
+
+}
+
+#endif /* ifndef ARRAYVIEW_H */
@@ -0,0 +1,59 @@
+
+#ifndef BUFFEREDIOLINE_H
+#define BUFFEREDIOLINE_H
+
+#include "ioline.h"
+#include "visibility.h"
+
+#include <memory>
+
+namespace cppio
+{
+
+/*
+ * Decorator which coalesces small writes and reads of wrapped stream line. Written data is sent when write
+ * buffer fills up, on flush(), or, if maxLatencyInMs is not 0, by background thread when the oldest buffered
+ * byte has waited that long. Writes are safe to call concurrently with that thread, reads are not synchronized.
+ * Data in read buffer is not visible to pollers, see bufferedReadSize().
+ */
+class CPPIO_API BufferedIoLine : public IoLine
+{
+public:
+	BufferedIoLine(std::unique_ptr<IoLine> line, size_t writeBufferSize = 65536, size_t readBufferSize = 65536,
+			int maxLatencyInMs = 0);
+	virtual ~BufferedIoLine();
+
+	virtual ssize_t read(void* buffer, size_t buflen);
+	virtual ssize_t write(void* buffer, size_t buflen);
+	virtual ssize_t writeShared(const std::shared_ptr<const std::vector<char>>& buffer, size_t offset, size_t buflen);
+
+	/*
+	 * Flushes buffered data, then passes region to wrapped line, so that sockets still use sendfile()
+	 */
+	virtual ssize_t sendFileRegion(int fd, uint64_t offset, size_t length);
+
+	/*
+	 * Sends buffered data; returns 0 or error code of failed write, including one which happened in background
+	 */
+	virtual ssize_t flush();
+
+	virtual void setOption(LineOption option, void* data);
+	virtual void getOption(LineOption option, void* data);
+	virtual bool isConnected();
+
+	/*
+	 * Handle of wrapped line, for polling only: data written to it directly would overtake buffered data
+	 */
+	virtual void* getNativeHandle();
+
+	size_t bufferedReadSize() const;
+	IoLine* line() const;
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> m_impl;
+};
+
+}
+
+#endif /* ifndef BUFFEREDIOLINE_H */
@@ -6,7 +6,23 @@
 CPPIO_API enum cppio_line_option
 {
 	cppio_receive_timeout = 1,
-	cppio_send_timeout = 2
+	cppio_send_timeout = 2,
+	cppio_nodelay = 3,
+	cppio_send_buffer_size = 4,
+	cppio_receive_buffer_size = 5,
+	cppio_quickack = 6,
+	cppio_cork = 7,
+	cppio_busy_poll = 8,
+	cppio_priority = 9,
+	cppio_user_timeout = 10,
+	cppio_zerocopy_threshold = 11,
+	cppio_send_batch = 12,
+	cppio_receive_batch = 13,
+	cppio_sequence_numbers = 14,
+	cppio_multicast_ttl = 15,
+	cppio_multicast_loop = 16,
+	cppio_sequence_gaps = 17,
+	cppio_vmsplice_threshold = 18
 };
 
 #ifdef __cplusplus
@@ -22,15 +38,23 @@ extern "C"
 	CPPIO_API cppio_iolinemanager cppio_create_line_manager();
 
 	CPPIO_API cppio_ioline cppio_create_client(cppio_iolinemanager manager, const char* address);
+	CPPIO_API cppio_ioline cppio_create_client_with_timeout(cppio_iolinemanager manager, const char* address, int timeout);
+	CPPIO_API void cppio_create_clients(cppio_iolinemanager manager, const char** addresses, cppio_ioline* lines, size_t count, int timeout);
 	CPPIO_API void cppio_destroy_line(cppio_ioline line);
 
+	CPPIO_API cppio_ioline cppio_lease_client(cppio_iolinemanager manager, const char* address, int timeout);
+	CPPIO_API void cppio_release_client(cppio_iolinemanager manager, cppio_ioline line, int reusable);
+
 	CPPIO_API cppio_ioacceptor cppio_create_server(cppio_iolinemanager manager, const char* address);
 	CPPIO_API void cppio_destroy_acceptor(cppio_ioacceptor acceptor);
 
 	cppio_ioline cppio_acceptor_wait_connection(cppio_ioacceptor acceptor, int timeout);
+	size_t cppio_acceptor_wait_connections(cppio_ioacceptor acceptor, cppio_ioline* lines, size_t max_lines, int timeout);
 	ssize_t cppio_line_read(cppio_ioline line, char* buffer, size_t buffer_length);
 	ssize_t cppio_line_write(cppio_ioline line, char* buffer, size_t buffer_length);
 	int cppio_line_set_option(cppio_ioline line, enum cppio_line_option option, void* data);
+	int cppio_line_get_option(cppio_ioline line, enum cppio_line_option option, void* data);
+	ssize_t cppio_line_flush(cppio_ioline line);
 
 	cppio_message cppio_create_message();
 	void cppio_message_add(cppio_message message, const char* buffer, size_t buffer_length);
@@ -9,6 +9,7 @@ namespace cppio
 		eTimeout = -1,
 		eConnectionLost = -2,
 		eTooBigBuffer = -3,
+		eChecksumMismatch = -4,
 		eUnknown = -100
 	};
 }
@@ -0,0 +1,191 @@
+
+#ifndef FRAMETRAITS_H
+#define FRAMETRAITS_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <stdexcept>
+#include <type_traits>
+#include "arrayview.h"
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+namespace cppio
+{
+
+/*
+ * Encoding of values into frames for Message::pack() and unpack(). Trivially copyable types (integers, floats,
+ * enums, plain structs) are stored as is, in host byte order, and their size is known at compile time;
+ * strings are stored without terminator. Specialize for other types.
+ */
+template <typename T, typename Enable = void>
+struct FrameTraits
+{
+	static_assert(std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value,
+			"Only trivially copyable non-pointer types can be packed as is");
+
+	static constexpr bool isFixedSize = true;
+
+	static constexpr size_t size(const T&)
+	{
+		return sizeof(T);
+	}
+
+	static void encode(const T& value, void* buffer)
+	{
+		memcpy(buffer, &value, sizeof(T));
+	}
+
+	static T decode(const void* data, size_t size)
+	{
+		if(size != sizeof(T))
+			throw std::length_error("Frame size doesn't match unpacked type");
+		T value;
+		memcpy(&value, data, sizeof(T));
+		return value;
+	}
+};
+
+template <>
+struct FrameTraits<std::string>
+{
+	static constexpr bool isFixedSize = false;
+
+	static size_t size(const std::string& value)
+	{
+		return value.size();
+	}
+
+	static void encode(const std::string& value, void* buffer)
+	{
+		memcpy(buffer, value.data(), value.size());
+	}
+
+	static std::string decode(const void* data, size_t size)
+	{
+		return std::string(static_cast<const char*>(data), size);
+	}
+};
+
+#if __cplusplus >= 201703L
+/*
+ * Unpacked views reference frame storage and are valid while message is
+ */
+template <>
+struct FrameTraits<std::string_view>
+{
+	static constexpr bool isFixedSize = false;
+
+	static size_t size(std::string_view value)
+	{
+		return value.size();
+	}
+
+	static void encode(std::string_view value, void* buffer)
+	{
+		memcpy(buffer, value.data(), value.size());
+	}
+
+	static std::string_view decode(const void* data, size_t size)
+	{
+		return std::string_view(static_cast<const char*>(data), size);
+	}
+};
+#endif
+
+/*
+ * Arrays are packed as is; unpacked view references frame storage, see Message::getArray()
+ */
+template <typename T>
+struct FrameTraits<ArrayView<T>>
+{
+	static constexpr bool isFixedSize = false;
+
+	static size_t size(ArrayView<T> value)
+	{
+		return value.sizeInBytes();
+	}
+
+	static void encode(ArrayView<T> value, void* buffer)
+	{
+		if(!value.empty())
+			memcpy(buffer, value.data(), value.sizeInBytes());
+	}
+
+	static ArrayView<T> decode(const void* data, size_t size)
+	{
+		static_assert(std::is_const<T>::value, "Unpacked arrays are read-only");
+		return detail::arrayOf<typename std::remove_const<T>::type>(data, size);
+	}
+};
+
+namespace detail
+{
+
+template <size_t... I>
+struct IndexSequence
+{
+};
+
+template <size_t N, size_t... I>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...>
+{
+};
+
+template <size_t... I>
+struct MakeIndexSequence<0, I...>
+{
+	typedef IndexSequence<I...> type;
+};
+
+/*
+ * Total payload size of values whose size is known at compile time
+ */
+template <typename... Ts>
+struct FixedPayloadSize;
+
+template <>
+struct FixedPayloadSize<>
+{
+	static constexpr size_t value = 0;
+};
+
+template <typename T, typename... Ts>
+struct FixedPayloadSize<T, Ts...>
+{
+	static constexpr size_t value = (FrameTraits<T>::isFixedSize ? sizeof(T) : 0) + FixedPayloadSize<Ts...>::value;
+};
+
+template <typename T>
+inline size_t variablePayloadSize(const T& value)
+{
+	return FrameTraits<T>::isFixedSize ? 0 : FrameTraits<T>::size(value);
+}
+
+template <typename... Ts>
+struct Unpacker
+{
+	template <typename Source, size_t... I>
+	static std::tuple<Ts...> unpack(const Source& source, size_t first, IndexSequence<I...>)
+	{
+		if(source.size() < first + sizeof...(Ts))
+			throw std::out_of_range("Not enough frames to unpack");
+		return std::tuple<Ts...>(FrameTraits<Ts>::decode(source.frame(first + I).data(),
+					source.frame(first + I).size())...);
+	}
+};
+
+template <typename... Ts, typename Source>
+std::tuple<Ts...> unpackFrames(const Source& source, size_t first)
+{
+	return Unpacker<Ts...>::unpack(source, first, typename MakeIndexSequence<sizeof...(Ts)>::type());
+}
+
+}
+
+}
+
+#endif /* ifndef FRAMETRAITS_H */
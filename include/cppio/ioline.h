@@ -3,8 +3,10 @@
 #define IOLINE_H
 
 #include <cstddef>
+#include <cstdint>
 #include <stdexcept>
 #include <memory>
+#include <vector>
 #include <chrono>
 #include "visibility.h"
 #include "cppio/errors.h"
@@ -42,10 +44,39 @@ public:
 	ConnectionLost(const std::string& errmsg) : IoException(errmsg) {}
 };
 
+// Part of record passed to IoLine::writeRecord()
+struct CPPIO_API IoVec
+{
+	const void* data;
+	size_t length;
+};
+
+/*
+ * All options take a pointer to int.
+ * Options after SendTimeout are line specific, as noted below; lines that do not support an option throw
+ * UnsupportedOption. Pipe lines accept SendBufferSize (F_SETPIPE_SZ) and VmspliceThreshold.
+ * They may also be given in the line address, e.g. "tcp://host:port?nodelay=1&sndbuf=262144"
+ */
 enum class CPPIO_API LineOption
 {
 	ReceiveTimeout = 1,
-	SendTimeout = 2
+	SendTimeout = 2,
+	NoDelay = 3,            // TCP_NODELAY: 1 disables Nagle's algorithm
+	SendBufferSize = 4,     // SO_SNDBUF, in bytes
+	ReceiveBufferSize = 5,  // SO_RCVBUF, in bytes
+	QuickAck = 6,           // TCP_QUICKACK: 1 keeps delayed ACKs disabled (re-armed after every read)
+	Cork = 7,               // TCP_CORK: 1 holds partial segments, 0 flushes them
+	BusyPoll = 8,           // SO_BUSY_POLL, in microseconds
+	Priority = 9,           // SO_PRIORITY
+	UserTimeout = 10,       // TCP_USER_TIMEOUT, in milliseconds
+	ZeroCopyThreshold = 11, // MSG_ZEROCOPY is used for writes of at least this many bytes, 0 disables
+	SendBatch = 12,         // UDP: datagrams queued before one sendmmsg(), queue is also sent by flush()
+	ReceiveBatch = 13,      // UDP: datagrams fetched by one recvmmsg()
+	SequenceNumbers = 14,   // UDP: 1 prepends 64-bit sequence number to every datagram and checks it on receive
+	MulticastTtl = 15,      // IP_MULTICAST_TTL/IPV6_MULTICAST_HOPS
+	MulticastLoop = 16,     // IP_MULTICAST_LOOP/IPV6_MULTICAST_LOOP
+	SequenceGaps = 17,      // UDP, read only: number of datagrams lost or reordered according to sequence numbers
+	VmspliceThreshold = 18  // Pipes: shared writes of at least this many bytes are mapped with vmsplice(), 0 disables
 };
 
 class CPPIO_API Pollable
@@ -69,7 +100,89 @@ public:
 	virtual ssize_t read(void* buffer, size_t buflen) = 0;
 	virtual ssize_t write(void* buffer, size_t buflen) = 0;
 
+	/*
+	 * Same as write(), but line may keep a reference to the buffer after returning
+	 * (e.g. until kernel is done with zero-copy transmission). Caller must not modify buffer
+	 * while its use_count() is greater than one.
+	 */
+	virtual ssize_t writeShared(const std::shared_ptr<const std::vector<char>>& buffer, size_t offset, size_t buflen)
+	{
+		return write(const_cast<char*>(buffer->data()) + offset, buflen);
+	}
+
+	/*
+	 * Writes parts in order, with one system call where line supports it (writev()). Returns number of bytes
+	 * written, which may end in the middle of any part, or error code. Default implementation write()s parts
+	 * one by one and stops at first short write.
+	 */
+	virtual ssize_t writeGathered(const IoVec* parts, size_t count);
+
 	virtual void setOption(LineOption option, void* data) = 0;
+
+	virtual void getOption(LineOption option, void* data)
+	{
+		throw UnsupportedOption("");
+	}
+
+	/*
+	 * Sends data which line has queued (e.g. batched datagrams). Returns 0 or error code.
+	 */
+	virtual ssize_t flush()
+	{
+		return 0;
+	}
+
+	/*
+	 * Lines which preserve message boundaries deliver every writeRecord() as a whole to one readRecord().
+	 * readRecord() returns record size; if record is bigger than buflen, it is left in the line and its size
+	 * is returned, so that caller can retry with bigger buffer.
+	 */
+	virtual bool preservesBoundaries() const
+	{
+		return false;
+	}
+
+	virtual ssize_t writeRecord(const IoVec* parts, size_t count)
+	{
+		throw UnsupportedOption("Line doesn't preserve message boundaries");
+	}
+
+	virtual ssize_t readRecord(void* buffer, size_t buflen)
+	{
+		throw UnsupportedOption("Line doesn't preserve message boundaries");
+	}
+
+	/*
+	 * Passes descriptors to peer along with the first bytes of buffer, returns number of bytes written.
+	 * Descriptors stay owned by caller. Peer gets them from takeDescriptor() in the same order, after reading
+	 * data they were sent with. Only local socket lines support it.
+	 */
+	virtual ssize_t writeWithDescriptors(const void* buffer, size_t buflen, const int* fds, size_t count)
+	{
+		throw UnsupportedOption("Line can't pass descriptors");
+	}
+
+	/*
+	 * Returns next received descriptor, which is then owned by caller, or -1 if there is none
+	 */
+	virtual int takeDescriptor()
+	{
+		return -1;
+	}
+
+	/*
+	 * Writes length bytes of file fd starting at offset, returns length or error code. Socket lines send them
+	 * straight from page cache, default implementation reads file in chunks and write()s them.
+	 */
+	virtual ssize_t sendFileRegion(int fd, uint64_t offset, size_t length);
+
+	/*
+	 * Non-blocking check that peer hasn't closed the line. Lines which can't tell return true.
+	 */
+	virtual bool isConnected()
+	{
+		return true;
+	}
 };
 
 inline IoLine::~IoLine() {}
@@ -80,6 +193,24 @@ public:
 	virtual ~IoAcceptor() = 0;
 
 	virtual IoLine* waitConnection(int timeoutInMs) = 0;
+
+	/*
+	 * Waits up to timeoutInMs for first connection, then takes every connection which is already pending,
+	 * up to maxConnections. Returns empty vector on timeout.
+	 */
+	virtual std::vector<IoLine*> waitConnections(size_t maxConnections, int timeoutInMs)
+	{
+		std::vector<IoLine*> lines;
+		IoLine* line = waitConnection(timeoutInMs);
+		while(line)
+		{
+			lines.push_back(line);
+			if(lines.size() >= maxConnections)
+				break;
+			line = waitConnection(0);
+		}
+		return lines;
+	}
 };
 
 inline IoAcceptor::~IoAcceptor() {}
@@ -92,6 +223,35 @@ public:
 	virtual bool supportsScheme(const std::string& scheme) = 0;
 	virtual IoLine* createClient(const std::string& address) = 0;
 	virtual IoAcceptor* createServer(const std::string& address) = 0;
+
+	/*
+	 * Connects to all addresses, giving up on attempts which are not finished within timeoutInMs (no limit if
+	 * negative). Result has nullptr for every failed connection. Factories which can connect asynchronously
+	 * establish all connections concurrently, with timeoutInMs == 0 they keep only connections which are
+	 * established right away. Default implementation connects one by one and can't interrupt an attempt,
+	 * so with timeoutInMs <= 0 it makes one attempt for every address.
+	 */
+	virtual std::vector<IoLine*> createClients(const std::vector<std::string>& addresses, int timeoutInMs)
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutInMs);
+		std::vector<IoLine*> lines;
+		for(const auto& address : addresses)
+		{
+			IoLine* line = nullptr;
+			if((timeoutInMs <= 0) || (std::chrono::steady_clock::now() < deadline))
+			{
+				try
+				{
+					line = createClient(address);
+				}
+				catch(const IoException& e)
+				{
+				}
+			}
+			lines.push_back(line);
+		}
+		return lines;
+	}
 };
 
 inline IoLineFactory::~IoLineFactory() {}
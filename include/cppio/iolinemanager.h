@@ -6,10 +6,21 @@
 #include "visibility.h"
 
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace cppio
 {
 
+struct CPPIO_API PoolLimits
+{
+	PoolLimits() : maxIdlePerEndpoint(4), maxActivePerEndpoint(16), idleTimeoutInMs(60000) {}
+
+	size_t maxIdlePerEndpoint;
+	size_t maxActivePerEndpoint;
+	int idleTimeoutInMs;
+};
+
 class CPPIO_API IoLineManager
 {
 public:
@@ -19,6 +30,28 @@ public:
 	IoLine* createClient(const std::string& address);
 	IoAcceptor* createServer(const std::string& address);
 
+	/*
+	 * Connects with deadline: returns nullptr if connection is not established within timeoutInMs.
+	 * See IoLineFactory::createClients() for meaning of timeoutInMs == 0.
+	 */
+	IoLine* createClient(const std::string& address, int timeoutInMs);
+
+	/*
+	 * Establishes connections to all addresses concurrently, within timeoutInMs.
+	 * Returned vector has the same order as addresses, with nullptr for every failed connection.
+	 */
+	std::vector<IoLine*> createClients(const std::vector<std::string>& addresses, int timeoutInMs);
+
+	/*
+	 * Pooled client lines: leaseClient() returns an idle line to the same address if there is a healthy one,
+	 * otherwise connects a new one. Waits up to timeoutInMs if endpoint already has maxActivePerEndpoint
+	 * lines leased. Leased lines should be given back with releaseClient(), which keeps reusable lines
+	 * for the next lease (up to maxIdlePerEndpoint) and deletes the rest.
+	 */
+	IoLine* leaseClient(const std::string& address, int timeoutInMs);
+	void releaseClient(IoLine* line, bool reusable = true);
+	void setPoolLimits(const PoolLimits& limits);
+
 	void registerFactory(std::unique_ptr<IoLineFactory> factory);
 
 private:
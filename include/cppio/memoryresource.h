@@ -0,0 +1,198 @@
+
+#ifndef MEMORYRESOURCE_H
+#define MEMORYRESOURCE_H
+
+#include "visibility.h"
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define CPPIO_HAS_PMR 1
+#endif
+#endif
+
+namespace cppio
+{
+
+/*
+ * Source of memory for frame payloads and frame tables, modelled after std::pmr::memory_resource
+ * (which is not available in C++11).
+ */
+class CPPIO_API MemoryResource
+{
+public:
+	virtual ~MemoryResource();
+
+	void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t))
+	{
+		return doAllocate(bytes, alignment);
+	}
+
+	void deallocate(void* p, size_t bytes, size_t alignment = alignof(std::max_align_t))
+	{
+		doDeallocate(p, bytes, alignment);
+	}
+
+	bool isEqual(const MemoryResource& other) const
+	{
+		return this == &other || doIsEqual(other);
+	}
+
+protected:
+	virtual void* doAllocate(size_t bytes, size_t alignment) = 0;
+	virtual void doDeallocate(void* p, size_t bytes, size_t alignment) = 0;
+	virtual bool doIsEqual(const MemoryResource& other) const
+	{
+		return false;
+	}
+};
+
+/*
+ * Resource which uses global operator new/delete
+ */
+CPPIO_API MemoryResource* newDeleteResource();
+
+/*
+ * Pool of power-of-two size classes (64 bytes to 1 MiB) with per-thread caches, so that frames don't go to
+ * malloc on every message. Block freed by thread other than one which allocated it is handed back to owner
+ * through lock-free list. Caches of exited threads are taken over by new threads. Bigger blocks and blocks
+ * with alignment above max_align_t are passed to newDeleteResource().
+ */
+CPPIO_API MemoryResource* bufferPoolResource();
+
+/*
+ * Resource used by frames and messages which are created without explicit one, bufferPoolResource()
+ * by default. setDefaultResource() returns previous resource; nullptr restores bufferPoolResource().
+ * Resource should outlive every frame which was allocated from it.
+ */
+CPPIO_API MemoryResource* defaultResource();
+CPPIO_API MemoryResource* setDefaultResource(MemoryResource* resource);
+
+/*
+ * Arena which hands out memory sequentially and frees it all at once, on release() or destruction.
+ * deallocate() does nothing. Not thread safe.
+ */
+class CPPIO_API MonotonicBufferResource : public MemoryResource
+{
+public:
+	MonotonicBufferResource(size_t initialSize = 4096, MemoryResource* upstream = nullptr);
+
+	/*
+	 * Uses caller's buffer first, then continues with chunks from upstream
+	 */
+	MonotonicBufferResource(void* buffer, size_t size, MemoryResource* upstream = nullptr);
+	virtual ~MonotonicBufferResource();
+
+	MonotonicBufferResource(const MonotonicBufferResource&) = delete;
+	MonotonicBufferResource& operator=(const MonotonicBufferResource&) = delete;
+
+	void release();
+
+protected:
+	virtual void* doAllocate(size_t bytes, size_t alignment);
+	virtual void doDeallocate(void* p, size_t bytes, size_t alignment);
+
+private:
+	struct Chunk
+	{
+		void* data;
+		size_t size;
+	};
+
+	MemoryResource* m_upstream;
+	std::vector<Chunk> m_chunks;
+	char* m_initialBuffer;
+	size_t m_initialSize;
+	char* m_current;
+	size_t m_left;
+	size_t m_nextChunkSize;
+};
+
+#ifdef CPPIO_HAS_PMR
+/*
+ * Lets std::pmr resources be used where cppio expects MemoryResource
+ */
+class PmrResourceAdapter : public MemoryResource
+{
+public:
+	PmrResourceAdapter(std::pmr::memory_resource* resource) : m_resource(resource) {}
+
+	std::pmr::memory_resource* resource() const { return m_resource; }
+
+protected:
+	virtual void* doAllocate(size_t bytes, size_t alignment)
+	{
+		return m_resource->allocate(bytes, alignment);
+	}
+
+	virtual void doDeallocate(void* p, size_t bytes, size_t alignment)
+	{
+		m_resource->deallocate(p, bytes, alignment);
+	}
+
+	virtual bool doIsEqual(const MemoryResource& other) const
+	{
+		auto adapter = dynamic_cast<const PmrResourceAdapter*>(&other);
+		return adapter && m_resource->is_equal(*adapter->m_resource);
+	}
+
+private:
+	std::pmr::memory_resource* m_resource;
+};
+#endif
+
+/*
+ * Standard allocator over MemoryResource. Like std::pmr::polymorphic_allocator, it doesn't propagate on
+ * container assignment, and copies of containers get default resource.
+ */
+template <typename T>
+class ResourceAllocator
+{
+public:
+	typedef T value_type;
+
+	ResourceAllocator() : m_resource(defaultResource()) {}
+	ResourceAllocator(MemoryResource* resource) : m_resource(resource ? resource : defaultResource()) {}
+
+	template <typename U>
+	ResourceAllocator(const ResourceAllocator<U>& other) : m_resource(other.resource()) {}
+
+	T* allocate(size_t n)
+	{
+		return static_cast<T*>(m_resource->allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T* p, size_t n)
+	{
+		m_resource->deallocate(p, n * sizeof(T), alignof(T));
+	}
+
+	ResourceAllocator select_on_container_copy_construction() const
+	{
+		return ResourceAllocator();
+	}
+
+	MemoryResource* resource() const { return m_resource; }
+
+private:
+	MemoryResource* m_resource;
+};
+
+template <typename T, typename U>
+bool operator==(const ResourceAllocator<T>& a, const ResourceAllocator<U>& b)
+{
+	return a.resource()->isEqual(*b.resource());
+}
+
+template <typename T, typename U>
+bool operator!=(const ResourceAllocator<T>& a, const ResourceAllocator<U>& b)
+{
+	return !(a == b);
+}
+
+}
+
+#endif /* ifndef MEMORYRESOURCE_H */
@@ -3,32 +3,106 @@
 #define MESSAGE_H
 
 #include "visibility.h"
+#include "memoryresource.h"
+#include "frametraits.h"
+#include "arrayview.h"
 
 #include <cstddef>
 #include <vector>
 #include <cstdint>
+#include <sys/types.h>
 #include <memory>
+#include <utility>
+#include <string>
+#include <cstring>
 
 namespace cppio
 {
 
+/*
+ * Frames allocate payloads which don't fit inline from memory resource (defaultResource() unless given).
+ * Copy of frame allocates from defaultResource(), moved frame keeps resource of its source.
+ */
 class CPPIO_API Frame
 {
 public:
-	Frame();
-	Frame(const void* data, size_t len);
+	explicit Frame(MemoryResource* resource = nullptr);
+	Frame(const void* data, size_t len, MemoryResource* resource = nullptr);
+
+	/*
+	 * Takes vector's storage as is
+	 */
 	Frame(std::vector<char>&& data);
-	Frame(const Frame& other) = default;
-	Frame(Frame&& other) = default;
-	Frame& operator=(const Frame& other) = default;
-	Frame& operator=(Frame&& other) = default;
+	Frame(const Frame& other);
+	Frame(Frame&& other) noexcept;
+	Frame& operator=(const Frame& other);
+	Frame& operator=(Frame&& other) noexcept;
+	~Frame();
+
+	/*
+	 * Payloads up to this size are stored in frame itself, bigger ones are allocated on heap
+	 */
+	static const size_t InlineCapacity = 32;
+
+	size_t size() const { return m_size; }
+
+	/*
+	 * Returns nullptr for file region frames: their contents are not in memory
+	 */
+	const void* data() const { return isFileRegion() ? nullptr : (isInline() ? m_inline : m_heap); }
+
+	MemoryResource* resource() const { return m_resource; }
+
+	/*
+	 * Frame which holds copy of array; see also Message::getArray()
+	 */
+	template <typename T>
+	static Frame fromArray(ArrayView<const T> values, MemoryResource* resource = nullptr)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only arrays of trivially copyable types can be stored");
+		Frame frame(resource);
+		if(!values.empty())
+			memcpy(frame.resize(values.sizeInBytes(), alignof(T)), values.data(), values.sizeInBytes());
+		return frame;
+	}
 
-	size_t size() const { return m_data.size(); }
-	const void* data() const { return m_data.data(); }
+	template <typename T>
+	static Frame fromArray(const std::vector<T>& values, MemoryResource* resource = nullptr)
+	{
+		return fromArray(ArrayView<const T>(values), resource);
+	}
+
+	template <typename T>
+	static Frame fromArray(const T* values, size_t count, MemoryResource* resource = nullptr)
+	{
+		return fromArray(ArrayView<const T>(values, count), resource);
+	}
+
+	bool isFileRegion() const { return m_fd >= 0; }
+	bool isDescriptor() const { return m_descriptor != nullptr; }
+	int descriptor() const { return m_descriptor ? *m_descriptor : -1; }
+	int fileDescriptor() const { return m_fd; }
+	uint64_t fileOffset() const { return m_fileOffset; }
+
+	/*
+	 * Makes frame an in-memory frame of given size and returns pointer to its payload, aligned at least to
+	 * given power of two. Heap storage of frame is reused if it is big enough.
+	 */
+	void* resize(size_t len, size_t alignment = 1);
+	void assign(const void* data, size_t len);
+
+	/*
+	 * Copies frame contents to buffer, reading file region if needed
+	 */
+	void copyTo(void* buffer) const;
 
 	inline bool operator==(const Frame& other) const
 	{
-		return m_data == other.m_data;
+		if(isDescriptor() || other.isDescriptor())
+			return descriptor() == other.descriptor();
+		if(isFileRegion() || other.isFileRegion())
+			return m_fd == other.m_fd && m_fileOffset == other.m_fileOffset && m_size == other.m_size;
+		return m_size == other.m_size && memcmp(data(), other.data(), m_size) == 0;
 	}
 
 	static Frame fromValue(uint8_t value);
@@ -36,14 +110,53 @@ public:
 	static Frame fromValue(uint32_t value);
 	static Frame fromValue(const std::string& value);
 
+	/*
+	 * Frame which references (offset, length) region of file. Descriptor is not owned and should stay open
+	 * until message is sent. Stream lines get it through IoLine::sendFileRegion(), so socket lines transmit it
+	 * with sendfile(); lines which preserve message boundaries read it into memory.
+	 */
+	static Frame fromFile(int fd, uint64_t offset, size_t length);
+
+	/*
+	 * Frame which carries descriptor itself (e.g. sealed memfd with bulk payload). fromDescriptor() duplicates fd,
+	 * adoptDescriptor() takes ownership of it; descriptor is closed with the last copy of frame.
+	 * Such frames have no data and can only be sent over local socket lines, where peer receives its own
+	 * descriptor to the same file.
+	 */
+	static Frame fromDescriptor(int fd);
+	static Frame adoptDescriptor(int fd);
+
 private:
-	std::vector<char> m_data;
+	bool isInline() const { return m_heap == nullptr; }
+	char* reserveHeap(size_t len, size_t alignment);
+	void releaseHeap();
+
+	// Payload size, or region length for file region frames
+	size_t m_size;
+	alignas(uint64_t) char m_inline[InlineCapacity];
+
+	// Payload which doesn't fit inline (or needs stricter alignment): block of m_capacity bytes from m_resource,
+	// or, if m_capacity is 0, storage of adopted vector. Kept for reuse when frame is resized to smaller size.
+	MemoryResource* m_resource;
+	char* m_heap;
+	size_t m_capacity;
+	size_t m_alignment;
+	std::vector<char> m_adopted;
+
+	int m_fd;
+	uint64_t m_fileOffset;
+
+	std::shared_ptr<const int> m_descriptor;
 };
 
+/*
+ * Frame table of message is allocated from given resource, as well as frames created by message itself
+ * (see resize() and MessageProtocol::readMessageInto())
+ */
 class CPPIO_API Message
 {
 public:
-	Message();
+	explicit Message(MemoryResource* resource = nullptr);
 	Message(const Message& other) = default;
 	Message(Message&& other) = default;
 	Message& operator=(const Message& other) = default;
@@ -52,11 +165,22 @@ public:
 
 	void clear();
 
-	static Message readMessage(const void* buffer, size_t bufferLength);
+	static Message readMessage(const void* buffer, size_t bufferLength, MemoryResource* resource = nullptr);
 
 	void addFrame(const Frame& frame);
 	void addFrame(Frame&& frame);
 
+	template <typename... Args>
+	void emplaceFrame(Args&&... args)
+	{
+		m_frames.emplace_back(std::forward<Args>(args)...);
+	}
+
+	void reserve(size_t frames);
+	void resize(size_t frames);
+
+	MemoryResource* resource() const { return m_frames.get_allocator().resource(); }
+
 	size_t size() const { return m_frames.size(); }
 	Frame& frame(size_t index) { return m_frames[index]; }
 	const Frame& frame(size_t index) const { return m_frames[index]; }
@@ -64,13 +188,180 @@ public:
 	size_t messageSize() const;
 	void writeMessage(void* buffer) const;
 
+	/*
+	 * Appends one frame per value, encoded as described in FrameTraits
+	 */
+	template <typename... Ts>
+	Message& pack(const Ts&... values)
+	{
+		m_frames.reserve(m_frames.size() + sizeof...(Ts));
+		int expand[] = { 0, (packFrame(values), 0)... };
+		(void)expand;
+		return *this;
+	}
+
+	/*
+	 * Decodes sizeof...(Ts) frames starting from firstFrame. Throws std::out_of_range if there are not enough
+	 * frames, std::length_error if size of frame doesn't match fixed-size type.
+	 */
+	template <typename... Ts>
+	std::tuple<Ts...> unpack(size_t firstFrame = 0) const
+	{
+		return detail::unpackFrames<Ts...>(*this, firstFrame);
+	}
+
 	template <typename T>
 	Message& operator<<(const T& value)
 	{
-		addFrame(Frame::fromValue(value));
+		return pack(value);
+	}
+
+	/*
+	 * Views frame payload as array without copying; see detail::arrayOf() for thrown errors
+	 */
+	template <typename T>
+	ArrayView<const T> getArray(size_t frameNumber) const
+	{
+		return detail::arrayOf<T>(frame(frameNumber).data(), frame(frameNumber).size());
+	}
+
+	void get(uint8_t& value, size_t frameNumber) const;
+	void get(uint16_t& value, size_t frameNumber) const;
+	void get(uint32_t& value, size_t frameNumber) const;
+	void get(std::string& value, size_t frameNumber) const;
+
+	template <typename T>
+	T get(size_t frameNumber) const
+	{
+		T t;
+		get(t, frameNumber);
+		return t;
+	}
+
+private:
+	template <typename T>
+	void packFrame(const T& value)
+	{
+		m_frames.emplace_back(resource());
+		FrameTraits<T>::encode(value, m_frames.back().resize(FrameTraits<T>::size(value)));
+	}
+
+	std::vector<Frame, ResourceAllocator<Frame>> m_frames;
+};
+
+/*
+ * Keeps released messages with their frames, so that receive loop can reuse them with
+ * MessageProtocol::readMessageInto() instead of allocating. Safe to use from several threads.
+ */
+class CPPIO_API MessagePool
+{
+public:
+	MessagePool(size_t maxMessages = 64);
+	virtual ~MessagePool();
+
+	/*
+	 * Returns recycled message, which still has frames of its previous contents, or new empty message
+	 */
+	Message acquire();
+	void release(Message&& message);
+
+	size_t size() const;
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> m_impl;
+};
+
+/*
+ * Non-owning reference to frame payload stored elsewhere
+ */
+class CPPIO_API FrameView
+{
+public:
+	FrameView() : m_data(nullptr), m_size(0) {}
+	FrameView(const void* data, size_t size) : m_data(data), m_size(size) {}
+
+	size_t size() const { return m_size; }
+	const void* data() const { return m_data; }
+
+	Frame toFrame() const { return Frame(m_data, m_size); }
+
+	inline bool operator==(const FrameView& other) const
+	{
+		return m_size == other.m_size && memcmp(m_data, other.m_data, m_size) == 0;
+	}
+
+private:
+	const void* m_data;
+	size_t m_size;
+};
+
+/*
+ * Message which keeps all frames in one buffer, already in wire format. Building, copying and sending it
+ * doesn't allocate per frame. Frames are views into that buffer and are invalidated by addFrame().
+ * File regions are read into buffer, descriptor frames are not supported.
+ */
+class CPPIO_API CompactMessage
+{
+public:
+	explicit CompactMessage(MemoryResource* resource = nullptr);
+	explicit CompactMessage(const Message& message, MemoryResource* resource = nullptr);
+
+	void clear();
+	void reserve(size_t frames, size_t bytes);
+
+	static CompactMessage readMessage(const void* buffer, size_t bufferLength, MemoryResource* resource = nullptr);
+
+	void addFrame(const void* data, size_t len);
+	void addFrame(const Frame& frame);
+
+	/*
+	 * Appends frame of given length and returns pointer to its payload, so that it can be filled in place.
+	 * Pointer is valid until next frame is appended.
+	 */
+	void* appendFrame(size_t len);
+
+	size_t size() const { return m_offsets.size(); }
+	FrameView frame(size_t index) const;
+
+	/*
+	 * Wire encoding of message, same as produced by Message::writeMessage()
+	 */
+	const void* data() const { return m_buffer.data(); }
+	size_t messageSize() const { return m_buffer.size(); }
+	void writeMessage(void* buffer) const;
+
+	Message toMessage(MemoryResource* resource = nullptr) const;
+
+	/*
+	 * Appends one frame per value; buffer is grown once, by size computed for all values
+	 */
+	template <typename... Ts>
+	CompactMessage& pack(const Ts&... values)
+	{
+		size_t variableSizes[] = { 0, detail::variablePayloadSize(values)... };
+		size_t bytes = messageSize() + detail::FixedPayloadSize<Ts...>::value + 4 * sizeof...(Ts);
+		for(size_t variableSize : variableSizes)
+			bytes += variableSize;
+		reserve(size() + sizeof...(Ts), bytes);
+
+		int expand[] = { 0, (FrameTraits<Ts>::encode(values, appendFrame(FrameTraits<Ts>::size(values))), 0)... };
+		(void)expand;
 		return *this;
 	}
 
+	template <typename... Ts>
+	std::tuple<Ts...> unpack(size_t firstFrame = 0) const
+	{
+		return detail::unpackFrames<Ts...>(*this, firstFrame);
+	}
+
+	template <typename T>
+	CompactMessage& operator<<(const T& value)
+	{
+		return pack(value);
+	}
+
 	void get(uint8_t& value, size_t frameNumber) const;
 	void get(uint16_t& value, size_t frameNumber) const;
 	void get(uint32_t& value, size_t frameNumber) const;
@@ -85,7 +376,174 @@ public:
 	}
 
 private:
-	std::vector<Frame> m_frames;
+	// Frame count, then length and data of each frame
+	std::vector<char, ResourceAllocator<char>> m_buffer;
+	// Offsets of frame data in m_buffer
+	std::vector<size_t, ResourceAllocator<size_t>> m_offsets;
+};
+
+/*
+ * Builds outgoing messages directly in wire format. Values are written to message buffer without
+ * intermediate frames; clear() keeps buffer capacity, so that builder reused for every message stops
+ * allocating once buffer has grown to typical message size.
+ */
+class CPPIO_API MessageBuilder
+{
+public:
+	MessageBuilder(size_t frames = 0, size_t bytes = 0, MemoryResource* resource = nullptr);
+
+	void clear() { m_message.clear(); }
+
+	MessageBuilder& addFrame(const void* data, size_t len)
+	{
+		m_message.addFrame(data, len);
+		return *this;
+	}
+
+	void* appendFrame(size_t len) { return m_message.appendFrame(len); }
+
+	template <typename... Ts>
+	MessageBuilder& pack(const Ts&... values)
+	{
+		m_message.pack(values...);
+		return *this;
+	}
+
+	MessageBuilder& operator<<(uint8_t value) { return addFrame(&value, sizeof(value)); }
+	MessageBuilder& operator<<(uint16_t value) { return addFrame(&value, sizeof(value)); }
+	MessageBuilder& operator<<(uint32_t value) { return addFrame(&value, sizeof(value)); }
+	MessageBuilder& operator<<(const std::string& value) { return addFrame(value.data(), value.size()); }
+	MessageBuilder& operator<<(const Frame& frame)
+	{
+		m_message.addFrame(frame);
+		return *this;
+	}
+
+	size_t size() const { return m_message.size(); }
+
+	/*
+	 * Built message, to be passed to MessageProtocol::sendMessage()
+	 */
+	const CompactMessage& message() const { return m_message; }
+
+private:
+	CompactMessage m_message;
+};
+
+/*
+ * Layout of messages on the wire. Lengths and counts are in host byte order.
+ */
+enum class WireFormat : int
+{
+	// u32 frame count, then u32 length and payload of every frame
+	V1 = 1,
+	// u32 length of the rest of message, varint (LEB128) frame count, then varint length and payload of every
+	// frame. Small frames take one byte of header instead of four, and receiver knows size of message up front.
+	V2 = 2
+};
+
+/*
+ * Immutable message for sending the same contents to many lines. Wire encoding is built once, on construction;
+ * copies share it, and MessageProtocol sends it with IoLine::writeShared() without further copying.
+ * Encoding in WireFormat::V2 is built on first send to line which uses it and is shared the same way.
+ * Safe to send from several threads at once. File regions are read into buffer, descriptor frames are
+ * not supported.
+ */
+class CPPIO_API SharedMessage
+{
+public:
+	SharedMessage();
+	explicit SharedMessage(const Message& message);
+	explicit SharedMessage(const CompactMessage& message);
+
+	size_t size() const { return m_offsets->size(); }
+	FrameView frame(size_t index) const;
+
+	const void* data() const { return m_buffer->data(); }
+	size_t messageSize() const { return m_buffer->size(); }
+	const std::shared_ptr<const std::vector<char>>& buffer() const { return m_buffer; }
+
+	/*
+	 * Message serialized in given format, buffer() for WireFormat::V1. Returns nullptr if message doesn't fit
+	 * in format. If checksum is given, it is set to CRC-32C of returned buffer, computed once per format.
+	 */
+	std::shared_ptr<const std::vector<char>> buffer(WireFormat format, uint32_t* checksum = nullptr) const;
+
+	Message toMessage(MemoryResource* resource = nullptr) const;
+
+	template <typename... Ts>
+	std::tuple<Ts...> unpack(size_t firstFrame = 0) const
+	{
+		return detail::unpackFrames<Ts...>(*this, firstFrame);
+	}
+
+private:
+	struct Encodings;
+
+	std::shared_ptr<const std::vector<char>> m_buffer;
+	std::shared_ptr<const std::vector<size_t>> m_offsets;
+	std::shared_ptr<Encodings> m_encodings;
+};
+
+/*
+ * Frames of wire-format message, referenced in place. Buffer is validated once, when view is set up;
+ * std::length_error is thrown if it is truncated. Frame views are valid while buffer is: caller's buffer
+ * for view over raw memory, or, for buffer passed as shared pointer, as long as any copy of view exists.
+ */
+class CPPIO_API MessageView
+{
+public:
+	MessageView();
+	MessageView(const void* buffer, size_t bufferLength);
+	MessageView(const std::shared_ptr<const std::vector<char>>& buffer, size_t bufferLength);
+
+	void reset(const void* buffer, size_t bufferLength, WireFormat format = WireFormat::V1);
+	void reset(const std::shared_ptr<const std::vector<char>>& buffer, size_t bufferLength,
+			WireFormat format = WireFormat::V1);
+	void clear();
+
+	size_t size() const { return m_frames.size(); }
+	const FrameView& frame(size_t index) const { return m_frames[index]; }
+
+	const void* data() const { return m_buffer; }
+	size_t messageSize() const { return m_length; }
+
+	Message toMessage(MemoryResource* resource = nullptr) const;
+
+	template <typename... Ts>
+	std::tuple<Ts...> unpack(size_t firstFrame = 0) const
+	{
+		return detail::unpackFrames<Ts...>(*this, firstFrame);
+	}
+
+	/*
+	 * Frames in wire buffer are only 1-byte aligned, so this throws std::invalid_argument unless frame happens
+	 * to be aligned for T
+	 */
+	template <typename T>
+	ArrayView<const T> getArray(size_t frameNumber) const
+	{
+		return detail::arrayOf<T>(frame(frameNumber).data(), frame(frameNumber).size());
+	}
+
+	void get(uint8_t& value, size_t frameNumber) const;
+	void get(uint16_t& value, size_t frameNumber) const;
+	void get(uint32_t& value, size_t frameNumber) const;
+	void get(std::string& value, size_t frameNumber) const;
+
+	template <typename T>
+	T get(size_t frameNumber) const
+	{
+		T t;
+		get(t, frameNumber);
+		return t;
+	}
+
+private:
+	const char* m_buffer;
+	size_t m_length;
+	std::shared_ptr<const std::vector<char>> m_storage;
+	std::vector<FrameView> m_frames;
 };
 
 class CPPIO_API IoLine;
@@ -97,7 +555,50 @@ public:
 	virtual ~MessageProtocol();
 
 	ssize_t readMessage(Message& m);
+
+	/*
+	 * Same as readMessage(), but m may be non-empty: its frames are reused for incoming message, so that
+	 * receiving messages of the same shape doesn't allocate
+	 */
+	ssize_t readMessageInto(Message& m);
+
+	/*
+	 * Payloads of frames received by readMessage() and readMessageInto() are placed at given alignment
+	 * (power of two, e.g. 64 for SIMD processing of arrays). Default is 1, which lets small frames stay inline.
+	 */
+	void setFrameAlignment(size_t alignment);
+
+	/*
+	 * Format of sent and expected messages, WireFormat::V1 by default. Both peers should use the same format:
+	 * either set it on both sides, or call negotiateWireFormat() on both sides right after connecting.
+	 */
+	void setWireFormat(WireFormat format);
+	WireFormat wireFormat() const;
+
+	/*
+	 * Exchanges handshake with peer and switches to newest format which both sides support, but not newer
+	 * than preferred. Returns 1 on success, or error code; eUnknown if peer sent something else than handshake.
+	 */
+	ssize_t negotiateWireFormat(WireFormat preferred = WireFormat::V2);
+
+	/*
+	 * When enabled, every message is followed by its CRC-32C, which is computed while message is serialized
+	 * or parsed. Reads return eChecksumMismatch if it doesn't match; contents of message are unspecified then,
+	 * but next message can be read. Both peers should enable it. File region frames are sent from memory
+	 * instead of with sendfile(), since they have to be read to compute checksum.
+	 */
+	void setChecksums(bool enabled);
+	bool checksums() const;
+
+	/*
+	 * Reads message into buffer held by protocol, without copying frames out of it. Buffer is reused for next
+	 * message unless some copy of view still references it. Views can't carry descriptors: message with
+	 * descriptor frames is read to the end and dropped, received descriptors are closed and eUnknown is returned.
+	 */
+	ssize_t readMessageView(MessageView& view);
 	ssize_t sendMessage(const Message& m);
+	ssize_t sendMessage(const CompactMessage& m);
+	ssize_t sendMessage(const SharedMessage& m);
 
 	IoLine* getLine() const;
 
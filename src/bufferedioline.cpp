@@ -0,0 +1,324 @@
+
+#include "cppio/bufferedioline.h"
+
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#ifdef __MINGW32__
+#ifndef _GLIBCXX_HAS_GTHREADS
+#include "mingw.thread.h"
+#include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
+#endif
+#endif
+#include <condition_variable>
+
+namespace cppio
+{
+
+struct BufferedIoLine::Impl
+{
+	std::unique_ptr<IoLine> line;
+	size_t writeBufferSize;
+	std::chrono::milliseconds maxLatency;
+
+	// Lock order: flushMutex, then mutex. flushMutex serializes writes to underlying line, mutex guards
+	// write buffer, so that new data can be buffered while previous buffer is being sent.
+	std::mutex flushMutex;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::vector<char> writeBuffer;
+	std::vector<char> flushBuffer;
+	std::chrono::steady_clock::time_point firstBuffered;
+	ssize_t writeError;
+	bool stop;
+	std::thread flusher;
+
+	std::vector<char> readBuffer;
+	size_t readOffset;
+	size_t readSize;
+
+	ssize_t takeWriteError();
+	ssize_t writeAll(const char* data, size_t length);
+	ssize_t flushBuffered();
+	void runFlusher();
+};
+
+/*
+ * Error of write which was done in background, reported once. Called with mutex held.
+ */
+ssize_t BufferedIoLine::Impl::takeWriteError()
+{
+	ssize_t rc = writeError;
+	writeError = 0;
+	return rc;
+}
+
+/*
+ * Called with flushMutex held
+ */
+ssize_t BufferedIoLine::Impl::writeAll(const char* data, size_t length)
+{
+	size_t done = 0;
+	while(done < length)
+	{
+		ssize_t rc = line->write(const_cast<char*>(data) + done, length - done);
+		if(rc < 0)
+			return rc;
+		done += rc;
+	}
+	return done;
+}
+
+/*
+ * Called with flushMutex held
+ */
+ssize_t BufferedIoLine::Impl::flushBuffered()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::swap(writeBuffer, flushBuffer);
+	}
+
+	if(flushBuffer.empty())
+		return 0;
+
+	ssize_t rc = writeAll(flushBuffer.data(), flushBuffer.size());
+	flushBuffer.clear();
+	if(rc < 0)
+		return rc;
+	return 0;
+}
+
+void BufferedIoLine::Impl::runFlusher()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while(!stop)
+	{
+		if(writeBuffer.empty())
+		{
+			condition.wait(lock);
+			continue;
+		}
+
+		auto deadline = firstBuffered + maxLatency;
+		if(std::chrono::steady_clock::now() < deadline)
+		{
+			condition.wait_until(lock, deadline);
+			continue;
+		}
+
+		lock.unlock();
+		{
+			std::lock_guard<std::mutex> flushLock(flushMutex);
+			ssize_t rc = flushBuffered();
+			if(rc < 0)
+			{
+				std::lock_guard<std::mutex> errorLock(mutex);
+				writeError = rc;
+			}
+		}
+		lock.lock();
+	}
+}
+
+BufferedIoLine::BufferedIoLine(std::unique_ptr<IoLine> line, size_t writeBufferSize, size_t readBufferSize,
+		int maxLatencyInMs) : m_impl(new Impl)
+{
+	if(line->preservesBoundaries())
+		throw IoException("BufferedIoLine requires stream line");
+
+	m_impl->line = std::move(line);
+	m_impl->writeBufferSize = writeBufferSize;
+	m_impl->maxLatency = std::chrono::milliseconds(maxLatencyInMs);
+	m_impl->writeBuffer.reserve(writeBufferSize);
+	m_impl->flushBuffer.reserve(writeBufferSize);
+	m_impl->writeError = 0;
+	m_impl->stop = false;
+	m_impl->readBuffer.resize(readBufferSize);
+	m_impl->readOffset = 0;
+	m_impl->readSize = 0;
+
+	if(maxLatencyInMs > 0)
+		m_impl->flusher = std::thread(&Impl::runFlusher, m_impl.get());
+}
+
+BufferedIoLine::~BufferedIoLine()
+{
+	if(m_impl->flusher.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_impl->mutex);
+			m_impl->stop = true;
+		}
+		m_impl->condition.notify_one();
+		m_impl->flusher.join();
+	}
+
+	std::lock_guard<std::mutex> flushLock(m_impl->flushMutex);
+	m_impl->flushBuffered();
+}
+
+ssize_t BufferedIoLine::read(void* buffer, size_t buflen)
+{
+	if(m_impl->readOffset == m_impl->readSize)
+	{
+		// Nothing to gain from buffering reads which are as big as buffer
+		if(buflen >= m_impl->readBuffer.size())
+			return m_impl->line->read(buffer, buflen);
+
+		ssize_t rc = m_impl->line->read(m_impl->readBuffer.data(), m_impl->readBuffer.size());
+		if(rc <= 0)
+			return rc;
+		m_impl->readOffset = 0;
+		m_impl->readSize = rc;
+	}
+
+	size_t length = std::min(buflen, m_impl->readSize - m_impl->readOffset);
+	memcpy(buffer, m_impl->readBuffer.data() + m_impl->readOffset, length);
+	m_impl->readOffset += length;
+	return length;
+}
+
+ssize_t BufferedIoLine::write(void* buffer, size_t buflen)
+{
+	if(buflen >= m_impl->writeBufferSize)
+	{
+		std::lock_guard<std::mutex> flushLock(m_impl->flushMutex);
+		{
+			std::lock_guard<std::mutex> lock(m_impl->mutex);
+			ssize_t rc = m_impl->takeWriteError();
+			if(rc < 0)
+				return rc;
+		}
+		ssize_t rc = m_impl->flushBuffered();
+		if(rc < 0)
+			return rc;
+		return m_impl->writeAll((const char*)buffer, buflen);
+	}
+
+	bool buffered = false;
+	while(true)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_impl->mutex);
+			ssize_t rc = m_impl->takeWriteError();
+			if(rc < 0)
+				return rc;
+
+			auto& writeBuffer = m_impl->writeBuffer;
+			if(!buffered && (writeBuffer.size() + buflen <= m_impl->writeBufferSize))
+			{
+				if(writeBuffer.empty())
+				{
+					m_impl->firstBuffered = std::chrono::steady_clock::now();
+					if(m_impl->flusher.joinable())
+						m_impl->condition.notify_one();
+				}
+				writeBuffer.insert(writeBuffer.end(), (const char*)buffer, (const char*)buffer + buflen);
+				if(writeBuffer.size() < m_impl->writeBufferSize)
+					return buflen;
+				buffered = true;
+			}
+		}
+
+		std::lock_guard<std::mutex> flushLock(m_impl->flushMutex);
+		ssize_t rc = m_impl->flushBuffered();
+		if(rc < 0)
+			return rc;
+		if(buffered)
+			return buflen;
+	}
+}
+
+ssize_t BufferedIoLine::writeShared(const std::shared_ptr<const std::vector<char>>& buffer, size_t offset, size_t buflen)
+{
+	if(buflen < m_impl->writeBufferSize)
+		return write(const_cast<char*>(buffer->data()) + offset, buflen);
+
+	// Big buffers are passed as is, so that wrapped line can still avoid copying them
+	std::lock_guard<std::mutex> flushLock(m_impl->flushMutex);
+	{
+		std::lock_guard<std::mutex> lock(m_impl->mutex);
+		ssize_t rc = m_impl->takeWriteError();
+		if(rc < 0)
+			return rc;
+	}
+	ssize_t rc = m_impl->flushBuffered();
+	if(rc < 0)
+		return rc;
+
+	size_t done = 0;
+	while(done < buflen)
+	{
+		rc = m_impl->line->writeShared(buffer, offset + done, buflen - done);
+		if(rc < 0)
+			return rc;
+		done += rc;
+	}
+	return done;
+}
+
+ssize_t BufferedIoLine::sendFileRegion(int fd, uint64_t offset, size_t length)
+{
+	std::lock_guard<std::mutex> flushLock(m_impl->flushMutex);
+	{
+		std::lock_guard<std::mutex> lock(m_impl->mutex);
+		ssize_t rc = m_impl->takeWriteError();
+		if(rc < 0)
+			return rc;
+	}
+	ssize_t rc = m_impl->flushBuffered();
+	if(rc < 0)
+		return rc;
+	return m_impl->line->sendFileRegion(fd, offset, length);
+}
+
+ssize_t BufferedIoLine::flush()
+{
+	std::lock_guard<std::mutex> flushLock(m_impl->flushMutex);
+	{
+		std::lock_guard<std::mutex> lock(m_impl->mutex);
+		ssize_t rc = m_impl->takeWriteError();
+		if(rc < 0)
+			return rc;
+	}
+	ssize_t rc = m_impl->flushBuffered();
+	if(rc < 0)
+		return rc;
+	return m_impl->line->flush();
+}
+
+void BufferedIoLine::setOption(LineOption option, void* data)
+{
+	m_impl->line->setOption(option, data);
+}
+
+void BufferedIoLine::getOption(LineOption option, void* data)
+{
+	m_impl->line->getOption(option, data);
+}
+
+bool BufferedIoLine::isConnected()
+{
+	return m_impl->line->isConnected();
+}
+
+void* BufferedIoLine::getNativeHandle()
+{
+	return m_impl->line->getNativeHandle();
+}
+
+size_t BufferedIoLine::bufferedReadSize() const
+{
+	return m_impl->readSize - m_impl->readOffset;
+}
+
+IoLine* BufferedIoLine::line() const
+{
+	return m_impl->line.get();
+}
+
+}
@@ -0,0 +1,272 @@
+
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CPPIO_CRC32C_HARDWARE 1
+#include <nmmintrin.h>
+#endif
+
+namespace cppio
+{
+
+// Reversed Castagnoli polynomial
+static const uint32_t gs_polynomial = 0x82f63b78;
+
+// crc32 instruction has latency of three cycles, but throughput of one per cycle, so hardware path runs
+// three independent checksums over adjacent blocks and then combines them with shift tables
+static const size_t gs_longBlock = 8192;
+static const size_t gs_shortBlock = 256;
+
+namespace
+{
+
+typedef uint32_t ShiftTable[4][256];
+
+struct Crc32cTables
+{
+	Crc32cTables();
+
+	// Slicing-by-8 tables: software[k] is checksum of byte followed by k zero bytes
+	uint32_t software[8][256];
+
+	// Operators which append block of zeros to checksum
+	ShiftTable longShift;
+	ShiftTable shortShift;
+
+	bool hardware;
+};
+
+/*
+ * Checksum operators are 32x32 matrices over GF(2), stored as columns
+ */
+static uint32_t matrixTimes(const uint32_t* matrix, uint32_t vector)
+{
+	uint32_t sum = 0;
+	while(vector)
+	{
+		if(vector & 1)
+			sum ^= *matrix;
+		vector >>= 1;
+		matrix++;
+	}
+	return sum;
+}
+
+static void matrixSquare(uint32_t* square, const uint32_t* matrix)
+{
+	for(int n = 0; n < 32; n++)
+		square[n] = matrixTimes(matrix, matrix[n]);
+}
+
+/*
+ * Builds table which appends length zero bytes to checksum; length should be power of two
+ */
+static void makeShiftTable(ShiftTable& table, size_t length)
+{
+	uint32_t even[32];
+	uint32_t odd[32];
+
+	// Operator for one zero bit
+	odd[0] = gs_polynomial;
+	uint32_t row = 1;
+	for(int n = 1; n < 32; n++)
+	{
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	// Squaring doubles number of zero bits: 2, 4, then one byte in even, two bytes in odd and so on
+	matrixSquare(even, odd);
+	matrixSquare(odd, even);
+	uint32_t* result = odd;
+	do
+	{
+		matrixSquare(even, odd);
+		result = even;
+		length >>= 1;
+		if(length == 0)
+			break;
+		matrixSquare(odd, even);
+		result = odd;
+		length >>= 1;
+	} while(length);
+
+	for(uint32_t n = 0; n < 256; n++)
+	{
+		table[0][n] = matrixTimes(result, n);
+		table[1][n] = matrixTimes(result, n << 8);
+		table[2][n] = matrixTimes(result, n << 16);
+		table[3][n] = matrixTimes(result, n << 24);
+	}
+}
+
+Crc32cTables::Crc32cTables()
+{
+	for(uint32_t n = 0; n < 256; n++)
+	{
+		uint32_t crc = n;
+		for(int bit = 0; bit < 8; bit++)
+			crc = (crc & 1) ? (crc >> 1) ^ gs_polynomial : crc >> 1;
+		software[0][n] = crc;
+	}
+	for(uint32_t n = 0; n < 256; n++)
+	{
+		for(int k = 1; k < 8; k++)
+			software[k][n] = (software[k - 1][n] >> 8) ^ software[0][software[k - 1][n] & 0xff];
+	}
+
+#ifdef CPPIO_CRC32C_HARDWARE
+	__builtin_cpu_init();
+	hardware = __builtin_cpu_supports("sse4.2");
+#else
+	hardware = false;
+#endif
+	if(hardware)
+	{
+		makeShiftTable(longShift, gs_longBlock);
+		makeShiftTable(shortShift, gs_shortBlock);
+	}
+}
+
+static const Crc32cTables& tables()
+{
+	static Crc32cTables instance;
+	return instance;
+}
+
+#ifdef CPPIO_CRC32C_HARDWARE
+static inline uint32_t shift(const ShiftTable& table, uint32_t crc)
+{
+	return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+template <bool Copy>
+__attribute__((target("sse4.2")))
+static inline uint64_t hardwareTriples(uint64_t crc0, char*& dst, const char*& src, size_t& length, size_t block,
+		const ShiftTable& table)
+{
+	while(length >= 3 * block)
+	{
+		uint64_t crc1 = 0;
+		uint64_t crc2 = 0;
+		const char* end = src + block;
+		do
+		{
+			uint64_t a, b, c;
+			memcpy(&a, src, 8);
+			memcpy(&b, src + block, 8);
+			memcpy(&c, src + 2 * block, 8);
+			if(Copy)
+			{
+				memcpy(dst, &a, 8);
+				memcpy(dst + block, &b, 8);
+				memcpy(dst + 2 * block, &c, 8);
+				dst += 8;
+			}
+			crc0 = _mm_crc32_u64(crc0, a);
+			crc1 = _mm_crc32_u64(crc1, b);
+			crc2 = _mm_crc32_u64(crc2, c);
+			src += 8;
+		} while(src < end);
+
+		crc0 = shift(table, crc0) ^ crc1;
+		crc0 = shift(table, crc0) ^ crc2;
+		src += 2 * block;
+		if(Copy)
+			dst += 2 * block;
+		length -= 3 * block;
+	}
+	return crc0;
+}
+
+template <bool Copy>
+__attribute__((target("sse4.2")))
+static uint32_t hardwareCrc(uint32_t crc, char* dst, const char* src, size_t length)
+{
+	const Crc32cTables& t = tables();
+	uint64_t crc0 = ~crc;
+
+	// Source is read in aligned 8-byte words
+	while((length > 0) && ((reinterpret_cast<uintptr_t>(src) & 7) != 0))
+	{
+		if(Copy)
+			*dst++ = *src;
+		crc0 = _mm_crc32_u8(crc0, *src++);
+		length--;
+	}
+
+	crc0 = hardwareTriples<Copy>(crc0, dst, src, length, gs_longBlock, t.longShift);
+	crc0 = hardwareTriples<Copy>(crc0, dst, src, length, gs_shortBlock, t.shortShift);
+
+	while(length >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, src, 8);
+		if(Copy)
+		{
+			memcpy(dst, &word, 8);
+			dst += 8;
+		}
+		crc0 = _mm_crc32_u64(crc0, word);
+		src += 8;
+		length -= 8;
+	}
+	while(length > 0)
+	{
+		if(Copy)
+			*dst++ = *src;
+		crc0 = _mm_crc32_u8(crc0, *src++);
+		length--;
+	}
+	return ~(uint32_t)crc0;
+}
+#endif
+
+}
+
+uint32_t crc32cSoftware(uint32_t crc, const void* data, size_t length)
+{
+	const Crc32cTables& t = tables();
+	const uint8_t* next = static_cast<const uint8_t*>(data);
+	crc = ~crc;
+	while(length >= 8)
+	{
+		crc ^= (uint32_t)next[0] | ((uint32_t)next[1] << 8) | ((uint32_t)next[2] << 16) | ((uint32_t)next[3] << 24);
+		crc = t.software[7][crc & 0xff] ^ t.software[6][(crc >> 8) & 0xff] ^
+			t.software[5][(crc >> 16) & 0xff] ^ t.software[4][crc >> 24] ^
+			t.software[3][next[4]] ^ t.software[2][next[5]] ^ t.software[1][next[6]] ^ t.software[0][next[7]];
+		next += 8;
+		length -= 8;
+	}
+	while(length > 0)
+	{
+		crc = (crc >> 8) ^ t.software[0][(crc ^ *next++) & 0xff];
+		length--;
+	}
+	return ~crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+#ifdef CPPIO_CRC32C_HARDWARE
+	if(tables().hardware)
+		return hardwareCrc<false>(crc, nullptr, static_cast<const char*>(data), length);
+#endif
+	return crc32cSoftware(crc, data, length);
+}
+
+uint32_t crc32cCopy(uint32_t crc, void* dst, const void* src, size_t length)
+{
+#ifdef CPPIO_CRC32C_HARDWARE
+	if(tables().hardware)
+		return hardwareCrc<true>(crc, static_cast<char*>(dst), static_cast<const char*>(src), length);
+#endif
+	if(length == 0)
+		return crc;
+	memcpy(dst, src, length);
+	return crc32cSoftware(crc, dst, length);
+}
+
+}
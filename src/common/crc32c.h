@@ -0,0 +1,29 @@
+
+#ifndef COMMON_CRC32C_H
+#define COMMON_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cppio
+{
+
+/*
+ * CRC-32C (Castagnoli polynomial, as in iSCSI and ext4). crc is value returned for preceding data, 0 at start,
+ * so that checksum of data can be computed piece by piece. Uses SSE4.2 crc32 instruction if CPU has it.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+/*
+ * Copies length bytes from src to dst and returns checksum of them, reading src only once
+ */
+uint32_t crc32cCopy(uint32_t crc, void* dst, const void* src, size_t length);
+
+/*
+ * Table-driven implementation, used when CPU doesn't support crc32 instruction
+ */
+uint32_t crc32cSoftware(uint32_t crc, const void* data, size_t length);
+
+}
+
+#endif /* ifndef COMMON_CRC32C_H */
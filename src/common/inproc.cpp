@@ -531,6 +531,12 @@ namespace cppio
 		}
 	}
 
+	bool InprocLine::isConnected()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_in && m_out && m_in->isConnected() && m_out->isConnected();
+	}
+
 	void InprocLine::waitForConnection()
 	{
 		std::unique_lock<std::mutex> lock(m_mutex);
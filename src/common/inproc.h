@@ -68,6 +68,7 @@ public:
 	size_t availableWriteSize() const;
 
 	void setConnectionFlag(bool c);
+	bool isConnected() const { return m_connected; }
 private:
 	RingBuffer m_buffer;
 
@@ -87,6 +88,7 @@ public:
 	virtual ssize_t read(void* buffer, size_t buflen) override;
 	virtual ssize_t write(void* buffer, size_t buflen) override;
 	virtual void setOption(LineOption option, void* data);
+	virtual bool isConnected() override;
 
 	std::string address() const { return m_address; }
 
@@ -0,0 +1,74 @@
+
+#include "lineoptions.h"
+
+#include <cstdlib>
+
+namespace cppio
+{
+
+static LineOption optionByName(const std::string& name)
+{
+	static const std::pair<const char*, LineOption> names[] = {
+		{ "receive_timeout", LineOption::ReceiveTimeout },
+		{ "send_timeout", LineOption::SendTimeout },
+		{ "nodelay", LineOption::NoDelay },
+		{ "sndbuf", LineOption::SendBufferSize },
+		{ "rcvbuf", LineOption::ReceiveBufferSize },
+		{ "quickack", LineOption::QuickAck },
+		{ "cork", LineOption::Cork },
+		{ "busy_poll", LineOption::BusyPoll },
+		{ "priority", LineOption::Priority },
+		{ "user_timeout", LineOption::UserTimeout },
+		{ "zerocopy", LineOption::ZeroCopyThreshold },
+		{ "send_batch", LineOption::SendBatch },
+		{ "recv_batch", LineOption::ReceiveBatch },
+		{ "sequence", LineOption::SequenceNumbers },
+		{ "multicast_ttl", LineOption::MulticastTtl },
+		{ "multicast_loop", LineOption::MulticastLoop },
+		{ "vmsplice", LineOption::VmspliceThreshold }
+	};
+
+	for(const auto& n : names)
+	{
+		if(name == n.first)
+			return n.second;
+	}
+	throw IoException("Unknown line option: " + name);
+}
+
+std::string splitLineOptions(const std::string& address, LineOptions& options)
+{
+	auto question = address.find('?');
+	if(question == std::string::npos)
+		return address;
+
+	size_t start = question + 1;
+	while(start < address.size())
+	{
+		auto end = address.find('&', start);
+		if(end == std::string::npos)
+			end = address.size();
+
+		auto pair = address.substr(start, end - start);
+		auto equals = pair.find('=');
+		if(!pair.empty())
+		{
+			auto name = pair.substr(0, equals);
+			int value = 1;
+			if(equals != std::string::npos)
+				value = atoi(pair.substr(equals + 1).c_str());
+			options.push_back(std::make_pair(optionByName(name), value));
+		}
+		start = end + 1;
+	}
+
+	return address.substr(0, question);
+}
+
+void applyLineOptions(IoLine* line, const LineOptions& options)
+{
+	for(auto option : options)
+		line->setOption(option.first, &option.second);
+}
+
+}
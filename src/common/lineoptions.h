@@ -0,0 +1,26 @@
+
+#ifndef COMMON_LINEOPTIONS_H
+#define COMMON_LINEOPTIONS_H
+
+#include "cppio/ioline.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace cppio
+{
+
+typedef std::vector<std::pair<LineOption, int>> LineOptions;
+
+/*
+ * Splits "host:port?nodelay=1&sndbuf=65536" into base address and list of options.
+ * Throws IoException on unknown option name.
+ */
+std::string splitLineOptions(const std::string& address, LineOptions& options);
+
+void applyLineOptions(IoLine* line, const LineOptions& options);
+
+}
+
+#endif /* ifndef COMMON_LINEOPTIONS_H */
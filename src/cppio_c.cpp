@@ -4,6 +4,8 @@
 #include "cppio/ioline.h"
 #include "cppio/message.h"
 
+#include <algorithm>
+
 using namespace cppio;
 extern "C"
 {
@@ -25,11 +27,57 @@ extern "C"
 		}
 	}
 
+	CPPIO_API cppio_ioline cppio_create_client_with_timeout(cppio_iolinemanager manager, const char* address, int timeout)
+	{
+		try
+		{
+			auto man = static_cast<IoLineManager*>(manager);
+			return man->createClient(std::string(address), timeout);
+		}
+		catch(const IoException& e)
+		{
+			return nullptr;
+		}
+	}
+
+	CPPIO_API void cppio_create_clients(cppio_iolinemanager manager, const char** addresses, cppio_ioline* lines, size_t count, int timeout)
+	{
+		std::fill(lines, lines + count, nullptr);
+		try
+		{
+			auto man = static_cast<IoLineManager*>(manager);
+			auto created = man->createClients(std::vector<std::string>(addresses, addresses + count), timeout);
+			std::copy(created.begin(), created.end(), lines);
+		}
+		catch(const IoException& e)
+		{
+		}
+	}
+
 	CPPIO_API void cppio_destroy_line(cppio_ioline line)
 	{
 		delete static_cast<IoLine*>(line);
 	}
 
+	CPPIO_API cppio_ioline cppio_lease_client(cppio_iolinemanager manager, const char* address, int timeout)
+	{
+		try
+		{
+			auto man = static_cast<IoLineManager*>(manager);
+			return man->leaseClient(std::string(address), timeout);
+		}
+		catch(const IoException& e)
+		{
+			return nullptr;
+		}
+	}
+
+	CPPIO_API void cppio_release_client(cppio_iolinemanager manager, cppio_ioline line, int reusable)
+	{
+		auto man = static_cast<IoLineManager*>(manager);
+		man->releaseClient(static_cast<IoLine*>(line), reusable != 0);
+	}
+
 	CPPIO_API cppio_ioacceptor cppio_create_server(cppio_iolinemanager manager, const char* address)
 	{
 		try
@@ -54,6 +102,21 @@ extern "C"
 		return a->waitConnection(timeout);
 	}
 
+	size_t cppio_acceptor_wait_connections(cppio_ioacceptor acceptor, cppio_ioline* lines, size_t max_lines, int timeout)
+	{
+		try
+		{
+			auto a = static_cast<IoAcceptor*>(acceptor);
+			auto accepted = a->waitConnections(max_lines, timeout);
+			std::copy(accepted.begin(), accepted.end(), lines);
+			return accepted.size();
+		}
+		catch(const IoException& e)
+		{
+			return 0;
+		}
+	}
+
 	ssize_t cppio_line_read(cppio_ioline line, char* buffer, size_t buffer_length)
 	{
 		auto l = static_cast<IoLine*>(line);
@@ -67,10 +130,37 @@ extern "C"
 	}
 
 	int cppio_line_set_option(cppio_ioline line, cppio_line_option option, void* data)
+	{
+		try
+		{
+			auto l = static_cast<IoLine*>(line);
+			l->setOption((LineOption)option, data);
+			return 0;
+		}
+		catch(const IoException& e)
+		{
+			return -1;
+		}
+	}
+
+	int cppio_line_get_option(cppio_ioline line, cppio_line_option option, void* data)
+	{
+		try
+		{
+			auto l = static_cast<IoLine*>(line);
+			l->getOption((LineOption)option, data);
+			return 0;
+		}
+		catch(const IoException& e)
+		{
+			return -1;
+		}
+	}
+
+	ssize_t cppio_line_flush(cppio_ioline line)
 	{
 		auto l = static_cast<IoLine*>(line);
-		l->setOption((LineOption)option, data);
-		return 0;
+		return l->flush();
 	}
 
 	cppio_message cppio_create_message()
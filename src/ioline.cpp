@@ -0,0 +1,72 @@
+
+#include "cppio/ioline.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace cppio
+{
+
+static const size_t gs_fileChunkSize = 65536;
+
+ssize_t IoLine::writeGathered(const IoVec* parts, size_t count)
+{
+	ssize_t total = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(parts[i].length == 0)
+			continue;
+		ssize_t rc = write(const_cast<void*>(parts[i].data), parts[i].length);
+		if(rc < 0)
+			return (total > 0) ? total : rc;
+		total += rc;
+		if((size_t)rc < parts[i].length)
+			break;
+	}
+	return total;
+}
+
+ssize_t IoLine::sendFileRegion(int fd, uint64_t offset, size_t length)
+{
+#ifdef _WIN32
+	throw IoException("File region frames are not supported");
+#else
+	std::vector<char> buffer(std::min(length, gs_fileChunkSize));
+	size_t maxWrite = buffer.size();
+	size_t done = 0;
+	while(done < length)
+	{
+		ssize_t rc = pread(fd, buffer.data(), std::min(buffer.size(), length - done), offset + done);
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc <= 0)
+			throw IoException("Unable to read file region: " + std::to_string(errno));
+
+		size_t chunk = rc;
+		size_t written = 0;
+		while(written < chunk)
+		{
+			ssize_t wrc = write(buffer.data() + written, std::min(maxWrite, chunk - written));
+			if((wrc == eTooBigBuffer) && (maxWrite > 1))
+			{
+				// Line can't accept that much at once (e.g. inproc queue), retry with smaller pieces
+				maxWrite /= 2;
+				continue;
+			}
+			if(wrc < 0)
+				return wrc;
+			written += wrc;
+		}
+		done += chunk;
+	}
+	return length;
+#endif
+}
+
+}
@@ -2,13 +2,58 @@
 #include "cppio/iolinemanager.h"
 
 #include <vector>
+#include <algorithm>
+#include <map>
+#include <deque>
+#include <mutex>
+#ifdef __MINGW32__
+#ifndef _GLIBCXX_HAS_GTHREADS
+#include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
+#endif
+#endif
+#include <condition_variable>
 
 namespace cppio
 {
 
+struct PoolEndpoint
+{
+	PoolEndpoint() : active(0) {}
+
+	// Most recently released line is at the back
+	std::deque<std::pair<IoLine*, std::chrono::steady_clock::time_point>> idle;
+	// Leased lines and connections in progress
+	size_t active;
+};
+
 struct IoLineManager::Impl
 {
 	std::vector<std::unique_ptr<IoLineFactory>> factories;
+
+	std::mutex poolMutex;
+	std::condition_variable poolCondition;
+	PoolLimits poolLimits;
+	std::map<std::string, PoolEndpoint> endpoints;
+	std::map<IoLine*, std::string> leased;
+
+	IoLineFactory* findFactory(const std::string& address, std::string& baseAddress)
+	{
+		auto delimiter = address.find_first_of("://");
+		if(delimiter == std::string::npos)
+			return nullptr;
+
+		auto scheme = address.substr(0, delimiter);
+		for(const auto& factory : factories)
+		{
+			if(factory->supportsScheme(scheme))
+			{
+				baseAddress = address.substr(delimiter + 3);
+				return factory.get();
+			}
+		}
+		return nullptr;
+	}
 };
 
 IoLineManager::IoLineManager() : m_impl(new Impl)
@@ -17,58 +62,184 @@ IoLineManager::IoLineManager() : m_impl(new Impl)
 
 IoLineManager::~IoLineManager()
 {
+	for(auto& endpoint : m_impl->endpoints)
+	{
+		for(auto& idle : endpoint.second.idle)
+			delete idle.first;
+	}
 }
 
 IoLine* IoLineManager::createClient(const std::string& address)
 {
-	auto delimiter = address.find_first_of("://");
-	if(delimiter == std::string::npos)
+	std::string baseAddress;
+	auto factory = m_impl->findFactory(address, baseAddress);
+	if(!factory)
 		return nullptr;
 
-	auto scheme = address.substr(0, delimiter);
-	for(const auto& factory : m_impl->factories)
+	try
+	{
+		return factory->createClient(baseAddress);
+	}
+	catch(const IoException& e)
 	{
-		if(factory->supportsScheme(scheme))
+		return nullptr;
+	}
+}
+
+IoLine* IoLineManager::createClient(const std::string& address, int timeoutInMs)
+{
+	return createClients(std::vector<std::string> { address }, timeoutInMs).front();
+}
+
+std::vector<IoLine*> IoLineManager::createClients(const std::vector<std::string>& addresses, int timeoutInMs)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutInMs);
+	std::vector<IoLine*> lines(addresses.size(), nullptr);
+
+	// Addresses are grouped by factory, so that each factory can establish its connections concurrently
+	std::vector<std::pair<IoLineFactory*, std::vector<size_t>>> groups;
+	std::vector<std::string> baseAddresses(addresses.size());
+	for(size_t i = 0; i < addresses.size(); i++)
+	{
+		auto factory = m_impl->findFactory(addresses[i], baseAddresses[i]);
+		if(!factory)
+			continue;
+
+		auto it = groups.begin();
+		while((it != groups.end()) && (it->first != factory))
+			++it;
+		if(it == groups.end())
+			it = groups.insert(groups.end(), std::make_pair(factory, std::vector<size_t>()));
+		it->second.push_back(i);
+	}
+
+	for(const auto& group : groups)
+	{
+		int timeout = timeoutInMs;
+		if(timeoutInMs > 0)
 		{
-			try
-			{
-				auto baseAddress = address.substr(delimiter + 3);
-				return factory->createClient(baseAddress);
-			}
-			catch(const IoException& e)
-			{
-				return nullptr;
-			}
+			// Timeout of 0 would still make an attempt, but deadline has passed
+			timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if(timeout <= 0)
+				break;
 		}
+
+		std::vector<std::string> groupAddresses;
+		for(auto index : group.second)
+			groupAddresses.push_back(baseAddresses[index]);
+
+		auto groupLines = group.first->createClients(groupAddresses, timeout);
+		for(size_t i = 0; i < group.second.size(); i++)
+			lines[group.second[i]] = groupLines[i];
 	}
-	return nullptr;
+
+	return lines;
 }
 
 IoAcceptor* IoLineManager::createServer(const std::string& address)
 {
-	auto delimiter = address.find_first_of("://");
-	if(delimiter == std::string::npos)
+	std::string baseAddress;
+	auto factory = m_impl->findFactory(address, baseAddress);
+	if(!factory)
 		return nullptr;
 
-	auto scheme = address.substr(0, delimiter);
-	for(const auto& factory : m_impl->factories)
+	try
 	{
-		if(factory->supportsScheme(scheme))
+		return factory->createServer(baseAddress);
+	}
+	catch(const IoException& e)
+	{
+		return nullptr;
+	}
+}
+
+IoLine* IoLineManager::leaseClient(const std::string& address, int timeoutInMs)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutInMs);
+	std::vector<std::unique_ptr<IoLine>> stale;
+
+	std::unique_lock<std::mutex> lock(m_impl->poolMutex);
+	while(true)
+	{
+		auto& endpoint = m_impl->endpoints[address];
+		auto now = std::chrono::steady_clock::now();
+		auto idleTimeout = std::chrono::milliseconds(m_impl->poolLimits.idleTimeoutInMs);
+		while(!endpoint.idle.empty())
 		{
-			try
+			auto idle = endpoint.idle.back();
+			endpoint.idle.pop_back();
+			if((now - idle.second < idleTimeout) && idle.first->isConnected())
 			{
-				auto baseAddress = address.substr(delimiter + 3);
-				return factory->createServer(baseAddress);
-			}
-			catch(const IoException& e)
-			{
-				return nullptr;
+				endpoint.active++;
+				m_impl->leased[idle.first] = address;
+				return idle.first;
 			}
+			stale.emplace_back(idle.first);
+		}
+
+		if(endpoint.active < m_impl->poolLimits.maxActivePerEndpoint)
+			break;
+
+		if(timeoutInMs < 0)
+			m_impl->poolCondition.wait(lock);
+		else if(m_impl->poolCondition.wait_until(lock, deadline) == std::cv_status::timeout)
+			return nullptr;
+	}
+
+	// Slot is reserved while connecting, so that concurrent leases don't exceed the limit
+	m_impl->endpoints[address].active++;
+	lock.unlock();
+	stale.clear();
+
+	IoLine* line = nullptr;
+	int timeout = timeoutInMs;
+	if(timeoutInMs > 0)
+		timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+	if(timeoutInMs < 0)
+		line = createClient(address);
+	else if((timeoutInMs == 0) || (timeout > 0))
+		line = createClient(address, timeout);
+
+	lock.lock();
+	if(!line)
+	{
+		m_impl->endpoints[address].active--;
+		m_impl->poolCondition.notify_one();
+		return nullptr;
+	}
+	m_impl->leased[line] = address;
+	return line;
+}
+
+void IoLineManager::releaseClient(IoLine* line, bool reusable)
+{
+	std::unique_ptr<IoLine> toDelete;
+	{
+		std::unique_lock<std::mutex> lock(m_impl->poolMutex);
+		auto it = m_impl->leased.find(line);
+		if(it == m_impl->leased.end())
+		{
+			toDelete.reset(line);
+		}
+		else
+		{
+			auto& endpoint = m_impl->endpoints[it->second];
+			m_impl->leased.erase(it);
+			endpoint.active--;
+			if(reusable && (endpoint.idle.size() < m_impl->poolLimits.maxIdlePerEndpoint) && line->isConnected())
+				endpoint.idle.push_back(std::make_pair(line, std::chrono::steady_clock::now()));
+			else
+				toDelete.reset(line);
+			m_impl->poolCondition.notify_one();
 		}
 	}
-	return nullptr;
 }
 
+void IoLineManager::setPoolLimits(const PoolLimits& limits)
+{
+	std::unique_lock<std::mutex> lock(m_impl->poolMutex);
+	m_impl->poolLimits = limits;
+}
 
 void IoLineManager::registerFactory(std::unique_ptr<IoLineFactory> factory)
 {
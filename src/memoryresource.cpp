@@ -0,0 +1,359 @@
+
+#include "cppio/memoryresource.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#ifdef __MINGW32__
+#ifndef _GLIBCXX_HAS_GTHREADS
+#include "mingw.mutex.h"
+#endif
+#endif
+
+namespace cppio
+{
+
+MemoryResource::~MemoryResource()
+{
+}
+
+namespace
+{
+/*
+ * Alignments beyond what operator new guarantees are handled by over-allocating; original pointer is stored
+ * right before aligned block.
+ */
+class NewDeleteResource : public MemoryResource
+{
+protected:
+	virtual void* doAllocate(size_t bytes, size_t alignment)
+	{
+		if(alignment <= alignof(std::max_align_t))
+			return ::operator new(bytes);
+
+		char* raw = static_cast<char*>(::operator new(bytes + alignment));
+		uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + alignment) & ~(uintptr_t)(alignment - 1);
+		reinterpret_cast<void**>(aligned)[-1] = raw;
+		return reinterpret_cast<void*>(aligned);
+	}
+
+	virtual void doDeallocate(void* p, size_t bytes, size_t alignment)
+	{
+		if(alignment <= alignof(std::max_align_t))
+			::operator delete(p);
+		else
+			::operator delete(static_cast<void**>(p)[-1]);
+	}
+
+	virtual bool doIsEqual(const MemoryResource& other) const
+	{
+		return dynamic_cast<const NewDeleteResource*>(&other) != nullptr;
+	}
+};
+}
+
+MemoryResource* newDeleteResource()
+{
+	static NewDeleteResource resource;
+	return &resource;
+}
+
+namespace
+{
+static const size_t gs_minSizeClass = 6;
+static const size_t gs_maxSizeClass = 20;
+static const size_t gs_sizeClasses = gs_maxSizeClass - gs_minSizeClass + 1;
+
+// Blocks kept in thread cache per size class, beyond that they are returned to upstream
+static const size_t gs_maxCachedBytes = 256 * 1024;
+static const size_t gs_minCachedBlocks = 8;
+
+struct ThreadCache;
+
+/*
+ * Precedes every pooled block. While block is free, its first bytes hold pointer to next free block.
+ */
+struct alignas(std::max_align_t) BlockHeader
+{
+	ThreadCache* owner;
+	uint32_t sizeClass;
+};
+
+struct FreeBlock
+{
+	FreeBlock* next;
+};
+
+struct ThreadCache
+{
+	ThreadCache() : remoteFrees(nullptr)
+	{
+		for(size_t i = 0; i < gs_sizeClasses; i++)
+		{
+			freeLists[i] = nullptr;
+			freeCounts[i] = 0;
+		}
+	}
+
+	// Only touched by owning thread
+	FreeBlock* freeLists[gs_sizeClasses];
+	size_t freeCounts[gs_sizeClasses];
+
+	// Blocks freed by other threads; pushed with CAS, taken by owner all at once
+	std::atomic<FreeBlock*> remoteFrees;
+};
+
+static size_t sizeClassOf(size_t bytes)
+{
+	size_t sizeClass = gs_minSizeClass;
+	while(((size_t)1 << sizeClass) < bytes)
+		sizeClass++;
+	return sizeClass;
+}
+
+static FreeBlock* blockOf(BlockHeader* header)
+{
+	return reinterpret_cast<FreeBlock*>(header + 1);
+}
+
+static BlockHeader* headerOf(void* block)
+{
+	return static_cast<BlockHeader*>(block) - 1;
+}
+
+/*
+ * Caches are never destroyed: blocks which were allocated by exited thread can still be freed to its cache
+ * by other threads. Such caches are kept here until some new thread takes one over.
+ */
+struct OrphanedCaches
+{
+	std::mutex mutex;
+	std::vector<ThreadCache*> caches;
+};
+
+static OrphanedCaches& orphanedCaches()
+{
+	static OrphanedCaches* orphans = new OrphanedCaches();
+	return *orphans;
+}
+
+struct ThreadCacheHolder
+{
+	ThreadCacheHolder() : cache(nullptr) {}
+
+	~ThreadCacheHolder()
+	{
+		if(!cache)
+			return;
+		// Frees which happen later during thread exit go through remote list, as if from another thread
+		ThreadCache* orphan = cache;
+		cache = nullptr;
+		auto& orphans = orphanedCaches();
+		std::lock_guard<std::mutex> lock(orphans.mutex);
+		orphans.caches.push_back(orphan);
+	}
+
+	ThreadCache* get()
+	{
+		if(cache)
+			return cache;
+
+		auto& orphans = orphanedCaches();
+		{
+			std::lock_guard<std::mutex> lock(orphans.mutex);
+			if(!orphans.caches.empty())
+			{
+				cache = orphans.caches.back();
+				orphans.caches.pop_back();
+			}
+		}
+		if(!cache)
+			cache = new ThreadCache();
+		return cache;
+	}
+
+	ThreadCache* cache;
+};
+
+static thread_local ThreadCacheHolder gs_threadCache;
+
+class BufferPoolResource : public MemoryResource
+{
+protected:
+	virtual void* doAllocate(size_t bytes, size_t alignment)
+	{
+		if(!isPooled(bytes, alignment))
+			return newDeleteResource()->allocate(bytes, alignment);
+
+		size_t sizeClass = sizeClassOf(bytes);
+		size_t index = sizeClass - gs_minSizeClass;
+		ThreadCache* cache = gs_threadCache.get();
+
+		if(!cache->freeLists[index])
+			takeRemoteFrees(cache);
+
+		FreeBlock* block = cache->freeLists[index];
+		if(block)
+		{
+			cache->freeLists[index] = block->next;
+			cache->freeCounts[index]--;
+			headerOf(block)->owner = cache;
+			return block;
+		}
+
+		BlockHeader* header = static_cast<BlockHeader*>(::operator new(sizeof(BlockHeader) + ((size_t)1 << sizeClass)));
+		header->owner = cache;
+		header->sizeClass = sizeClass;
+		return blockOf(header);
+	}
+
+	virtual void doDeallocate(void* p, size_t bytes, size_t alignment)
+	{
+		if(!isPooled(bytes, alignment))
+		{
+			newDeleteResource()->deallocate(p, bytes, alignment);
+			return;
+		}
+
+		ThreadCache* owner = headerOf(p)->owner;
+		FreeBlock* block = static_cast<FreeBlock*>(p);
+		if(owner == gs_threadCache.cache)
+		{
+			pushLocal(owner, block);
+			return;
+		}
+
+		FreeBlock* head = owner->remoteFrees.load(std::memory_order_relaxed);
+		do
+		{
+			block->next = head;
+		} while(!owner->remoteFrees.compare_exchange_weak(head, block, std::memory_order_release,
+					std::memory_order_relaxed));
+	}
+
+	virtual bool doIsEqual(const MemoryResource& other) const
+	{
+		return dynamic_cast<const BufferPoolResource*>(&other) != nullptr;
+	}
+
+private:
+	static bool isPooled(size_t bytes, size_t alignment)
+	{
+		return (bytes <= ((size_t)1 << gs_maxSizeClass)) && (alignment <= alignof(std::max_align_t));
+	}
+
+	static void pushLocal(ThreadCache* cache, FreeBlock* block)
+	{
+		BlockHeader* header = headerOf(block);
+		size_t index = header->sizeClass - gs_minSizeClass;
+		size_t maxBlocks = std::max(gs_minCachedBlocks, gs_maxCachedBytes >> header->sizeClass);
+		if(cache->freeCounts[index] >= maxBlocks)
+		{
+			::operator delete(header);
+			return;
+		}
+		block->next = cache->freeLists[index];
+		cache->freeLists[index] = block;
+		cache->freeCounts[index]++;
+	}
+
+	static void takeRemoteFrees(ThreadCache* cache)
+	{
+		if(!cache->remoteFrees.load(std::memory_order_relaxed))
+			return;
+
+		FreeBlock* block = cache->remoteFrees.exchange(nullptr, std::memory_order_acquire);
+		while(block)
+		{
+			FreeBlock* next = block->next;
+			pushLocal(cache, block);
+			block = next;
+		}
+	}
+};
+}
+
+MemoryResource* bufferPoolResource()
+{
+	static BufferPoolResource resource;
+	return &resource;
+}
+
+static std::atomic<MemoryResource*> gs_defaultResource(nullptr);
+
+MemoryResource* defaultResource()
+{
+	MemoryResource* resource = gs_defaultResource.load(std::memory_order_acquire);
+	return resource ? resource : bufferPoolResource();
+}
+
+MemoryResource* setDefaultResource(MemoryResource* resource)
+{
+	MemoryResource* previous = gs_defaultResource.exchange(resource, std::memory_order_acq_rel);
+	return previous ? previous : bufferPoolResource();
+}
+
+MonotonicBufferResource::MonotonicBufferResource(size_t initialSize, MemoryResource* upstream) :
+	m_upstream(upstream ? upstream : defaultResource()),
+	m_initialBuffer(nullptr),
+	m_initialSize(0),
+	m_current(nullptr),
+	m_left(0),
+	m_nextChunkSize(initialSize > 0 ? initialSize : 4096)
+{
+}
+
+MonotonicBufferResource::MonotonicBufferResource(void* buffer, size_t size, MemoryResource* upstream) :
+	m_upstream(upstream ? upstream : defaultResource()),
+	m_initialBuffer(static_cast<char*>(buffer)),
+	m_initialSize(size),
+	m_current(static_cast<char*>(buffer)),
+	m_left(size),
+	m_nextChunkSize(size > 0 ? 2 * size : 4096)
+{
+}
+
+MonotonicBufferResource::~MonotonicBufferResource()
+{
+	release();
+}
+
+void MonotonicBufferResource::release()
+{
+	for(const auto& chunk : m_chunks)
+		m_upstream->deallocate(chunk.data, chunk.size);
+	m_chunks.clear();
+	m_current = m_initialBuffer;
+	m_left = m_initialSize;
+}
+
+void* MonotonicBufferResource::doAllocate(size_t bytes, size_t alignment)
+{
+	size_t padding = (alignment - reinterpret_cast<uintptr_t>(m_current) % alignment) % alignment;
+	if(!m_current || (padding + bytes > m_left))
+	{
+		size_t chunkSize = m_nextChunkSize;
+		while(chunkSize < bytes + alignment)
+			chunkSize *= 2;
+		m_nextChunkSize = chunkSize * 2;
+
+		void* data = m_upstream->allocate(chunkSize);
+		m_chunks.push_back(Chunk { data, chunkSize });
+		m_current = static_cast<char*>(data);
+		m_left = chunkSize;
+		padding = (alignment - reinterpret_cast<uintptr_t>(m_current) % alignment) % alignment;
+	}
+
+	void* result = m_current + padding;
+	m_current += padding + bytes;
+	m_left -= padding + bytes;
+	return result;
+}
+
+void MonotonicBufferResource::doDeallocate(void* p, size_t bytes, size_t alignment)
+{
+}
+
+}
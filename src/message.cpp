@@ -2,24 +2,261 @@
 #include "cppio/message.h"
 
 #include "cppio/ioline.h"
+#include "common/crc32c.h"
 
 #include <cstring>
 #include <stdexcept>
 #include <cassert>
+#include <algorithm>
+#include <cerrno>
+#include <mutex>
+#ifdef __MINGW32__
+#ifndef _GLIBCXX_HAS_GTHREADS
+#include "mingw.mutex.h"
+#endif
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
 namespace cppio
 {
 
-Frame::Frame()
+// Frame length which denotes descriptor frame on the wire. Descriptor itself is passed out of band.
+static const uint32_t gs_descriptorFrameMarker = 0xFFFFFFFF;
+
+const size_t Frame::InlineCapacity;
+
+Frame::Frame(MemoryResource* resource) : m_size(0),
+	m_resource(resource ? resource : defaultResource()),
+	m_heap(nullptr),
+	m_capacity(0),
+	m_alignment(0),
+	m_fd(-1),
+	m_fileOffset(0)
+{
+}
+
+Frame::Frame(const void* data, size_t len, MemoryResource* resource) : m_size(0),
+	m_resource(resource ? resource : defaultResource()),
+	m_heap(nullptr),
+	m_capacity(0),
+	m_alignment(0),
+	m_fd(-1),
+	m_fileOffset(0)
+{
+	assign(data, len);
+}
+
+Frame::Frame(std::vector<char>&& data) : m_size(data.size()),
+	m_resource(defaultResource()),
+	m_heap(nullptr),
+	m_capacity(0),
+	m_alignment(0),
+	m_fd(-1),
+	m_fileOffset(0)
+{
+	if(m_size <= InlineCapacity)
+	{
+		memcpy(m_inline, data.data(), m_size);
+	}
+	else
+	{
+		m_adopted = std::move(data);
+		m_heap = m_adopted.data();
+		m_alignment = alignof(std::max_align_t);
+	}
+}
+
+Frame::Frame(const Frame& other) : m_size(0),
+	m_resource(defaultResource()),
+	m_heap(nullptr),
+	m_capacity(0),
+	m_alignment(0),
+	m_fd(-1),
+	m_fileOffset(0)
+{
+	*this = other;
+}
+
+Frame::Frame(Frame&& other) noexcept : m_size(other.m_size),
+	m_resource(other.m_resource),
+	m_heap(other.m_heap),
+	m_capacity(other.m_capacity),
+	m_alignment(other.m_alignment),
+	m_adopted(std::move(other.m_adopted)),
+	m_fd(other.m_fd),
+	m_fileOffset(other.m_fileOffset),
+	m_descriptor(std::move(other.m_descriptor))
+{
+	if(isInline() && !isFileRegion())
+		memcpy(m_inline, other.m_inline, m_size);
+	other.m_size = 0;
+	other.m_heap = nullptr;
+	other.m_capacity = 0;
+	other.m_fd = -1;
+}
+
+Frame::~Frame()
+{
+	releaseHeap();
+}
+
+Frame& Frame::operator=(const Frame& other)
+{
+	if(this == &other)
+		return *this;
+
+	if(other.isFileRegion())
+	{
+		m_size = other.m_size;
+		m_fd = other.m_fd;
+		m_fileOffset = other.m_fileOffset;
+		m_descriptor.reset();
+		return *this;
+	}
+
+	// Over-aligned payloads stay over-aligned in copies, so that array views of them remain valid
+	size_t alignment = (other.m_alignment > alignof(std::max_align_t)) ? other.m_alignment : 1;
+	memcpy(resize(other.m_size, alignment), other.data(), other.m_size);
+	m_descriptor = other.m_descriptor;
+	return *this;
+}
+
+Frame& Frame::operator=(Frame&& other) noexcept
+{
+	if(this == &other)
+		return *this;
+
+	releaseHeap();
+	m_size = other.m_size;
+	m_resource = other.m_resource;
+	m_heap = other.m_heap;
+	m_capacity = other.m_capacity;
+	m_alignment = other.m_alignment;
+	m_adopted = std::move(other.m_adopted);
+	m_fd = other.m_fd;
+	m_fileOffset = other.m_fileOffset;
+	m_descriptor = std::move(other.m_descriptor);
+	if(isInline() && !isFileRegion())
+		memcpy(m_inline, other.m_inline, m_size);
+	other.m_size = 0;
+	other.m_heap = nullptr;
+	other.m_capacity = 0;
+	other.m_fd = -1;
+	return *this;
+}
+
+char* Frame::reserveHeap(size_t len, size_t alignment)
+{
+	if((m_capacity >= len) && (m_alignment >= alignment))
+		return m_heap;
+
+	if(m_heap && (m_capacity == 0) && (alignment <= alignof(std::max_align_t)))
+	{
+		m_adopted.resize(len);
+		m_heap = m_adopted.data();
+		return m_heap;
+	}
+
+	releaseHeap();
+	m_alignment = std::max(alignment, alignof(std::max_align_t));
+	m_heap = static_cast<char*>(m_resource->allocate(len, m_alignment));
+	m_capacity = len;
+	return m_heap;
+}
+
+void Frame::releaseHeap()
+{
+	if(m_capacity > 0)
+		m_resource->deallocate(m_heap, m_capacity, m_alignment);
+	m_heap = nullptr;
+	m_capacity = 0;
+	m_alignment = 0;
+	m_adopted = std::vector<char>();
+}
+
+void* Frame::resize(size_t len, size_t alignment)
+{
+	m_fd = -1;
+	m_fileOffset = 0;
+	m_descriptor.reset();
+	m_size = len;
+	if(!m_heap && ((len == 0) || ((len <= InlineCapacity) && (alignment <= alignof(uint64_t)))))
+		return m_inline;
+	if(len == 0)
+		return m_heap;
+	return reserveHeap(len, alignment);
+}
+
+void Frame::assign(const void* data, size_t len)
+{
+	memcpy(resize(len), data, len);
+}
+
+void Frame::copyTo(void* buffer) const
+{
+	if(!isFileRegion())
+	{
+		memcpy(buffer, data(), m_size);
+		return;
+	}
+
+#ifdef _WIN32
+	throw IoException("File region frames are not supported");
+#else
+	char* ptr = static_cast<char*>(buffer);
+	size_t done = 0;
+	while(done < m_size)
+	{
+		ssize_t rc = pread(m_fd, ptr + done, m_size - done, m_fileOffset + done);
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc <= 0)
+			throw IoException("Unable to read file region: " + std::to_string(errno));
+		done += rc;
+	}
+#endif
+}
+
+Frame Frame::fromFile(int fd, uint64_t offset, size_t length)
 {
+	Frame frame;
+	frame.m_fd = fd;
+	frame.m_fileOffset = offset;
+	frame.m_size = length;
+	return frame;
 }
 
-Frame::Frame(const void* data, size_t len) : m_data((char*)data, (char*)data + len)
+Frame Frame::adoptDescriptor(int fd)
 {
+#ifdef _WIN32
+	throw IoException("Descriptor frames are not supported");
+#else
+	if(fd < 0)
+		throw IoException("Invalid descriptor");
+
+	Frame frame;
+	frame.m_descriptor = std::shared_ptr<const int>(new int(fd), [](const int* descriptor) {
+			close(*descriptor);
+			delete descriptor;
+		});
+	return frame;
+#endif
 }
 
-Frame::Frame(std::vector<char>&& data) : m_data(data)
+Frame Frame::fromDescriptor(int fd)
 {
+#ifdef _WIN32
+	throw IoException("Descriptor frames are not supported");
+#else
+	int newfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if(newfd < 0)
+		throw IoException("Unable to duplicate descriptor: " + std::to_string(errno));
+	return adoptDescriptor(newfd);
+#endif
 }
 
 Frame Frame::fromValue(uint8_t value)
@@ -42,7 +279,7 @@ Frame Frame::fromValue(const std::string& value)
 	return Frame(value.data(), value.size());
 }
 
-Message::Message()
+Message::Message(MemoryResource* resource) : m_frames(ResourceAllocator<Frame>(resource))
 {
 }
 
@@ -55,27 +292,9 @@ void Message::clear()
 	m_frames.clear();
 }
 
-Message Message::readMessage(const void* buffer, size_t bufferLength)
+Message Message::readMessage(const void* buffer, size_t bufferLength, MemoryResource* resource)
 {
-	char* start = (char*)buffer;
-	char* current = (char*)buffer;
-	size_t frames = *((uint32_t*)current);
-	current += 4;
-
-	Message msg;
-
-	for(size_t i = 0; i < frames; i++)
-	{
-		size_t currentFrameLength = *((uint32_t*)current);
-		current += 4;
-		if(current + currentFrameLength - start > (ssize_t)bufferLength)
-			throw std::length_error("Unable to construct Message: end of buffer");
-
-		msg.addFrame(Frame(current, currentFrameLength));
-		current += currentFrameLength;
-	}
-
-	return msg;
+	return MessageView(buffer, bufferLength).toMessage(resource);
 }
 
 void Message::addFrame(const Frame& frame)
@@ -85,7 +304,25 @@ void Message::addFrame(const Frame& frame)
 
 void Message::addFrame(Frame&& frame)
 {
-	m_frames.push_back(frame);
+	m_frames.push_back(std::move(frame));
+}
+
+void Message::reserve(size_t frames)
+{
+	m_frames.reserve(frames);
+}
+
+void Message::resize(size_t frames)
+{
+	if(frames <= m_frames.size())
+	{
+		m_frames.resize(frames);
+		return;
+	}
+
+	m_frames.reserve(frames);
+	while(m_frames.size() < frames)
+		m_frames.emplace_back(resource());
 }
 
 size_t Message::messageSize() const
@@ -107,9 +344,9 @@ void Message::writeMessage(void* buffer) const
 	b += 4;
 	for(const auto& frame : m_frames)
 	{
-		*((uint32_t*)b) = frame.size();
+		*((uint32_t*)b) = frame.isDescriptor() ? gs_descriptorFrameMarker : frame.size();
 		b += 4;
-		memcpy(b, frame.data(), frame.size());
+		frame.copyTo(b);
 		b += frame.size();
 	}
 }
@@ -135,84 +372,1420 @@ void Message::get(std::string& value, size_t frameNumber) const
 	value.assign((const char*)f.data(), f.size());
 }
 
-struct MessageProtocol::Impl
+CompactMessage::CompactMessage(MemoryResource* resource) : m_buffer(4, 0, ResourceAllocator<char>(resource)),
+	m_offsets(ResourceAllocator<size_t>(resource))
 {
-	IoLine* line;
+}
+
+CompactMessage::CompactMessage(const Message& message, MemoryResource* resource) :
+	m_buffer(ResourceAllocator<char>(resource)),
+	m_offsets(ResourceAllocator<size_t>(resource))
+{
+	size_t bytes = message.messageSize();
+	reserve(message.size(), bytes);
+	m_buffer.resize(bytes);
+
+	uint32_t frames = message.size();
+	memcpy(m_buffer.data(), &frames, 4);
+	size_t offset = 4;
+	for(size_t i = 0; i < message.size(); i++)
+	{
+		const Frame& frame = message.frame(i);
+		if(frame.isDescriptor())
+			throw IoException("Descriptor frames can't be stored in CompactMessage");
+
+		uint32_t frameLength = frame.size();
+		memcpy(m_buffer.data() + offset, &frameLength, 4);
+		offset += 4;
+		m_offsets.push_back(offset);
+		frame.copyTo(m_buffer.data() + offset);
+		offset += frameLength;
+	}
+}
+
+void CompactMessage::clear()
+{
+	m_buffer.assign(4, 0);
+	m_offsets.clear();
+}
+
+void CompactMessage::reserve(size_t frames, size_t bytes)
+{
+	m_offsets.reserve(frames);
+	m_buffer.reserve(bytes);
+}
+
+CompactMessage CompactMessage::readMessage(const void* buffer, size_t bufferLength, MemoryResource* resource)
+{
+	const char* current = (const char*)buffer;
+	const char* end = current + bufferLength;
+	if(bufferLength < 4)
+		throw std::length_error("Unable to construct CompactMessage: end of buffer");
+
+	uint32_t frames;
+	memcpy(&frames, current, 4);
+	current += 4;
+
+	CompactMessage msg(resource);
+	for(size_t i = 0; i < frames; i++)
+	{
+		uint32_t frameLength;
+		if(end - current < 4)
+			throw std::length_error("Unable to construct CompactMessage: end of buffer");
+		memcpy(&frameLength, current, 4);
+		current += 4;
+		if((size_t)(end - current) < frameLength)
+			throw std::length_error("Unable to construct CompactMessage: end of buffer");
+
+		msg.m_offsets.push_back(current - (const char*)buffer);
+		current += frameLength;
+	}
+	msg.m_buffer.assign((const char*)buffer, current);
+	return msg;
+}
+
+void* CompactMessage::appendFrame(size_t len)
+{
+	uint32_t frameLength = len;
+	size_t offset = m_buffer.size();
+	m_buffer.resize(offset + 4 + len);
+	memcpy(m_buffer.data() + offset, &frameLength, 4);
+	m_offsets.push_back(offset + 4);
+
+	uint32_t frames = m_offsets.size();
+	memcpy(m_buffer.data(), &frames, 4);
+	return m_buffer.data() + offset + 4;
+}
+
+void CompactMessage::addFrame(const void* data, size_t len)
+{
+	memcpy(appendFrame(len), data, len);
+}
+
+void CompactMessage::addFrame(const Frame& frame)
+{
+	if(frame.isDescriptor())
+		throw IoException("Descriptor frames can't be stored in CompactMessage");
+	frame.copyTo(appendFrame(frame.size()));
+}
+
+FrameView CompactMessage::frame(size_t index) const
+{
+	size_t offset = m_offsets[index];
+	uint32_t frameLength;
+	memcpy(&frameLength, m_buffer.data() + offset - 4, 4);
+	return FrameView(m_buffer.data() + offset, frameLength);
+}
+
+void CompactMessage::writeMessage(void* buffer) const
+{
+	memcpy(buffer, m_buffer.data(), m_buffer.size());
+}
+
+Message CompactMessage::toMessage(MemoryResource* resource) const
+{
+	Message msg(resource);
+	msg.reserve(size());
+	for(size_t i = 0; i < size(); i++)
+		msg.emplaceFrame(frame(i).data(), frame(i).size(), resource);
+	return msg;
+}
+
+void CompactMessage::get(uint8_t& value, size_t frameNumber) const
+{
+	memcpy(&value, frame(frameNumber).data(), sizeof(value));
+}
+
+void CompactMessage::get(uint16_t& value, size_t frameNumber) const
+{
+	memcpy(&value, frame(frameNumber).data(), sizeof(value));
+}
+
+void CompactMessage::get(uint32_t& value, size_t frameNumber) const
+{
+	memcpy(&value, frame(frameNumber).data(), sizeof(value));
+}
+
+void CompactMessage::get(std::string& value, size_t frameNumber) const
+{
+	auto f = frame(frameNumber);
+	value.assign((const char*)f.data(), f.size());
+}
+
+MessageBuilder::MessageBuilder(size_t frames, size_t bytes, MemoryResource* resource) : m_message(resource)
+{
+	m_message.reserve(frames, bytes);
+}
+
+struct MessagePool::Impl
+{
+	size_t maxMessages;
+	mutable std::mutex mutex;
+	std::vector<Message> messages;
 };
 
-MessageProtocol::MessageProtocol(IoLine* line) : m_impl(new Impl)
+MessagePool::MessagePool(size_t maxMessages) : m_impl(new Impl)
 {
-	m_impl->line = line;
+	m_impl->maxMessages = maxMessages;
+	m_impl->messages.reserve(maxMessages);
 }
 
-MessageProtocol::~MessageProtocol()
+MessagePool::~MessagePool()
 {
 }
 
-MessageProtocol::MessageProtocol(MessageProtocol&& other) : m_impl(std::move(other.m_impl))
+Message MessagePool::acquire()
 {
+	std::lock_guard<std::mutex> lock(m_impl->mutex);
+	if(m_impl->messages.empty())
+		return Message();
+
+	Message message(std::move(m_impl->messages.back()));
+	m_impl->messages.pop_back();
+	return message;
 }
 
-ssize_t MessageProtocol::readMessage(Message& m)
+void MessagePool::release(Message&& message)
 {
-	assert(m.size() == 0);
+	std::lock_guard<std::mutex> lock(m_impl->mutex);
+	if(m_impl->messages.size() < m_impl->maxMessages)
+		m_impl->messages.push_back(std::move(message));
+}
 
-	uint32_t frames = 0;
-	int bytesRead = 0;
-	while(bytesRead < 4)
+size_t MessagePool::size() const
+{
+	std::lock_guard<std::mutex> lock(m_impl->mutex);
+	return m_impl->messages.size();
+}
+
+/*
+ * Encodings in formats other than WireFormat::V1 and checksums of encodings, built on demand
+ */
+struct SharedMessage::Encodings
+{
+	Encodings() : v1Checksum(0), v2Checksum(0), hasV1Checksum(false), hasV2Checksum(false)
 	{
-		char* ptr = reinterpret_cast<char*>(&frames) + bytesRead;
-		int result = m_impl->line->read(ptr, 4 - bytesRead);
-		if(result <= 0)
-			return result;
-		bytesRead += result;
 	}
 
-	for(size_t i = 0; i < frames; i++)
+	std::mutex mutex;
+	std::shared_ptr<const std::vector<char>> v2;
+	uint32_t v1Checksum;
+	uint32_t v2Checksum;
+	bool hasV1Checksum;
+	bool hasV2Checksum;
+};
+
+SharedMessage::SharedMessage() : m_buffer(std::make_shared<std::vector<char>>(4, 0)),
+	m_offsets(std::make_shared<std::vector<size_t>>()),
+	m_encodings(std::make_shared<Encodings>())
+{
+}
+
+SharedMessage::SharedMessage(const Message& message) : m_encodings(std::make_shared<Encodings>())
+{
+	auto offsets = std::make_shared<std::vector<size_t>>();
+	offsets->reserve(message.size());
+	size_t offset = 4;
+	for(size_t i = 0; i < message.size(); i++)
 	{
-		uint32_t frameLength = 0;
-		size_t bytesRead = 0;
-		while(bytesRead < 4)
+		if(message.frame(i).isDescriptor())
+			throw IoException("Descriptor frames can't be stored in SharedMessage");
+		offset += 4;
+		offsets->push_back(offset);
+		offset += message.frame(i).size();
+	}
+	m_offsets = offsets;
+
+	auto buffer = std::make_shared<std::vector<char>>(message.messageSize());
+	message.writeMessage(buffer->data());
+	m_buffer = buffer;
+}
+
+SharedMessage::SharedMessage(const CompactMessage& message) : m_encodings(std::make_shared<Encodings>())
+{
+	const char* data = static_cast<const char*>(message.data());
+	m_buffer = std::make_shared<std::vector<char>>(data, data + message.messageSize());
+
+	auto offsets = std::make_shared<std::vector<size_t>>();
+	offsets->reserve(message.size());
+	for(size_t i = 0; i < message.size(); i++)
+		offsets->push_back(static_cast<const char*>(message.frame(i).data()) - data);
+	m_offsets = offsets;
+}
+
+FrameView SharedMessage::frame(size_t index) const
+{
+	size_t offset = (*m_offsets)[index];
+	uint32_t frameLength;
+	memcpy(&frameLength, m_buffer->data() + offset - 4, 4);
+	return FrameView(m_buffer->data() + offset, frameLength);
+}
+
+Message SharedMessage::toMessage(MemoryResource* resource) const
+{
+	Message msg(resource);
+	msg.reserve(size());
+	for(size_t i = 0; i < size(); i++)
+		msg.emplaceFrame(frame(i).data(), frame(i).size(), resource);
+	return msg;
+}
+
+static size_t varintSize(uint32_t value)
+{
+	size_t size = 1;
+	while(value >= 0x80)
+	{
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+static char* writeVarint(char* buffer, uint32_t value)
+{
+	while(value >= 0x80)
+	{
+		*buffer++ = (char)((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	*buffer++ = (char)value;
+	return buffer;
+}
+
+/*
+ * Returns position after varint, or nullptr if it is truncated or doesn't fit in 32 bits
+ */
+static const char* readVarint(const char* current, const char* end, uint32_t& value)
+{
+	value = 0;
+	for(unsigned int shift = 0; (shift < 32) && (current < end); shift += 7)
+	{
+		uint8_t byte = *current++;
+		if((shift == 28) && (byte > 0x0F))
+			return nullptr;
+		value |= (uint32_t)(byte & 0x7F) << shift;
+		if(!(byte & 0x80))
+			return current;
+	}
+	return nullptr;
+}
+
+static uint32_t wireLength(const Frame& frame)
+{
+	return frame.isDescriptor() ? gs_descriptorFrameMarker : frame.size();
+}
+
+static uint32_t wireLength(const FrameView& frame)
+{
+	return frame.size();
+}
+
+/*
+ * Copies payload to buffer; if crc is given, updates it in the same pass
+ */
+static void copyPayload(const Frame& frame, char* buffer, uint32_t* crc)
+{
+	if(!crc)
+	{
+		frame.copyTo(buffer);
+		return;
+	}
+	if(frame.isFileRegion())
+	{
+		frame.copyTo(buffer);
+		*crc = crc32c(*crc, buffer, frame.size());
+		return;
+	}
+	*crc = crc32cCopy(*crc, buffer, frame.data(), frame.size());
+}
+
+static void copyPayload(const FrameView& frame, char* buffer, uint32_t* crc)
+{
+	if(crc)
+		*crc = crc32cCopy(*crc, buffer, frame.data(), frame.size());
+	else
+		memcpy(buffer, frame.data(), frame.size());
+}
+
+/*
+ * Frame count and frame lengths are encoded the same way: u32 in WireFormat::V1, varint in WireFormat::V2
+ */
+static size_t lengthSize(uint32_t value, WireFormat format)
+{
+	return (format == WireFormat::V2) ? varintSize(value) : 4;
+}
+
+static char* writeLength(char* buffer, uint32_t value, WireFormat format)
+{
+	if(format == WireFormat::V2)
+		return writeVarint(buffer, value);
+	memcpy(buffer, &value, 4);
+	return buffer + 4;
+}
+
+/*
+ * Size of serialized message, including length prefix of WireFormat::V2. Source is Message, CompactMessage
+ * or SharedMessage.
+ */
+template <typename Source>
+static size_t wireMessageSize(const Source& m, WireFormat format)
+{
+	size_t size = ((format == WireFormat::V2) ? 4 : 0) + lengthSize(m.size(), format);
+	for(size_t i = 0; i < m.size(); i++)
+	{
+		const auto& frame = m.frame(i);
+		size += lengthSize(wireLength(frame), format) + frame.size();
+	}
+	return size;
+}
+
+/*
+ * Serializes message to buffer of wireMessageSize() bytes. If crc is given, it is updated with serialized
+ * bytes while payloads are copied.
+ */
+template <typename Source>
+static void writeWireMessage(const Source& m, WireFormat format, char* buffer, size_t size, uint32_t* crc)
+{
+	char* b = buffer;
+	if(format == WireFormat::V2)
+	{
+		uint32_t bodyLength = size - 4;
+		memcpy(b, &bodyLength, 4);
+		b += 4;
+	}
+	b = writeLength(b, m.size(), format);
+
+	// Headers are added to checksum in batches, between payloads
+	char* unchecked = buffer;
+	for(size_t i = 0; i < m.size(); i++)
+	{
+		const auto& frame = m.frame(i);
+		b = writeLength(b, wireLength(frame), format);
+		if(crc)
 		{
-			char* ptr = reinterpret_cast<char*>(&frameLength) + bytesRead;
-			int result = m_impl->line->read(ptr, 4 - bytesRead);
-			if(result <= 0)
-				return result;
-			bytesRead += result;
+			*crc = crc32c(*crc, unchecked, b - unchecked);
+			unchecked = b + frame.size();
 		}
+		copyPayload(frame, b, crc);
+		b += frame.size();
+	}
+	if(crc)
+		*crc = crc32c(*crc, unchecked, b - unchecked);
+}
 
-		std::vector<char> data(frameLength);
-		bytesRead = 0;
+std::shared_ptr<const std::vector<char>> SharedMessage::buffer(WireFormat format, uint32_t* checksum) const
+{
+	if((format == WireFormat::V1) && !checksum)
+		return m_buffer;
 
-		while(bytesRead < frameLength)
+	std::lock_guard<std::mutex> lock(m_encodings->mutex);
+	Encodings& e = *m_encodings;
+	if(format == WireFormat::V1)
+	{
+		if(!e.hasV1Checksum)
 		{
-			char* ptr = data.data() + bytesRead;
-			int result = m_impl->line->read(ptr, frameLength - bytesRead);
-			if(result <= 0)
-				return result;
-			bytesRead += result;
+			e.v1Checksum = crc32c(0, m_buffer->data(), m_buffer->size());
+			e.hasV1Checksum = true;
 		}
+		*checksum = e.v1Checksum;
+		return m_buffer;
+	}
 
-		m.addFrame(Frame(std::move(data)));
+	if(!e.v2)
+	{
+		size_t size = wireMessageSize(*this, format);
+		if(size - 4 > UINT32_MAX)
+			return nullptr;
+		auto buffer = std::make_shared<std::vector<char>>(size);
+		uint32_t crc = 0;
+		writeWireMessage(*this, format, buffer->data(), size, checksum ? &crc : nullptr);
+		e.v2 = buffer;
+		e.v2Checksum = crc;
+		e.hasV2Checksum = (checksum != nullptr);
 	}
-	return 1;
+	if(checksum && !e.hasV2Checksum)
+	{
+		e.v2Checksum = crc32c(0, e.v2->data(), e.v2->size());
+		e.hasV2Checksum = true;
+	}
+	if(checksum)
+		*checksum = e.v2Checksum;
+	return e.v2;
 }
 
-ssize_t MessageProtocol::sendMessage(const Message& m)
+/*
+ * Counterpart of parseMessage() for WireFormat::V2
+ */
+static size_t parseMessageV2(const char* buffer, size_t bufferLength, std::vector<FrameView>& frames)
 {
-	std::vector<char> buffer(m.messageSize());
-	m.writeMessage(buffer.data());
-	char* data = buffer.data();
-	int towrite = buffer.size();
-	while(towrite > 0)
+	frames.clear();
+	if(bufferLength < 4)
+		throw std::length_error("Unable to parse message: end of buffer");
+
+	uint32_t bodyLength;
+	memcpy(&bodyLength, buffer, 4);
+	if(bufferLength - 4 < bodyLength)
+		throw std::length_error("Unable to parse message: end of buffer");
+
+	const char* current = buffer + 4;
+	const char* end = current + bodyLength;
+	uint32_t frameCount;
+	current = readVarint(current, end, frameCount);
+	if(!current)
+		throw std::length_error("Unable to parse message: invalid frame count");
+
+	// Every frame takes at least 1 byte
+	frames.reserve(std::min<size_t>(frameCount, end - current));
+	for(size_t i = 0; i < frameCount; i++)
 	{
-		size_t done = m_impl->line->write(data, towrite);
-		towrite -= done;
-		data += done;
+		uint32_t frameLength;
+		current = readVarint(current, end, frameLength);
+		if(!current || ((size_t)(end - current) < frameLength))
+			throw std::length_error("Unable to parse message: end of buffer");
+
+		frames.push_back(FrameView(current, frameLength));
+		current += frameLength;
 	}
-	return 1;
+	return end - buffer;
 }
 
+/*
+ * Fills frames with views into buffer and returns length of message
+ */
+static size_t parseMessage(const char* buffer, size_t bufferLength, std::vector<FrameView>& frames)
+{
+	frames.clear();
+	if(bufferLength < 4)
+		throw std::length_error("Unable to parse message: end of buffer");
+
+	const char* current = buffer;
+	const char* end = buffer + bufferLength;
+	uint32_t frameCount;
+	memcpy(&frameCount, current, 4);
+	current += 4;
+
+	// Every frame takes at least 4 bytes, so bogus count can't cause huge allocation
+	frames.reserve(std::min<size_t>(frameCount, bufferLength / 4));
+	for(size_t i = 0; i < frameCount; i++)
+	{
+		if(end - current < 4)
+			throw std::length_error("Unable to parse message: end of buffer");
+		uint32_t frameLength;
+		memcpy(&frameLength, current, 4);
+		current += 4;
+		if((size_t)(end - current) < frameLength)
+			throw std::length_error("Unable to parse message: end of buffer");
+
+		frames.push_back(FrameView(current, frameLength));
+		current += frameLength;
+	}
+	return current - buffer;
+}
+
+MessageView::MessageView() : m_buffer(nullptr),
+	m_length(0)
+{
+}
+
+MessageView::MessageView(const void* buffer, size_t bufferLength) : m_buffer(nullptr),
+	m_length(0)
+{
+	reset(buffer, bufferLength);
+}
+
+MessageView::MessageView(const std::shared_ptr<const std::vector<char>>& buffer, size_t bufferLength) : m_buffer(nullptr),
+	m_length(0)
+{
+	reset(buffer, bufferLength);
+}
+
+static size_t parseMessage(const char* buffer, size_t bufferLength, std::vector<FrameView>& frames,
+		WireFormat format)
+{
+	if(format == WireFormat::V2)
+		return parseMessageV2(buffer, bufferLength, frames);
+	return parseMessage(buffer, bufferLength, frames);
+}
+
+void MessageView::reset(const void* buffer, size_t bufferLength, WireFormat format)
+{
+	clear();
+	try
+	{
+		m_length = parseMessage((const char*)buffer, bufferLength, m_frames, format);
+	}
+	catch(const std::length_error& e)
+	{
+		m_frames.clear();
+		throw;
+	}
+	m_buffer = (const char*)buffer;
+}
+
+void MessageView::reset(const std::shared_ptr<const std::vector<char>>& buffer, size_t bufferLength,
+		WireFormat format)
+{
+	clear();
+	try
+	{
+		m_length = parseMessage(buffer->data(), bufferLength, m_frames, format);
+	}
+	catch(const std::length_error& e)
+	{
+		m_frames.clear();
+		throw;
+	}
+	m_buffer = buffer->data();
+	m_storage = buffer;
+}
+
+void MessageView::clear()
+{
+	m_buffer = nullptr;
+	m_length = 0;
+	m_storage.reset();
+	m_frames.clear();
+}
+
+Message MessageView::toMessage(MemoryResource* resource) const
+{
+	Message msg(resource);
+	msg.reserve(m_frames.size());
+	for(const auto& frame : m_frames)
+		msg.emplaceFrame(frame.data(), frame.size(), resource);
+	return msg;
+}
+
+void MessageView::get(uint8_t& value, size_t frameNumber) const
+{
+	memcpy(&value, frame(frameNumber).data(), sizeof(value));
+}
+
+void MessageView::get(uint16_t& value, size_t frameNumber) const
+{
+	memcpy(&value, frame(frameNumber).data(), sizeof(value));
+}
+
+void MessageView::get(uint32_t& value, size_t frameNumber) const
+{
+	memcpy(&value, frame(frameNumber).data(), sizeof(value));
+}
+
+void MessageView::get(std::string& value, size_t frameNumber) const
+{
+	const FrameView& f = frame(frameNumber);
+	value.assign((const char*)f.data(), f.size());
+}
+
+struct MessageProtocol::Impl
+{
+	IoLine* line;
+
+	// Reused between sends unless line still holds a reference to it
+	std::shared_ptr<std::vector<char>> sendBuffer;
+
+	// Reused between reads unless some MessageView still holds it
+	std::shared_ptr<std::vector<char>> viewBuffer;
+
+	// Used with lines which preserve message boundaries, and for reading whole WireFormat::V2 messages
+	std::vector<char> recordBuffer;
+	std::vector<uint32_t> recordHeaders;
+	std::vector<char> recordPrefixes;
+	std::vector<IoVec> recordParts;
+
+	// Referenced by parts of record being sent
+	uint32_t sentChecksum;
+
+	std::vector<int> descriptors;
+
+	size_t frameAlignment;
+	WireFormat wireFormat;
+	bool checksums;
+
+	template <typename Source>
+	ssize_t encode(const Source& m);
+	void appendLength(uint32_t value);
+	const char* readLength(const char* current, const char* end, uint32_t& value) const;
+	ssize_t decode(const char* current, const char* end, Message& m);
+
+	ssize_t sendWithFileRegions(const Message& m);
+	ssize_t sendWithDescriptors(const Message& m);
+	ssize_t sendRecord(const Message& m);
+	template <typename Source>
+	ssize_t sendReencoded(const Source& m);
+	ssize_t sendSerialized(const char* data, size_t length, const std::shared_ptr<const std::vector<char>>& shared,
+			const uint32_t* checksum);
+	ssize_t readRecord(Message& m);
+	ssize_t readMessageV2(Message& m);
+};
+
+/*
+ * Serializes message to send buffer, followed by its checksum if enabled. Returns eTooBigBuffer if message
+ * doesn't fit in 32-bit length prefix.
+ */
+template <typename Source>
+ssize_t MessageProtocol::Impl::encode(const Source& m)
+{
+	size_t size = wireMessageSize(m, wireFormat);
+	if((wireFormat == WireFormat::V2) && (size - 4 > UINT32_MAX))
+		return eTooBigBuffer;
+
+	sendBuffer->resize(size + (checksums ? 4 : 0));
+	uint32_t crc = 0;
+	writeWireMessage(m, wireFormat, sendBuffer->data(), size, checksums ? &crc : nullptr);
+	if(checksums)
+		memcpy(sendBuffer->data() + size, &crc, 4);
+	return 1;
+}
+
+void MessageProtocol::Impl::appendLength(uint32_t value)
+{
+	char length[5];
+	sendBuffer->insert(sendBuffer->end(), length, writeLength(length, value, wireFormat));
+}
+
+/*
+ * Returns position after length, or nullptr if buffer is truncated
+ */
+const char* MessageProtocol::Impl::readLength(const char* current, const char* end, uint32_t& value) const
+{
+	if(wireFormat == WireFormat::V2)
+		return readVarint(current, end, value);
+	if(end - current < 4)
+		return nullptr;
+	memcpy(&value, current, 4);
+	return current + 4;
+}
+
+/*
+ * Fills message from serialized one, reusing frames which are already present in it. Checksum, if enabled,
+ * is computed while payloads are copied to frames.
+ */
+ssize_t MessageProtocol::Impl::decode(const char* current, const char* end, Message& m)
+{
+	const char* begin = current;
+	const char* bufferEnd = end;
+	if(wireFormat == WireFormat::V2)
+	{
+		if(end - current < 4)
+			return eUnknown;
+		uint32_t bodyLength;
+		memcpy(&bodyLength, current, 4);
+		current += 4;
+		if((size_t)(end - current) < bodyLength)
+			return eUnknown;
+		end = current + bodyLength;
+	}
+
+	uint32_t crc = 0;
+	const char* unchecked = begin;
+	uint32_t frames;
+	current = readLength(current, end, frames);
+	if(!current)
+		return eUnknown;
+	if(m.size() > frames)
+		m.resize(frames);
+	for(size_t i = 0; i < frames; i++)
+	{
+		uint32_t frameLength;
+		current = readLength(current, end, frameLength);
+		if(!current)
+			return eUnknown;
+		if(i == m.size())
+			m.emplaceFrame(m.resource());
+		if(frameLength == gs_descriptorFrameMarker)
+		{
+			int fd = line->takeDescriptor();
+			if(fd < 0)
+				return eUnknown;
+			m.frame(i) = Frame::adoptDescriptor(fd);
+			continue;
+		}
+		if((size_t)(end - current) < frameLength)
+			return eUnknown;
+		void* payload = m.frame(i).resize(frameLength, frameAlignment);
+		if(checksums)
+		{
+			crc = crc32c(crc, unchecked, current - unchecked);
+			crc = crc32cCopy(crc, payload, current, frameLength);
+			unchecked = current + frameLength;
+		}
+		else
+		{
+			memcpy(payload, current, frameLength);
+		}
+		current += frameLength;
+	}
+	if(!checksums)
+		return 1;
+
+	const char* messageEnd = (wireFormat == WireFormat::V2) ? end : current;
+	crc = crc32c(crc, unchecked, messageEnd - unchecked);
+	if(bufferEnd - messageEnd < 4)
+		return eUnknown;
+	return (memcmp(&crc, messageEnd, 4) == 0) ? 1 : eChecksumMismatch;
+}
+
+/*
+ * Checks checksum which follows message of given length in buffer
+ */
+static ssize_t verifyChecksum(const char* buffer, size_t messageLength, size_t bufferLength)
+{
+	if(bufferLength - messageLength < 4)
+		return eUnknown;
+	uint32_t crc = crc32c(0, buffer, messageLength);
+	return (memcmp(&crc, buffer + messageLength, 4) == 0) ? 1 : eChecksumMismatch;
+}
+
+// Keeps sendmsg() below IOV_MAX
+static const size_t gs_maxRecordParts = 1024;
+
+/*
+ * Whole message is sent with one writeRecord() call, frames are gathered directly from their storage
+ */
+ssize_t MessageProtocol::Impl::sendRecord(const Message& m)
+{
+	bool hasFileRegions = false;
+	for(size_t i = 0; i < m.size(); i++)
+		hasFileRegions = hasFileRegions || m.frame(i).isFileRegion();
+
+	recordParts.clear();
+	bool gathered = true;
+	if(hasFileRegions || (2 * m.size() + 2 > gs_maxRecordParts))
+	{
+		ssize_t rc = encode(m);
+		if(rc < 0)
+			return rc;
+		recordParts.push_back(IoVec { sendBuffer->data(), sendBuffer->size() });
+		gathered = false;
+	}
+	else if(wireFormat == WireFormat::V2)
+	{
+		size_t size = wireMessageSize(m, wireFormat);
+		if(size - 4 > UINT32_MAX)
+			return eTooBigBuffer;
+
+		// Sized up front, so that parts can point into it. Headers of adjacent frames without payload
+		// between them go in one part.
+		recordPrefixes.resize(4 + 5 * (m.size() + 1));
+		char* header = recordPrefixes.data();
+		uint32_t bodyLength = size - 4;
+		memcpy(header, &bodyLength, 4);
+		char* end = writeVarint(header + 4, m.size());
+		for(size_t i = 0; i < m.size(); i++)
+		{
+			const Frame& frame = m.frame(i);
+			end = writeVarint(end, frame.size());
+			if(frame.size() == 0)
+				continue;
+			recordParts.push_back(IoVec { header, (size_t)(end - header) });
+			recordParts.push_back(IoVec { frame.data(), frame.size() });
+			header = end;
+		}
+		if(end > header)
+			recordParts.push_back(IoVec { header, (size_t)(end - header) });
+	}
+	else
+	{
+		recordHeaders.resize(m.size() + 1);
+		recordHeaders[0] = m.size();
+		recordParts.push_back(IoVec { &recordHeaders[0], 4 });
+		for(size_t i = 0; i < m.size(); i++)
+		{
+			const Frame& frame = m.frame(i);
+			recordHeaders[i + 1] = frame.size();
+			recordParts.push_back(IoVec { &recordHeaders[i + 1], 4 });
+			if(frame.size() > 0)
+				recordParts.push_back(IoVec { frame.data(), frame.size() });
+		}
+	}
+
+	// Payloads are not copied here, so checksum is the only pass over them
+	if(checksums && gathered)
+	{
+		sentChecksum = 0;
+		for(const auto& part : recordParts)
+			sentChecksum = crc32c(sentChecksum, part.data, part.length);
+		recordParts.push_back(IoVec { &sentChecksum, 4 });
+	}
+
+	ssize_t rc = line->writeRecord(recordParts.data(), recordParts.size());
+	if(rc < 0)
+		return rc;
+	return 1;
+}
+
+ssize_t MessageProtocol::Impl::readRecord(Message& m)
+{
+	if(recordBuffer.size() < 65536)
+		recordBuffer.resize(65536);
+
+	ssize_t rc = line->readRecord(recordBuffer.data(), recordBuffer.size());
+	while(rc > (ssize_t)recordBuffer.size())
+	{
+		recordBuffer.resize(rc);
+		rc = line->readRecord(recordBuffer.data(), recordBuffer.size());
+	}
+	if(rc <= 0)
+		return rc;
+
+	return decode(recordBuffer.data(), recordBuffer.data() + rc, m);
+}
+
+MessageProtocol::MessageProtocol(IoLine* line) : m_impl(new Impl)
+{
+	m_impl->line = line;
+	m_impl->frameAlignment = 1;
+	m_impl->wireFormat = WireFormat::V1;
+	m_impl->checksums = false;
+}
+
+MessageProtocol::~MessageProtocol()
+{
+}
+
+MessageProtocol::MessageProtocol(MessageProtocol&& other) : m_impl(std::move(other.m_impl))
+{
+}
+
+static ssize_t readExactly(IoLine* line, char* buffer, size_t length)
+{
+	size_t bytesRead = 0;
+	while(bytesRead < length)
+	{
+		ssize_t result = line->read(buffer + bytesRead, length - bytesRead);
+		if(result <= 0)
+			return result;
+		bytesRead += result;
+	}
+	return 1;
+}
+
+/*
+ * Length prefix lets whole message be read with one call, into buffer which is reused between reads
+ */
+ssize_t MessageProtocol::Impl::readMessageV2(Message& m)
+{
+	uint32_t bodyLength = 0;
+	ssize_t rc = readExactly(line, reinterpret_cast<char*>(&bodyLength), 4);
+	if(rc <= 0)
+		return rc;
+
+	size_t length = 4 + (size_t)bodyLength + (checksums ? 4 : 0);
+	if(recordBuffer.size() < length)
+		recordBuffer.resize(length);
+	memcpy(recordBuffer.data(), &bodyLength, 4);
+	rc = readExactly(line, recordBuffer.data() + 4, length - 4);
+	if(rc <= 0)
+		return rc;
+
+	return decode(recordBuffer.data(), recordBuffer.data() + length, m);
+}
+
+ssize_t MessageProtocol::readMessage(Message& m)
+{
+	assert(m.size() == 0);
+	return readMessageInto(m);
+}
+
+/*
+ * Frames already present in message are overwritten in place, so their storage is reused
+ */
+ssize_t MessageProtocol::readMessageInto(Message& m)
+{
+	if(m_impl->line->preservesBoundaries())
+		return m_impl->readRecord(m);
+	if(m_impl->wireFormat == WireFormat::V2)
+		return m_impl->readMessageV2(m);
+
+	// Payloads are read straight into frames, so they are checksummed right after each read, while in cache
+	bool checksums = m_impl->checksums;
+	uint32_t crc = 0;
+
+	uint32_t frames = 0;
+	ssize_t rc = readExactly(m_impl->line, reinterpret_cast<char*>(&frames), 4);
+	if(rc <= 0)
+		return rc;
+	if(checksums)
+		crc = crc32c(crc, &frames, 4);
+
+	if(m.size() > frames)
+		m.resize(frames);
+	for(size_t i = 0; i < frames; i++)
+	{
+		uint32_t frameLength = 0;
+		rc = readExactly(m_impl->line, reinterpret_cast<char*>(&frameLength), 4);
+		if(rc <= 0)
+			return rc;
+		if(checksums)
+			crc = crc32c(crc, &frameLength, 4);
+
+		if(i == m.size())
+			m.emplaceFrame(m.resource());
+		if(frameLength == gs_descriptorFrameMarker)
+		{
+			int fd = m_impl->line->takeDescriptor();
+			if(fd < 0)
+				return eUnknown;
+			m.frame(i) = Frame::adoptDescriptor(fd);
+			continue;
+		}
+
+		char* payload = static_cast<char*>(m.frame(i).resize(frameLength, m_impl->frameAlignment));
+		rc = readExactly(m_impl->line, payload, frameLength);
+		if(rc <= 0)
+			return rc;
+		if(checksums)
+			crc = crc32c(crc, payload, frameLength);
+	}
+	if(!checksums)
+		return 1;
+
+	uint32_t expected = 0;
+	rc = readExactly(m_impl->line, reinterpret_cast<char*>(&expected), 4);
+	if(rc <= 0)
+		return rc;
+	return (crc == expected) ? 1 : eChecksumMismatch;
+}
+
+/*
+ * Closes descriptors which line has received with message that is dropped
+ */
+static void discardDescriptors(IoLine* line)
+{
+#ifndef _WIN32
+	int fd;
+	while((fd = line->takeDescriptor()) >= 0)
+		close(fd);
+#endif
+}
+
+ssize_t MessageProtocol::readMessageView(MessageView& view)
+{
+	view.clear();
+
+	auto& buffer = m_impl->viewBuffer;
+	if(!buffer || (buffer.use_count() > 1))
+		buffer = std::make_shared<std::vector<char>>();
+
+	if(m_impl->line->preservesBoundaries())
+	{
+		if(buffer->size() < 65536)
+			buffer->resize(65536);
+
+		ssize_t rc = m_impl->line->readRecord(buffer->data(), buffer->size());
+		while(rc > (ssize_t)buffer->size())
+		{
+			buffer->resize(rc);
+			rc = m_impl->line->readRecord(buffer->data(), buffer->size());
+		}
+		if(rc <= 0)
+			return rc;
+
+		try
+		{
+			view.reset(buffer, rc, m_impl->wireFormat);
+		}
+		catch(const std::length_error& e)
+		{
+			discardDescriptors(m_impl->line);
+			return eUnknown;
+		}
+		if(m_impl->checksums)
+			return verifyChecksum(buffer->data(), view.messageSize(), rc);
+		return 1;
+	}
+
+	buffer->resize(4);
+	ssize_t rc = readExactly(m_impl->line, buffer->data(), 4);
+	if(rc <= 0)
+		return rc;
+
+	// Views don't copy payloads, so checksum, if enabled, is the only pass over them
+	size_t checksumLength = m_impl->checksums ? 4 : 0;
+	if(m_impl->wireFormat == WireFormat::V2)
+	{
+		uint32_t bodyLength;
+		memcpy(&bodyLength, buffer->data(), 4);
+		buffer->resize(4 + (size_t)bodyLength + checksumLength);
+		rc = readExactly(m_impl->line, buffer->data() + 4, bodyLength + checksumLength);
+		if(rc <= 0)
+			return rc;
+
+		try
+		{
+			view.reset(buffer, buffer->size(), WireFormat::V2);
+		}
+		catch(const std::length_error& e)
+		{
+			discardDescriptors(m_impl->line);
+			return eUnknown;
+		}
+		if(m_impl->checksums)
+			return verifyChecksum(buffer->data(), view.messageSize(), buffer->size());
+		return 1;
+	}
+
+	uint32_t frames;
+	memcpy(&frames, buffer->data(), 4);
+	bool hasDescriptors = false;
+	for(size_t i = 0; i < frames; i++)
+	{
+		size_t offset = buffer->size();
+		buffer->resize(offset + 4);
+		rc = readExactly(m_impl->line, buffer->data() + offset, 4);
+		if(rc <= 0)
+			return rc;
+
+		uint32_t frameLength;
+		memcpy(&frameLength, buffer->data() + offset, 4);
+		if(frameLength == gs_descriptorFrameMarker)
+		{
+			hasDescriptors = true;
+			continue;
+		}
+
+		buffer->resize(offset + 4 + frameLength);
+		rc = readExactly(m_impl->line, buffer->data() + offset + 4, frameLength);
+		if(rc <= 0)
+			return rc;
+	}
+
+	size_t messageLength = buffer->size();
+	buffer->resize(messageLength + checksumLength);
+	rc = readExactly(m_impl->line, buffer->data() + messageLength, checksumLength);
+	if(rc <= 0)
+		return rc;
+
+	if(hasDescriptors)
+	{
+		discardDescriptors(m_impl->line);
+		return eUnknown;
+	}
+
+	view.reset(buffer, buffer->size());
+	if(m_impl->checksums)
+		return verifyChecksum(buffer->data(), messageLength, buffer->size());
+	return 1;
+}
+
+static ssize_t writeBuffer(IoLine* line, const std::shared_ptr<const std::vector<char>>& buffer, size_t offset = 0)
+{
+	size_t towrite = buffer->size() - offset;
+	size_t chunk = towrite;
+	while(towrite > 0)
+	{
+		ssize_t done = line->writeShared(buffer, offset, std::min(chunk, towrite));
+		if((done == eTooBigBuffer) && (chunk > 1))
+		{
+			// Line can't accept that much at once (e.g. inproc queue), retry with smaller pieces
+			chunk /= 2;
+			continue;
+		}
+		if(done < 0)
+			return done;
+		towrite -= done;
+		offset += done;
+	}
+	return 1;
+}
+
+static ssize_t writeBuffer(IoLine* line, const char* buffer, size_t length)
+{
+	size_t offset = 0;
+	size_t chunk = length;
+	while(offset < length)
+	{
+		ssize_t done = line->write(const_cast<char*>(buffer) + offset, std::min(chunk, length - offset));
+		if((done == eTooBigBuffer) && (chunk > 1))
+		{
+			chunk /= 2;
+			continue;
+		}
+		if(done < 0)
+			return done;
+		offset += done;
+	}
+	return 1;
+}
+
+/*
+ * Parts are written in order with IoLine::writeGathered(), which is retried after short writes
+ */
+static ssize_t writeParts(IoLine* line, IoVec* parts, size_t count)
+{
+	while(count > 0)
+	{
+		ssize_t done = line->writeGathered(parts, count);
+		if(done == eTooBigBuffer)
+		{
+			// Line can't accept that much at once (e.g. inproc queue), parts are written one by one in smaller pieces
+			for(size_t i = 0; i < count; i++)
+			{
+				ssize_t rc = writeBuffer(line, (const char*)parts[i].data, parts[i].length);
+				if(rc < 0)
+					return rc;
+			}
+			return 1;
+		}
+		if(done < 0)
+			return done;
+
+		while((count > 0) && ((size_t)done >= parts->length))
+		{
+			done -= parts->length;
+			parts++;
+			count--;
+		}
+		if(count > 0)
+		{
+			parts->data = (const char*)parts->data + done;
+			parts->length -= done;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Descriptors are attached to the first bytes of serialized message, so peer has them queued by the time it
+ * reads frame length markers. Whole message goes in one write on lines which preserve boundaries.
+ */
+ssize_t MessageProtocol::Impl::sendWithDescriptors(const Message& m)
+{
+	ssize_t rc = encode(m);
+	if(rc < 0)
+		return rc;
+
+	rc = line->writeWithDescriptors(sendBuffer->data(), sendBuffer->size(), descriptors.data(), descriptors.size());
+	if(rc < 0)
+		return rc;
+	if((size_t)rc == sendBuffer->size())
+		return 1;
+	return writeBuffer(line, sendBuffer, rc);
+}
+
+/*
+ * Sends in-memory parts of message from send buffer and file regions with IoLine::sendFileRegion(), so that
+ * socket lines can transmit them directly from page cache
+ */
+ssize_t MessageProtocol::Impl::sendWithFileRegions(const Message& m)
+{
+	sendBuffer->clear();
+	if(wireFormat == WireFormat::V2)
+	{
+		size_t size = wireMessageSize(m, wireFormat);
+		if(size - 4 > UINT32_MAX)
+			return eTooBigBuffer;
+		uint32_t bodyLength = size - 4;
+		sendBuffer->insert(sendBuffer->end(), (char*)&bodyLength, (char*)&bodyLength + 4);
+	}
+	appendLength(m.size());
+	for(size_t i = 0; i < m.size(); i++)
+	{
+		const Frame& frame = m.frame(i);
+		appendLength(frame.size());
+		if(!frame.isFileRegion())
+		{
+			sendBuffer->insert(sendBuffer->end(), (const char*)frame.data(), (const char*)frame.data() + frame.size());
+			continue;
+		}
+
+		ssize_t rc = writeBuffer(line, sendBuffer);
+		if(rc < 0)
+			return rc;
+		if(sendBuffer.use_count() > 1)
+			sendBuffer = std::make_shared<std::vector<char>>();
+		sendBuffer->clear();
+
+		rc = line->sendFileRegion(frame.fileDescriptor(), frame.fileOffset(), frame.size());
+		if(rc < 0)
+			return rc;
+	}
+	if(sendBuffer->empty())
+		return 1;
+	return writeBuffer(line, sendBuffer);
+}
+
+ssize_t MessageProtocol::sendMessage(const Message& m)
+{
+	auto& buffer = m_impl->sendBuffer;
+	if(!buffer || (buffer.use_count() > 1))
+		buffer = std::make_shared<std::vector<char>>();
+
+	m_impl->descriptors.clear();
+	for(size_t i = 0; i < m.size(); i++)
+	{
+		if(m.frame(i).isDescriptor())
+			m_impl->descriptors.push_back(m.frame(i).descriptor());
+	}
+	if(!m_impl->descriptors.empty())
+		return m_impl->sendWithDescriptors(m);
+
+	if(m_impl->line->preservesBoundaries())
+		return m_impl->sendRecord(m);
+
+	// With checksums, file regions have to be read anyway, so they are sent from memory
+	if(!m_impl->checksums)
+	{
+		for(size_t i = 0; i < m.size(); i++)
+		{
+			if(m.frame(i).isFileRegion())
+				return m_impl->sendWithFileRegions(m);
+		}
+	}
+
+	ssize_t rc = m_impl->encode(m);
+	if(rc < 0)
+		return rc;
+	return writeBuffer(m_impl->line, buffer);
+}
+
+/*
+ * Compact messages are kept in WireFormat::V1, for other formats they are converted on send. Message is copied
+ * to send buffer together with its checksum, which is computed in the same pass.
+ */
+template <typename Source>
+ssize_t MessageProtocol::Impl::sendReencoded(const Source& m)
+{
+	if(!sendBuffer || (sendBuffer.use_count() > 1))
+		sendBuffer = std::make_shared<std::vector<char>>();
+
+	ssize_t rc = encode(m);
+	if(rc < 0)
+		return rc;
+	if(line->preservesBoundaries())
+	{
+		IoVec part { sendBuffer->data(), sendBuffer->size() };
+		rc = line->writeRecord(&part, 1);
+		if(rc < 0)
+			return rc;
+		return 1;
+	}
+	return writeBuffer(line, sendBuffer);
+}
+
+/*
+ * Sends message which is already serialized in protocol's wire format, followed by its checksum if enabled.
+ * Checksum is computed here unless it is given. Shared buffer, if given, is passed to line as is when there
+ * is no checksum to send after it.
+ */
+ssize_t MessageProtocol::Impl::sendSerialized(const char* data, size_t length,
+		const std::shared_ptr<const std::vector<char>>& shared, const uint32_t* checksum)
+{
+	if(checksums)
+		sentChecksum = checksum ? *checksum : crc32c(0, data, length);
+
+	IoVec parts[2] = { { data, length }, { &sentChecksum, 4 } };
+	if(line->preservesBoundaries())
+	{
+		ssize_t rc = line->writeRecord(parts, checksums ? 2 : 1);
+		if(rc < 0)
+			return rc;
+		return 1;
+	}
+
+	if(checksums)
+		return writeParts(line, parts, 2);
+	return shared ? writeBuffer(line, shared) : writeBuffer(line, data, length);
+}
+
+/*
+ * Compact message is already in wire format, so it is written as is. Message can still be changed in place, so
+ * its checksum is not kept: on stream lines it is computed while message is copied to send buffer, which is then
+ * sent with one write.
+ */
+ssize_t MessageProtocol::sendMessage(const CompactMessage& m)
+{
+	if((m_impl->wireFormat != WireFormat::V1) || (m_impl->checksums && !m_impl->line->preservesBoundaries()))
+		return m_impl->sendReencoded(m);
+	return m_impl->sendSerialized((const char*)m.data(), m.messageSize(), nullptr, nullptr);
+}
+
+/*
+ * Encoding is shared with line, so that lines which keep buffer referenced (zero-copy sockets, vmsplice)
+ * don't need to copy it. Its checksum is computed once and kept with message.
+ */
+ssize_t MessageProtocol::sendMessage(const SharedMessage& m)
+{
+	uint32_t checksum = 0;
+	uint32_t* wanted = m_impl->checksums ? &checksum : nullptr;
+	auto buffer = m.buffer(m_impl->wireFormat, wanted);
+	if(!buffer)
+		return eTooBigBuffer;
+	return m_impl->sendSerialized(buffer->data(), buffer->size(), buffer, wanted);
+}
+
+void MessageProtocol::setFrameAlignment(size_t alignment)
+{
+	if((alignment == 0) || ((alignment & (alignment - 1)) != 0))
+		throw IoException("Frame alignment should be power of two");
+	m_impl->frameAlignment = alignment;
+}
+
+void MessageProtocol::setWireFormat(WireFormat format)
+{
+	if((format != WireFormat::V1) && (format != WireFormat::V2))
+		throw IoException("Unknown wire format");
+	m_impl->wireFormat = format;
+}
+
+WireFormat MessageProtocol::wireFormat() const
+{
+	return m_impl->wireFormat;
+}
+
+void MessageProtocol::setChecksums(bool enabled)
+{
+	m_impl->checksums = enabled;
+}
+
+bool MessageProtocol::checksums() const
+{
+	return m_impl->checksums;
+}
+
+// "CPIO" followed by newest supported format
+static const uint32_t gs_handshakeMagic = 0x4f495043;
+
+/*
+ * Both sides send their handshake before reading peer's one, so the order in which peers call this doesn't matter
+ */
+ssize_t MessageProtocol::negotiateWireFormat(WireFormat preferred)
+{
+	if((preferred != WireFormat::V1) && (preferred != WireFormat::V2))
+		throw IoException("Unknown wire format");
+
+	IoLine* line = m_impl->line;
+	uint32_t handshake[2] = { gs_handshakeMagic, (uint32_t)preferred };
+	uint32_t peerHandshake[2] = { 0, 0 };
+	ssize_t rc;
+	if(line->preservesBoundaries())
+	{
+		IoVec part { handshake, sizeof(handshake) };
+		rc = line->writeRecord(&part, 1);
+		if(rc < 0)
+			return rc;
+		rc = line->readRecord(peerHandshake, sizeof(peerHandshake));
+		if(rc <= 0)
+			return rc;
+		if(rc != sizeof(peerHandshake))
+			return eUnknown;
+	}
+	else
+	{
+		rc = writeBuffer(line, (const char*)handshake, sizeof(handshake));
+		if(rc < 0)
+			return rc;
+		rc = readExactly(line, (char*)peerHandshake, sizeof(peerHandshake));
+		if(rc <= 0)
+			return rc;
+	}
+
+	if((peerHandshake[0] != gs_handshakeMagic) || (peerHandshake[1] < (uint32_t)WireFormat::V1))
+		return eUnknown;
+	m_impl->wireFormat = (WireFormat)std::min(peerHandshake[1], (uint32_t)preferred);
+	return 1;
+}
 
 IoLine* MessageProtocol::getLine() const
 {
@@ -3,6 +3,8 @@
 
 #include "../common/inproc.h"
 #include "io_socket.h"
+#include "shm.h"
+#include "pipes.h"
 
 namespace cppio
 {
@@ -11,7 +13,11 @@ namespace cppio
 		auto manager = new IoLineManager();
 		manager->registerFactory(std::unique_ptr<InprocLineFactory>(new InprocLineFactory));
 		manager->registerFactory(std::unique_ptr<UnixSocketFactory>(new UnixSocketFactory));
+		manager->registerFactory(std::unique_ptr<UnixSeqPacketFactory>(new UnixSeqPacketFactory));
 		manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+		manager->registerFactory(std::unique_ptr<ShmLineFactory>(new ShmLineFactory));
+		manager->registerFactory(std::unique_ptr<UdpSocketFactory>(new UdpSocketFactory));
+		manager->registerFactory(std::unique_ptr<PipeLineFactory>(new PipeLineFactory));
 		return manager;
 	}
 }
@@ -1,22 +1,199 @@
 #include "io_socket.h"
+#include "resolver.h"
 
 #include <cstdlib>
 #include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <thread>
+#include <mutex>
 
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
 
 namespace cppio
 {
 
-UnixSocket::UnixSocket(const std::string& address) : m_address(address)
+// RFC 8305 recommended delay before starting connection to next address
+static const std::chrono::milliseconds gs_connectionAttemptDelay(250);
+// Kernel limit for descriptors in one SCM_RIGHTS message (SCM_MAX_FD)
+static const size_t gs_maxDescriptors = 253;
+// Used if seqpacket socket doesn't report its send buffer size
+static const size_t gs_defaultMaxRecordSize = 212992;
+
+static void setIntOption(int socket, int level, int name, int value)
+{
+	if(setsockopt(socket, level, name, &value, sizeof(value)) < 0)
+		throw IoException("Unable to set socket option " + std::to_string(name) + ": " + std::to_string(errno));
+}
+
+static void setTimeoutOption(int socket, int name, int msecs)
+{
+	int secs = msecs / 1000;
+	int restMsecs = msecs - secs * 1000;
+	struct timeval timeout;
+	timeout.tv_sec = secs;
+	timeout.tv_usec = restMsecs * 1000;
+
+	setsockopt(socket, SOL_SOCKET, name, (char*)&timeout, sizeof(timeout));
+}
+
+/*
+ * Waits for listening (non-blocking) socket to become readable and accepts all pending connections.
+ * Accepted sockets are left in blocking mode, as lines rely on blocking reads with SO_RCVTIMEO.
+ */
+static void acceptConnections(int socket, size_t maxConnections, int timeoutInMs, std::vector<int>& sockets)
+{
+	if(maxConnections == 0)
+		return;
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutInMs);
+	while(true)
+	{
+		pollfd pfd;
+		pfd.fd = socket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		int timeout = timeoutInMs;
+		if(timeoutInMs > 0)
+			timeout = std::max<int>(0, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+
+		int rc = ::poll(&pfd, 1, timeout);
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc < 0)
+			throw IoException("Unable to poll listening socket: " + std::to_string(errno));
+		if(rc == 0)
+			return;
+
+		while(sockets.size() < maxConnections)
+		{
+			int newsock = accept4(socket, nullptr, nullptr, SOCK_CLOEXEC);
+			if(newsock < 0)
+			{
+				if(errno == EINTR || errno == ECONNABORTED)
+					continue;
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				// Out of descriptors or memory: listening socket stays readable, so retrying would spin
+				if(sockets.empty())
+					throw IoException("Unable to accept connection: " + std::to_string(errno));
+				return;
+			}
+			sockets.push_back(newsock);
+		}
+
+		// Connection may have been reset between poll() and accept(), keep waiting in that case
+		if(!sockets.empty() || timeoutInMs == 0)
+			return;
+		if((timeoutInMs > 0) && (std::chrono::steady_clock::now() >= deadline))
+			return;
+	}
+}
+
+/*
+ * Idle connected socket is healthy if it has neither pending error, nor EOF, nor unexpected data
+ */
+static bool socketIsConnected(int socket)
+{
+	if(socket < 0)
+		return false;
+
+	pollfd pfd;
+	pfd.fd = socket;
+	pfd.events = POLLIN | POLLRDHUP;
+	pfd.revents = 0;
+	int rc = ::poll(&pfd, 1, 0);
+	if(rc < 0)
+		return false;
+	return pfd.revents == 0;
+}
+
+static ssize_t recordError()
+{
+	if((errno == ECONNRESET) || (errno == ENOTCONN) || (errno == EPIPE))
+		return eConnectionLost;
+	if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		return eTimeout;
+	if(errno == EMSGSIZE)
+		return eTooBigBuffer;
+	return eUnknown;
+}
+
+/*
+ * Handles options common for all socket types
+ */
+static void setSocketOption(int socket, LineOption option, void* data)
+{
+	int value = *(int*)data;
+	switch(option)
+	{
+		case LineOption::ReceiveTimeout:
+			setTimeoutOption(socket, SO_RCVTIMEO, value);
+			break;
+
+		case LineOption::SendTimeout:
+			setTimeoutOption(socket, SO_SNDTIMEO, value);
+			break;
+
+		case LineOption::SendBufferSize:
+			setIntOption(socket, SOL_SOCKET, SO_SNDBUF, value);
+			break;
+
+		case LineOption::ReceiveBufferSize:
+			setIntOption(socket, SOL_SOCKET, SO_RCVBUF, value);
+			break;
+
+		case LineOption::Priority:
+			setIntOption(socket, SOL_SOCKET, SO_PRIORITY, value);
+			break;
+
+		default:
+			throw UnsupportedOption("");
+	}
+}
+
+/*
+ * Fills sockaddr_un for path, or for abstract namespace name if address starts with '@'
+ */
+static socklen_t unixAddress(const std::string& address, sockaddr_un& addr)
 {
-	m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(address.size() >= sizeof(addr.sun_path))
+		throw IoException("Unix socket address is too long: " + address);
+
+	memcpy(addr.sun_path, address.data(), address.size());
+	if(!address.empty() && address[0] == '@')
+	{
+		addr.sun_path[0] = '\0';
+		return offsetof(sockaddr_un, sun_path) + address.size();
+	}
+	return offsetof(sockaddr_un, sun_path) + address.size() + 1;
+}
+
+static void unlinkUnixAddress(const std::string& address)
+{
+	if(!address.empty() && address[0] != '@')
+		unlink(address.c_str());
+}
+
+UnixSocket::UnixSocket(const std::string& address, int type) : m_address(address)
+{
+	m_socket = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
 	if(m_socket < 0)
 		throw IoException(std::string("Unable to create socket: " + std::to_string(m_socket)));
 }
@@ -29,25 +206,67 @@ UnixSocket::UnixSocket(int fd, const std::string& address)
 
 UnixSocket::~UnixSocket()
 {
+	for(int fd : m_descriptors)
+		close(fd);
 	close(m_socket);
-	unlink(m_address.c_str());
 }
 
 void UnixSocket::connect()
 {
-	sockaddr serverName;
-	serverName.sa_family = AF_UNIX;
-	strncpy(serverName.sa_data, m_address.c_str(), sizeof(serverName.sa_data));
+	sockaddr_un serverName;
+	socklen_t length = unixAddress(m_address, serverName);
 
-	int rc = ::connect(m_socket, &serverName, strlen(serverName.sa_data) + sizeof(serverName.sa_family));
+	int rc = ::connect(m_socket, (sockaddr*)&serverName, length);
 	if(rc < 0)
 		throw IoException(std::string("Unable to connect to socket: " + std::to_string(rc) + "/" + std::to_string(errno)));
 }
 
 
+ssize_t UnixSocket::receive(void* buffer, size_t buflen, int flags)
+{
+	iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = buflen;
+	return receive(&iov, 1, flags);
+}
+
+ssize_t UnixSocket::receive(iovec* parts, size_t count, int flags)
+{
+	union
+	{
+		cmsghdr header;
+		char data[CMSG_SPACE(gs_maxDescriptors * sizeof(int))];
+	} control;
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = parts;
+	msg.msg_iovlen = count;
+	msg.msg_control = control.data;
+	msg.msg_controllen = sizeof(control.data);
+
+	ssize_t rc = recvmsg(m_socket, &msg, flags | MSG_CMSG_CLOEXEC);
+	if(rc < 0 || msg.msg_controllen == 0)
+		return rc;
+
+	for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(size_t i = 0; i < count; i++)
+		{
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			m_descriptors.push_back(fd);
+		}
+	}
+	return rc;
+}
+
 ssize_t UnixSocket::read(void* buffer, size_t buflen)
 {
-	ssize_t rc = ::read(m_socket, buffer, buflen);
+	ssize_t rc = receive(buffer, buflen, 0);
 	if(rc < 0)
 	{
 		if((errno == ECONNRESET) || (errno == ENOTCONN))
@@ -78,61 +297,223 @@ ssize_t UnixSocket::write(void* buffer, size_t buflen)
 	return rc;
 }
 
+ssize_t UnixSocket::writeGathered(const IoVec* parts, size_t count)
+{
+	ssize_t rc = ::writev(m_socket, reinterpret_cast<const iovec*>(parts), count);
+	if(rc <= 0)
+	{
+		if((errno == ECONNRESET) || (errno == ENOTCONN))
+			return eConnectionLost;
+		return eUnknown;
+	}
+	return rc;
+}
+
+/*
+ * Sends file region with sendfile(), so that its contents are not copied to user space
+ */
+static ssize_t sendFileToSocket(int socket, int fd, uint64_t offset, size_t length)
+{
+	off_t position = offset;
+	size_t towrite = length;
+	while(towrite > 0)
+	{
+		ssize_t rc = sendfile(socket, fd, &position, towrite);
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc < 0)
+		{
+			if((errno == ECONNRESET) || (errno == ENOTCONN) || (errno == EPIPE))
+				return eConnectionLost;
+			return eUnknown;
+		}
+		if(rc == 0)
+			return eUnknown;
+		towrite -= rc;
+	}
+	return length;
+}
+
+ssize_t UnixSocket::sendFileRegion(int fd, uint64_t offset, size_t length)
+{
+	return sendFileToSocket(m_socket, fd, offset, length);
+}
+
 void UnixSocket::setOption(LineOption option, void* data)
 {
-	switch(option)
+	setSocketOption(m_socket, option, data);
+}
+
+ssize_t UnixSocket::writeWithDescriptors(const void* buffer, size_t buflen, const int* fds, size_t count)
+{
+	if(count > gs_maxDescriptors)
+		throw IoException("Too many descriptors in one write: " + std::to_string(count));
+
+	iovec iov;
+	iov.iov_base = const_cast<void*>(buffer);
+	iov.iov_len = buflen;
+
+	union
 	{
-		case LineOption::ReceiveTimeout:
-			{
-				int msecs = *(int*)data;
-				int secs = msecs / 1000;
-				int restMsecs = msecs - secs * 1000;
-				struct timeval timeout;
-				timeout.tv_sec = secs;
-				timeout.tv_usec = restMsecs * 1000;
-
-				setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout,
-							sizeof(timeout));
-			}
-			break;
+		cmsghdr header;
+		char data[CMSG_SPACE(gs_maxDescriptors * sizeof(int))];
+	} control;
+	memset(control.data, 0, sizeof(control.data));
 
-		case LineOption::SendTimeout:
-			{
-				int msecs = *(int*)data;
-				int secs = msecs / 1000;
-				int restMsecs = msecs - secs * 1000;
-				struct timeval timeout;
-				timeout.tv_sec = secs;
-				timeout.tv_usec = restMsecs * 1000;
-
-				setsockopt(m_socket, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout,
-							sizeof(timeout));
-			}
-			break;
-		default:
-			throw UnsupportedOption("");
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(count > 0)
+	{
+		msg.msg_control = control.data;
+		msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+	}
+
+	ssize_t rc;
+	do
+	{
+		rc = sendmsg(m_socket, &msg, MSG_NOSIGNAL);
+	} while(rc < 0 && errno == EINTR);
+	if(rc < 0)
+		return recordError();
+	return rc;
+}
+
+int UnixSocket::takeDescriptor()
+{
+	if(m_descriptors.empty())
+		return -1;
+	int fd = m_descriptors.front();
+	m_descriptors.pop_front();
+	return fd;
+}
+
+bool UnixSocket::isConnected()
+{
+	return socketIsConnected(m_socket);
+}
+
+UnixSeqPacketSocket::UnixSeqPacketSocket(const std::string& address) : UnixSocket(address, SOCK_SEQPACKET),
+	m_maxRecordSize(0)
+{
+}
+
+UnixSeqPacketSocket::UnixSeqPacketSocket(int fd, const std::string& address) : UnixSocket(fd, address),
+	m_maxRecordSize(0)
+{
+}
+
+UnixSeqPacketSocket::~UnixSeqPacketSocket()
+{
+}
+
+// IoVec is passed to sendmsg() as is
+static_assert(sizeof(IoVec) == sizeof(iovec) && offsetof(IoVec, data) == offsetof(iovec, iov_base) &&
+		offsetof(IoVec, length) == offsetof(iovec, iov_len), "IoVec should match struct iovec");
+
+ssize_t UnixSeqPacketSocket::writeRecord(const IoVec* parts, size_t count)
+{
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = reinterpret_cast<iovec*>(const_cast<IoVec*>(parts));
+	msg.msg_iovlen = count;
+
+	ssize_t rc = sendmsg(m_socket, &msg, MSG_NOSIGNAL);
+	if(rc < 0)
+		return recordError();
+	return rc;
+}
+
+/*
+ * Record is received with one recvmsg(). Part which doesn't fit in caller's buffer is scattered to per-thread
+ * overflow buffer, and then whole record is kept in line until caller retries with bigger buffer.
+ */
+ssize_t UnixSeqPacketSocket::readRecord(void* buffer, size_t buflen)
+{
+	if(!m_pending.empty())
+	{
+		size_t length = m_pending.size();
+		if(length > buflen)
+			return length;
+		memcpy(buffer, m_pending.data(), length);
+		m_pending.clear();
+		return length;
+	}
+
+	// Peer can't send record bigger than its send buffer, which is assumed to be the same as ours
+	if(m_maxRecordSize == 0)
+	{
+		int size = 0;
+		socklen_t length = sizeof(size);
+		if((getsockopt(m_socket, SOL_SOCKET, SO_SNDBUF, &size, &length) < 0) || (size <= 0))
+			size = gs_defaultMaxRecordSize;
+		m_maxRecordSize = size;
 	}
+	static thread_local std::vector<char> overflow;
+	if(overflow.size() < m_maxRecordSize)
+		overflow.resize(m_maxRecordSize);
+
+	iovec parts[2];
+	parts[0].iov_base = buffer;
+	parts[0].iov_len = buflen;
+	parts[1].iov_base = overflow.data();
+	parts[1].iov_len = overflow.size();
+
+	// With MSG_TRUNC, recvmsg() returns full record size even if it didn't fit
+	ssize_t rc = receive(parts, 2, MSG_TRUNC);
+	if(rc < 0)
+		return recordError();
+	if(rc == 0)
+		return eConnectionLost;
+	if((size_t)rc <= buflen)
+		return rc;
+	if((size_t)rc > buflen + overflow.size())
+		return eTooBigBuffer;
+
+	m_pending.assign(static_cast<const char*>(buffer), static_cast<const char*>(buffer) + buflen);
+	m_pending.insert(m_pending.end(), overflow.data(), overflow.data() + (rc - buflen));
+	return rc;
 }
 
-UnixSocketAcceptor::UnixSocketAcceptor(const std::string& address) : m_address(address)
+UnixSocketAcceptor::UnixSocketAcceptor(const std::string& address, const LineOptions& options, int type) : m_address(address),
+	m_options(options),
+	m_type(type)
 {
-	m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	m_socket = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if(m_socket < 0)
 		throw IoException(std::string("Unable to create socket: " + std::to_string(m_socket)));
 
-	sockaddr serverName;
-	serverName.sa_family = AF_UNIX;
-	strncpy(serverName.sa_data, m_address.c_str(), sizeof(serverName.sa_data));
+	sockaddr_un serverName;
+	socklen_t length;
+	try
+	{
+		length = unixAddress(m_address, serverName);
+	}
+	catch(const IoException& e)
+	{
+		close(m_socket);
+		throw;
+	}
 
-	int rc = bind(m_socket, &serverName, strlen(serverName.sa_data) + sizeof(serverName.sa_family));
+	int rc = bind(m_socket, (sockaddr*)&serverName, length);
 	if(rc < 0)
-		throw IoException(std::string("Unable to bind socket: " + std::to_string(rc)));
+	{
+		close(m_socket);
+		throw IoException(std::string("Unable to bind socket: " + std::to_string(rc) + "/" + std::to_string(errno)));
+	}
 
-	rc = listen(m_socket, 10);
+	rc = listen(m_socket, SOMAXCONN);
 	if(rc < 0)
 	{
 		close(m_socket);
-		unlink(m_address.c_str());
+		unlinkUnixAddress(m_address);
 		throw IoException(std::string("Unable to listen socket: " + std::to_string(rc)));
 	}
 }
@@ -140,19 +521,43 @@ UnixSocketAcceptor::UnixSocketAcceptor(const std::string& address) : m_address(a
 UnixSocketAcceptor::~UnixSocketAcceptor()
 {
 	close(m_socket);
-	unlink(m_address.c_str());
+	unlinkUnixAddress(m_address);
 }
 
 IoLine* UnixSocketAcceptor::waitConnection(int timeoutInMs)
 {
-	sockaddr addr;
-	socklen_t clen = sizeof(addr);
-	int newsock = accept(m_socket, &addr, &clen);
-	if(newsock > 0)
+	auto lines = waitConnections(1, timeoutInMs);
+	if(lines.empty())
+		return nullptr;
+	return lines.front();
+}
+
+std::vector<IoLine*> UnixSocketAcceptor::waitConnections(size_t maxConnections, int timeoutInMs)
+{
+	std::vector<int> sockets;
+	acceptConnections(m_socket, maxConnections, timeoutInMs, sockets);
+
+	std::vector<IoLine*> lines;
+	for(int newsock : sockets)
 	{
-		return new UnixSocket(newsock, "");
+		if(m_type == SOCK_SEQPACKET)
+			lines.push_back(new UnixSeqPacketSocket(newsock, ""));
+		else
+			lines.push_back(new UnixSocket(newsock, ""));
 	}
-	return nullptr;
+
+	try
+	{
+		for(auto line : lines)
+			applyLineOptions(line, m_options);
+	}
+	catch(const IoException& e)
+	{
+		for(auto line : lines)
+			delete line;
+		throw;
+	}
+	return lines;
 }
 
 UnixSocketFactory::~UnixSocketFactory()
@@ -166,27 +571,64 @@ bool UnixSocketFactory::supportsScheme(const std::string& scheme)
 
 IoLine* UnixSocketFactory::createClient(const std::string& address)
 {
-	auto socket = new UnixSocket(address);
-	if(socket)
-		socket->connect();
-	return socket;
+	LineOptions options;
+	auto baseAddress = splitLineOptions(address, options);
+	std::unique_ptr<UnixSocket> socket(new UnixSocket(baseAddress));
+	applyLineOptions(socket.get(), options);
+	socket->connect();
+	return socket.release();
 }
 
 IoAcceptor* UnixSocketFactory::createServer(const std::string& address)
 {
-	return new UnixSocketAcceptor(address);
+	LineOptions options;
+	auto baseAddress = splitLineOptions(address, options);
+	return new UnixSocketAcceptor(baseAddress, options);
+}
+
+UnixSeqPacketFactory::~UnixSeqPacketFactory()
+{
+}
+
+bool UnixSeqPacketFactory::supportsScheme(const std::string& scheme)
+{
+	return scheme == "seqpacket";
+}
+
+IoLine* UnixSeqPacketFactory::createClient(const std::string& address)
+{
+	LineOptions options;
+	auto baseAddress = splitLineOptions(address, options);
+	std::unique_ptr<UnixSeqPacketSocket> socket(new UnixSeqPacketSocket(baseAddress));
+	applyLineOptions(socket.get(), options);
+	socket->connect();
+	return socket.release();
+}
+
+IoAcceptor* UnixSeqPacketFactory::createServer(const std::string& address)
+{
+	LineOptions options;
+	auto baseAddress = splitLineOptions(address, options);
+	return new UnixSocketAcceptor(baseAddress, options, SOCK_SEQPACKET);
 }
 
 ///////
 
-TcpSocket::TcpSocket(const std::string& address) : m_address(address)
+TcpSocket::TcpSocket(const std::string& address) : m_address(address),
+	m_socket(-1),
+	m_quickAck(false),
+	m_zeroCopyThreshold(0),
+	m_zeroCopySequence(0),
+	m_nextAddress(0),
+	m_lastError(0)
 {
-	m_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if(m_socket < 0)
-		throw IoException(std::string("Unable to create socket: " + std::to_string(m_socket)));
 }
 
-TcpSocket::TcpSocket(int fd, const std::string& address)
+TcpSocket::TcpSocket(int fd, const std::string& address) : m_quickAck(false),
+	m_zeroCopyThreshold(0),
+	m_zeroCopySequence(0),
+	m_nextAddress(0),
+	m_lastError(0)
 {
 	m_socket = fd;
 	m_address = address;
@@ -194,162 +636,1133 @@ TcpSocket::TcpSocket(int fd, const std::string& address)
 
 TcpSocket::~TcpSocket()
 {
-	close(m_socket);
+	for(int attempt : m_attempts)
+		close(attempt);
+
+	if(m_socket >= 0)
+	{
+		// Buffers should not be released while kernel may still read them
+		waitZeroCopyCompletions(1000);
+		close(m_socket);
+	}
 }
 
-void TcpSocket::connect()
+static void setNonBlocking(int socket, bool nonBlocking)
 {
-	auto semicolon = m_address.find(':');
-	auto host = m_address.substr(0, semicolon);
-	auto port = atoi(m_address.substr(semicolon + 1).c_str());
-	sockaddr_in addr;
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = inet_addr(host.c_str());
-	addr.sin_port = htons(port);
-	
-	int rc = ::connect(m_socket, (sockaddr*)&addr, sizeof(addr));
-	if(rc < 0)
-		throw IoException(std::string("Unable to connect socket: " + std::to_string(rc) + "/" + std::to_string(errno)));
+	int flags = fcntl(socket, F_GETFL, 0);
+	if(flags < 0)
+		throw IoException("Unable to get socket flags: " + std::to_string(errno));
+	flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	if(fcntl(socket, F_SETFL, flags) < 0)
+		throw IoException("Unable to set socket flags: " + std::to_string(errno));
 }
 
+static int remainingMs(const std::chrono::steady_clock::time_point& deadline)
+{
+	return std::max<int>(0, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+}
 
-ssize_t TcpSocket::read(void* buffer, size_t buflen)
+void TcpSocket::connect()
 {
-	ssize_t rc = ::read(m_socket, buffer, buflen);
-	if(rc < 0)
-	{
-		if((errno == ECONNRESET) || (errno == ENOTCONN))
-			return eConnectionLost;
-		if(errno == EAGAIN)
-			return eTimeout;
-		return eUnknown;
-	}
-	else if(rc == 0)
+	if(startConnect())
+		return;
+
+	std::vector<pollfd> pfds;
+	while(true)
 	{
-		if(errno != ETIMEDOUT)
-			return eConnectionLost;
-		return eTimeout;
+		pfds.clear();
+		pollDescriptors(pfds);
+		auto wakeup = nextAttemptTime();
+		int timeout = wakeup == std::chrono::steady_clock::time_point::max() ? -1 : remainingMs(wakeup);
+		int rc = ::poll(pfds.data(), pfds.size(), timeout);
+		if(rc < 0 && errno != EINTR)
+			throw IoException("Unable to poll socket: " + std::to_string(errno));
+		if(processConnect(pfds.data(), pfds.size()))
+			return;
 	}
-	return rc;
 }
 
-ssize_t TcpSocket::write(void* buffer, size_t buflen)
+bool TcpSocket::startConnect()
 {
-	ssize_t rc = ::write(m_socket, buffer, buflen);
-	if(rc <= 0)
-		return eUnknown;
-	return rc;
+	return startConnect(resolveAddress(m_address, false));
 }
 
-void TcpSocket::setOption(LineOption option, void* data)
+bool TcpSocket::startConnect(const std::vector<ResolvedAddress>& addresses)
 {
-	switch(option)
-	{
-		case LineOption::ReceiveTimeout:
-			{
-				int msecs = *(int*)data;
-				int secs = msecs / 1000;
-				int restMsecs = msecs - secs * 1000;
-				struct timeval timeout;
-				timeout.tv_sec = secs;
-				timeout.tv_usec = restMsecs * 1000;
-
-				setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout,
-							sizeof(timeout));
-			}
-			break;
-
-		case LineOption::SendTimeout:
-			{
-				int msecs = *(int*)data;
-				int secs = msecs / 1000;
-				int restMsecs = msecs - secs * 1000;
-				struct timeval timeout;
-				timeout.tv_sec = secs;
-				timeout.tv_usec = restMsecs * 1000;
-
-				setsockopt(m_socket, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout,
-							sizeof(timeout));
-			}
-			break;
-		default:
-			throw UnsupportedOption("");
-	}
+	m_addresses = addresses;
+	m_nextAddress = 0;
+	return startNextAttempt();
 }
 
-TcpSocketAcceptor::TcpSocketAcceptor(const std::string& address) : m_address(address)
+bool TcpSocket::startNextAttempt()
 {
-	m_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if(m_socket < 0)
-		throw IoException(std::string("Unable to create socket: " + std::to_string(m_socket)));
-
-	int enable = 1;
-	if(setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-		throw IoException(std::string("Unable to set socket option: " + std::to_string(m_socket)));
+	while(m_nextAddress < m_addresses.size())
+	{
+		const auto& address = m_addresses[m_nextAddress++];
+		m_nextAttemptTime = std::chrono::steady_clock::now() + gs_connectionAttemptDelay;
 
+		int attempt = socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(attempt < 0)
+			continue;
 
-	auto semicolon = m_address.find(':');
-	auto host = m_address.substr(0, semicolon);
-	auto port = atoi(m_address.substr(semicolon + 1).c_str());
-	sockaddr_in serverName;
-	memset(&serverName, 0, sizeof(serverName));
-	serverName.sin_family = AF_INET;
-	if(host != "*")
-		serverName.sin_addr.s_addr = inet_addr(host.c_str());
-	else
-		serverName.sin_addr.s_addr = INADDR_ANY;
-	serverName.sin_port = htons(port);
+		try
+		{
+			for(auto option : m_deferredOptions)
+				setAttemptOption(attempt, option.first, option.second);
+		}
+		catch(const IoException& e)
+		{
+			close(attempt);
+			throw;
+		}
 
-	int rc = bind(m_socket, (sockaddr*)&serverName, sizeof(serverName));
-	if(rc < 0)
-		throw IoException(std::string("Unable to bind tcp socket: " + std::to_string(rc)) + "/" + std::to_string(errno));
+		int rc = ::connect(attempt, (const sockaddr*)&address.address, address.length);
+		if(rc == 0)
+		{
+			completeConnect(attempt);
+			return true;
+		}
+		if(errno == EINPROGRESS)
+		{
+			m_attempts.push_back(attempt);
+			return false;
+		}
 
-	rc = listen(m_socket, 10);
-	if(rc < 0)
-	{
-		close(m_socket);
-		throw IoException(std::string("Unable to listen socket: " + std::to_string(rc)));
+		// Immediate failure (e.g. unreachable address family), go on with next address right away
+		m_lastError = errno;
+		close(attempt);
 	}
-}
 
-TcpSocketAcceptor::~TcpSocketAcceptor()
-{
-	close(m_socket);
+	if(m_attempts.empty())
+		throw IoException("Unable to connect socket: " + m_address + "/" + std::to_string(m_lastError));
+	return false;
 }
 
-IoLine* TcpSocketAcceptor::waitConnection(int timeoutInMs)
+void TcpSocket::setAttemptOption(int attempt, LineOption option, int value)
 {
-	sockaddr addr;
-	socklen_t clen = sizeof(addr);
-	int newsock = accept(m_socket, &addr, &clen);
-	if(newsock > 0)
+	int previous = m_socket;
+	m_socket = attempt;
+	try
 	{
-		return new TcpSocket(newsock, "");
+		setOption(option, &value);
 	}
-	return nullptr;
+	catch(const IoException& e)
+	{
+		m_socket = previous;
+		throw;
+	}
+	m_socket = previous;
 }
 
-TcpSocketFactory::~TcpSocketFactory()
+void TcpSocket::completeConnect(int attempt)
 {
+	for(int other : m_attempts)
+	{
+		if(other != attempt)
+			close(other);
+	}
+	m_attempts.clear();
+	m_addresses.clear();
+	m_deferredOptions.clear();
+
+	setNonBlocking(attempt, false);
+	m_socket = attempt;
 }
 
-bool TcpSocketFactory::supportsScheme(const std::string& scheme)
+void TcpSocket::pollDescriptors(std::vector<pollfd>& pfds) const
 {
-	return scheme == "tcp";
+	for(int attempt : m_attempts)
+	{
+		pollfd pfd;
+		pfd.fd = attempt;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		pfds.push_back(pfd);
+	}
 }
 
-IoLine* TcpSocketFactory::createClient(const std::string& address)
+std::chrono::steady_clock::time_point TcpSocket::nextAttemptTime() const
 {
-	auto socket = new TcpSocket(address);
-	if(socket)
-		socket->connect();
-	return socket;
+	if(m_nextAddress >= m_addresses.size())
+		return std::chrono::steady_clock::time_point::max();
+	return m_nextAttemptTime;
 }
 
-IoAcceptor* TcpSocketFactory::createServer(const std::string& address)
+bool TcpSocket::processConnect(const pollfd* pfds, size_t count)
 {
-	return new TcpSocketAcceptor(address);
-}
+	for(size_t i = 0; i < count; i++)
+	{
+		if(pfds[i].revents == 0)
+			continue;
 
-}
+		int attempt = pfds[i].fd;
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if(getsockopt(attempt, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+			error = errno;
 
+		if(error == 0)
+		{
+			completeConnect(attempt);
+			return true;
+		}
+
+		m_lastError = error;
+		close(attempt);
+		m_attempts.erase(std::find(m_attempts.begin(), m_attempts.end(), attempt));
+
+		// Failed attempt doesn't have to wait for connection attempt delay
+		m_nextAttemptTime = std::chrono::steady_clock::now();
+	}
+
+	if(std::chrono::steady_clock::now() >= nextAttemptTime())
+		return startNextAttempt();
+
+	if(m_attempts.empty())
+		throw IoException("Unable to connect socket: " + m_address + "/" + std::to_string(m_lastError));
+	return false;
+}
+
+ssize_t TcpSocket::read(void* buffer, size_t buflen)
+{
+	ssize_t rc = ::read(m_socket, buffer, buflen);
+	if(m_quickAck)
+	{
+		// Kernel drops out of quickack mode on its own, so it has to be re-armed
+		int enable = 1;
+		setsockopt(m_socket, IPPROTO_TCP, TCP_QUICKACK, &enable, sizeof(enable));
+	}
+	if(rc < 0)
+	{
+		if((errno == ECONNRESET) || (errno == ENOTCONN))
+			return eConnectionLost;
+		if(errno == EAGAIN)
+			return eTimeout;
+		return eUnknown;
+	}
+	else if(rc == 0)
+	{
+		if(errno != ETIMEDOUT)
+			return eConnectionLost;
+		return eTimeout;
+	}
+	return rc;
+}
+
+ssize_t TcpSocket::write(void* buffer, size_t buflen)
+{
+	ssize_t rc = ::write(m_socket, buffer, buflen);
+	if(rc <= 0)
+		return eUnknown;
+	return rc;
+}
+
+ssize_t TcpSocket::writeGathered(const IoVec* parts, size_t count)
+{
+	ssize_t rc = ::writev(m_socket, reinterpret_cast<const iovec*>(parts), count);
+	if(rc <= 0)
+		return eUnknown;
+	return rc;
+}
+
+ssize_t TcpSocket::sendFileRegion(int fd, uint64_t offset, size_t length)
+{
+	return sendFileToSocket(m_socket, fd, offset, length);
+}
+
+ssize_t TcpSocket::writeShared(const std::shared_ptr<const std::vector<char>>& buffer, size_t offset, size_t buflen)
+{
+	if(!m_zeroCopyPending.empty())
+		reapZeroCopyCompletions();
+
+	if((m_zeroCopyThreshold == 0) || (buflen < m_zeroCopyThreshold))
+		return write(const_cast<char*>(buffer->data()) + offset, buflen);
+
+	ssize_t rc = ::send(m_socket, buffer->data() + offset, buflen, MSG_ZEROCOPY);
+	if(rc < 0)
+	{
+		// Out of optmem for pinned pages: fall back to ordinary copy
+		if(errno == ENOBUFS)
+			return write(const_cast<char*>(buffer->data()) + offset, buflen);
+		if((errno == ECONNRESET) || (errno == ENOTCONN) || (errno == EPIPE))
+			return eConnectionLost;
+		return eUnknown;
+	}
+
+	m_zeroCopyPending.push_back(std::make_pair(m_zeroCopySequence, buffer));
+	m_zeroCopySequence++;
+	return rc;
+}
+
+void TcpSocket::reapZeroCopyCompletions()
+{
+	char control[128];
+	while(!m_zeroCopyPending.empty())
+	{
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if(recvmsg(m_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if(!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+					(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+				continue;
+
+			sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if((err.ee_errno != 0) || (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY))
+				continue;
+
+			// TCP completes sends in order, so [ee_info, ee_data] always covers the oldest pending sends
+			uint32_t last = err.ee_data;
+			while(!m_zeroCopyPending.empty() && static_cast<int32_t>(last - m_zeroCopyPending.front().first) >= 0)
+				m_zeroCopyPending.pop_front();
+		}
+	}
+}
+
+size_t TcpSocket::pendingZeroCopyBuffers()
+{
+	reapZeroCopyCompletions();
+	return m_zeroCopyPending.size();
+}
+
+void TcpSocket::waitZeroCopyCompletions(int timeoutInMs)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutInMs);
+	reapZeroCopyCompletions();
+	while(!m_zeroCopyPending.empty())
+	{
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if(left.count() <= 0)
+			return;
+
+		// Completion notifications are signaled as POLLERR
+		pollfd pfd;
+		pfd.fd = m_socket;
+		pfd.events = 0;
+		pfd.revents = 0;
+		if(::poll(&pfd, 1, left.count()) <= 0)
+			return;
+		reapZeroCopyCompletions();
+	}
+}
+
+void TcpSocket::setOption(LineOption option, void* data)
+{
+	int value = *(int*)data;
+	if(m_socket < 0)
+	{
+		// Not connected yet: options are applied to every connection attempt
+		m_deferredOptions.push_back(std::make_pair(option, value));
+		return;
+	}
+
+	switch(option)
+	{
+		case LineOption::NoDelay:
+			setIntOption(m_socket, IPPROTO_TCP, TCP_NODELAY, value);
+			break;
+
+		case LineOption::QuickAck:
+			setIntOption(m_socket, IPPROTO_TCP, TCP_QUICKACK, value);
+			m_quickAck = value != 0;
+			break;
+
+		case LineOption::Cork:
+			setIntOption(m_socket, IPPROTO_TCP, TCP_CORK, value);
+			break;
+
+		case LineOption::BusyPoll:
+			setIntOption(m_socket, SOL_SOCKET, SO_BUSY_POLL, value);
+			break;
+
+		case LineOption::UserTimeout:
+			setIntOption(m_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, value);
+			break;
+
+		case LineOption::ZeroCopyThreshold:
+			if(value > 0)
+				setIntOption(m_socket, SOL_SOCKET, SO_ZEROCOPY, 1);
+			m_zeroCopyThreshold = value > 0 ? value : 0;
+			break;
+
+		default:
+			setSocketOption(m_socket, option, data);
+	}
+}
+
+bool TcpSocket::isConnected()
+{
+	return socketIsConnected(m_socket);
+}
+
+TcpSocketAcceptor::TcpSocketAcceptor(const std::string& address, const LineOptions& options) : m_address(address),
+	m_socket(-1),
+	m_options(options)
+{
+	auto addresses = resolveAddress(m_address, true);
+
+	// Wildcard address: prefer dual-stack IPv6 socket, which accepts IPv4 clients as well
+	if(m_address.substr(0, 2) == "*:")
+	{
+		std::stable_partition(addresses.begin(), addresses.end(), [](const ResolvedAddress& a)
+				{
+					return a.family() == AF_INET6;
+				});
+	}
+
+	int lastError = 0;
+	for(const auto& resolved : addresses)
+	{
+		int s = socket(resolved.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(s < 0)
+		{
+			lastError = errno;
+			continue;
+		}
+
+		try
+		{
+			setIntOption(s, SOL_SOCKET, SO_REUSEADDR, 1);
+			if(resolved.family() == AF_INET6)
+				setIntOption(s, IPPROTO_IPV6, IPV6_V6ONLY, 0);
+
+			// Window scaling is negotiated during handshake, so buffer sizes should be inherited from listening socket
+			for(const auto& option : m_options)
+			{
+				if(option.first == LineOption::SendBufferSize)
+					setIntOption(s, SOL_SOCKET, SO_SNDBUF, option.second);
+				else if(option.first == LineOption::ReceiveBufferSize)
+					setIntOption(s, SOL_SOCKET, SO_RCVBUF, option.second);
+			}
+		}
+		catch(const IoException& e)
+		{
+			close(s);
+			throw;
+		}
+
+		if((bind(s, (const sockaddr*)&resolved.address, resolved.length) < 0) || (listen(s, SOMAXCONN) < 0))
+		{
+			lastError = errno;
+			close(s);
+			continue;
+		}
+
+		m_socket = s;
+		return;
+	}
+
+	throw IoException("Unable to bind tcp socket: " + m_address + "/" + std::to_string(lastError));
+}
+
+TcpSocketAcceptor::~TcpSocketAcceptor()
+{
+	close(m_socket);
+}
+
+IoLine* TcpSocketAcceptor::waitConnection(int timeoutInMs)
+{
+	auto lines = waitConnections(1, timeoutInMs);
+	if(lines.empty())
+		return nullptr;
+	return lines.front();
+}
+
+std::vector<IoLine*> TcpSocketAcceptor::waitConnections(size_t maxConnections, int timeoutInMs)
+{
+	std::vector<int> sockets;
+	acceptConnections(m_socket, maxConnections, timeoutInMs, sockets);
+
+	std::vector<IoLine*> lines;
+	for(int newsock : sockets)
+		lines.push_back(new TcpSocket(newsock, ""));
+
+	try
+	{
+		for(auto line : lines)
+			applyLineOptions(line, m_options);
+	}
+	catch(const IoException& e)
+	{
+		for(auto line : lines)
+			delete line;
+		throw;
+	}
+	return lines;
+}
+
+TcpSocketFactory::~TcpSocketFactory()
+{
+}
+
+bool TcpSocketFactory::supportsScheme(const std::string& scheme)
+{
+	return scheme == "tcp";
+}
+
+IoLine* TcpSocketFactory::createClient(const std::string& address)
+{
+	LineOptions options;
+	auto baseAddress = splitLineOptions(address, options);
+	std::unique_ptr<TcpSocket> socket(new TcpSocket(baseAddress));
+	applyLineOptions(socket.get(), options);
+	socket->connect();
+	return socket.release();
+}
+
+/*
+ * Names which are not in resolver cache are looked up by background threads, so that slow lookup doesn't
+ * delay other connections. Threads which haven't finished by deadline are abandoned, so their results are
+ * passed through shared state; eventfd wakes up poll() when result is ready.
+ */
+struct PendingLookups
+{
+	PendingLookups() : event(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+	{
+		if(event < 0)
+			throw IoException("Unable to create eventfd: " + std::to_string(errno));
+	}
+
+	~PendingLookups()
+	{
+		close(event);
+	}
+
+	std::mutex mutex;
+	// Index of address and its resolved addresses, empty if lookup has failed
+	std::vector<std::pair<size_t, std::vector<ResolvedAddress>>> done;
+	int event;
+};
+
+static void startLookup(const std::shared_ptr<PendingLookups>& lookups, size_t index, const std::string& address)
+{
+	std::thread([lookups, index, address]() {
+			std::vector<ResolvedAddress> addresses;
+			try
+			{
+				addresses = resolveAddress(address, false);
+			}
+			catch(const IoException& e)
+			{
+			}
+
+			std::lock_guard<std::mutex> lock(lookups->mutex);
+			lookups->done.push_back(std::make_pair(index, std::move(addresses)));
+			uint64_t one = 1;
+			if(::write(lookups->event, &one, sizeof(one)) < 0)
+				return;
+			}).detach();
+}
+
+std::vector<IoLine*> TcpSocketFactory::createClients(const std::vector<std::string>& addresses, int timeoutInMs)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutInMs);
+	std::vector<IoLine*> lines(addresses.size(), nullptr);
+
+	// All connection attempts are started at once and then completed as their sockets become writable
+	std::vector<std::pair<size_t, std::unique_ptr<TcpSocket>>> pending;
+	std::vector<std::unique_ptr<TcpSocket>> resolving(addresses.size());
+	size_t resolvingCount = 0;
+	std::shared_ptr<PendingLookups> lookups;
+
+	auto connectResolved = [&](size_t index, std::unique_ptr<TcpSocket> socket, const std::vector<ResolvedAddress>& resolved) {
+		try
+		{
+			if(socket->startConnect(resolved))
+				lines[index] = socket.release();
+			else
+				pending.push_back(std::make_pair(index, std::move(socket)));
+		}
+		catch(const IoException& e)
+		{
+		}
+	};
+
+	for(size_t i = 0; i < addresses.size(); i++)
+	{
+		try
+		{
+			LineOptions options;
+			auto baseAddress = splitLineOptions(addresses[i], options);
+			std::unique_ptr<TcpSocket> socket(new TcpSocket(baseAddress));
+			applyLineOptions(socket.get(), options);
+
+			std::vector<ResolvedAddress> resolved;
+			if(resolveAddressWithoutLookup(baseAddress, resolved))
+			{
+				connectResolved(i, std::move(socket), resolved);
+				continue;
+			}
+
+			if(!lookups)
+				lookups = std::make_shared<PendingLookups>();
+			startLookup(lookups, i, baseAddress);
+			resolving[i] = std::move(socket);
+			resolvingCount++;
+		}
+		catch(const IoException& e)
+		{
+		}
+	}
+
+	std::vector<pollfd> pfds;
+	std::vector<size_t> ranges;
+	std::vector<std::pair<size_t, std::vector<ResolvedAddress>>> resolved;
+	while(!pending.empty() || (resolvingCount > 0))
+	{
+		pfds.clear();
+		ranges.clear();
+		auto wakeup = timeoutInMs < 0 ? std::chrono::steady_clock::time_point::max() : deadline;
+		for(const auto& p : pending)
+		{
+			ranges.push_back(pfds.size());
+			p.second->pollDescriptors(pfds);
+			wakeup = std::min(wakeup, p.second->nextAttemptTime());
+		}
+		ranges.push_back(pfds.size());
+		if(resolvingCount > 0)
+		{
+			pollfd pfd;
+			pfd.fd = lookups->event;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			pfds.push_back(pfd);
+		}
+
+		int timeout = -1;
+		if(wakeup != std::chrono::steady_clock::time_point::max())
+			timeout = remainingMs(wakeup);
+
+		int rc = ::poll(pfds.data(), pfds.size(), timeout);
+		if(rc < 0 && errno != EINTR)
+			break;
+
+		size_t next = 0;
+		for(size_t i = 0; i < pending.size(); i++)
+		{
+			try
+			{
+				if(pending[i].second->processConnect(pfds.data() + ranges[i], ranges[i + 1] - ranges[i]))
+				{
+					lines[pending[i].first] = pending[i].second.release();
+					continue;
+				}
+				pending[next++] = std::move(pending[i]);
+			}
+			catch(const IoException& e)
+			{
+			}
+		}
+		pending.resize(next);
+
+		if((resolvingCount > 0) && (pfds.back().revents & POLLIN))
+		{
+			uint64_t count;
+			if(::read(lookups->event, &count, sizeof(count)) < 0)
+				count = 0;
+			{
+				std::lock_guard<std::mutex> lock(lookups->mutex);
+				resolved.swap(lookups->done);
+			}
+			for(auto& r : resolved)
+			{
+				resolvingCount--;
+				if(!r.second.empty())
+					connectResolved(r.first, std::move(resolving[r.first]), r.second);
+				resolving[r.first].reset();
+			}
+			resolved.clear();
+		}
+
+		if((timeoutInMs >= 0) && (std::chrono::steady_clock::now() >= deadline))
+			break;
+	}
+
+	return lines;
+}
+
+IoAcceptor* TcpSocketFactory::createServer(const std::string& address)
+{
+	LineOptions options;
+	auto baseAddress = splitLineOptions(address, options);
+	return new TcpSocketAcceptor(baseAddress, options);
+}
+
+// Largest possible UDP payload fits into one receive slot
+static const size_t gs_datagramSlotSize = 65536;
+static const size_t gs_defaultReceiveBatch = 16;
+static const size_t gs_sequenceHeaderSize = sizeof(uint64_t);
+
+static bool isMulticast(const ResolvedAddress& address)
+{
+	if(address.family() == AF_INET)
+		return IN_MULTICAST(ntohl(((const sockaddr_in*)&address.address)->sin_addr.s_addr));
+	if(address.family() == AF_INET6)
+		return IN6_IS_ADDR_MULTICAST(&((const sockaddr_in6*)&address.address)->sin6_addr);
+	return false;
+}
+
+static void joinMulticastGroup(int socket, const ResolvedAddress& group)
+{
+	if(group.family() == AF_INET)
+	{
+		ip_mreqn request;
+		memset(&request, 0, sizeof(request));
+		request.imr_multiaddr = ((const sockaddr_in*)&group.address)->sin_addr;
+		request.imr_address.s_addr = htonl(INADDR_ANY);
+		if(setsockopt(socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) < 0)
+			throw IoException("Unable to join multicast group: " + std::to_string(errno));
+	}
+	else
+	{
+		ipv6_mreq request;
+		memset(&request, 0, sizeof(request));
+		request.ipv6mr_multiaddr = ((const sockaddr_in6*)&group.address)->sin6_addr;
+		if(setsockopt(socket, IPPROTO_IPV6, IPV6_JOIN_GROUP, &request, sizeof(request)) < 0)
+			throw IoException("Unable to join multicast group: " + std::to_string(errno));
+	}
+}
+
+static int familyOf(int socket)
+{
+	sockaddr_storage address;
+	socklen_t length = sizeof(address);
+	if(getsockname(socket, (sockaddr*)&address, &length) < 0)
+		return AF_INET;
+	return address.ss_family;
+}
+
+UdpSocket::UdpSocket(int fd, bool connected) : m_socket(fd),
+	m_connected(connected),
+	m_peerLength(0),
+	m_receiveBatch(gs_defaultReceiveBatch),
+	m_received(0),
+	m_nextReceived(0),
+	m_sendBatch(1),
+	m_sequenceNumbers(false),
+	m_sequenceStarted(false),
+	m_sendSequence(0),
+	m_expectedSequence(0),
+	m_sequenceGaps(0)
+{
+	memset(&m_peer, 0, sizeof(m_peer));
+}
+
+UdpSocket::~UdpSocket()
+{
+	flush();
+	close(m_socket);
+}
+
+ssize_t UdpSocket::receiveBatch()
+{
+	if(m_receiveBuffer.size() != m_receiveBatch * gs_datagramSlotSize)
+	{
+		m_receiveBuffer.resize(m_receiveBatch * gs_datagramSlotSize);
+		m_receiveHeaders.resize(m_receiveBatch);
+		m_receiveParts.resize(m_receiveBatch);
+		m_receiveAddresses.resize(m_receiveBatch);
+	}
+
+	for(size_t i = 0; i < m_receiveBatch; i++)
+	{
+		m_receiveParts[i].iov_base = m_receiveBuffer.data() + i * gs_datagramSlotSize;
+		m_receiveParts[i].iov_len = gs_datagramSlotSize;
+		memset(&m_receiveHeaders[i], 0, sizeof(mmsghdr));
+		m_receiveHeaders[i].msg_hdr.msg_iov = &m_receiveParts[i];
+		m_receiveHeaders[i].msg_hdr.msg_iovlen = 1;
+		m_receiveHeaders[i].msg_hdr.msg_name = &m_receiveAddresses[i];
+		m_receiveHeaders[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+	}
+
+	while(true)
+	{
+		// Blocks (up to SO_RCVTIMEO) for the first datagram only, then takes whatever is already queued
+		int rc = recvmmsg(m_socket, m_receiveHeaders.data(), m_receiveBatch, MSG_WAITFORONE, nullptr);
+		if(rc < 0)
+		{
+			// ICMP port unreachable for previous send on connected socket, not an error for receiving side
+			if((errno == EINTR) || (errno == ECONNREFUSED))
+				continue;
+			return recordError();
+		}
+		m_received = rc;
+		m_nextReceived = 0;
+		return rc;
+	}
+}
+
+ssize_t UdpSocket::readRecord(void* buffer, size_t buflen)
+{
+	while(true)
+	{
+		if(m_nextReceived == m_received)
+		{
+			ssize_t rc = receiveBatch();
+			if(rc < 0)
+				return rc;
+		}
+
+		const mmsghdr& header = m_receiveHeaders[m_nextReceived];
+		const char* data = m_receiveBuffer.data() + m_nextReceived * gs_datagramSlotSize;
+		size_t length = header.msg_len;
+		if(m_sequenceNumbers)
+		{
+			if(length < gs_sequenceHeaderSize)
+			{
+				// Not ours, e.g. sender without sequence numbers
+				m_nextReceived++;
+				continue;
+			}
+			data += gs_sequenceHeaderSize;
+			length -= gs_sequenceHeaderSize;
+		}
+
+		if(length > buflen)
+			return length;
+
+		if(m_sequenceNumbers)
+		{
+			uint64_t sequence;
+			memcpy(&sequence, data - gs_sequenceHeaderSize, gs_sequenceHeaderSize);
+			if(!m_sequenceStarted)
+			{
+				// Line may join the stream at any point
+				m_sequenceStarted = true;
+				m_expectedSequence = sequence;
+			}
+
+			if(sequence > m_expectedSequence)
+				m_sequenceGaps += sequence - m_expectedSequence;
+			else if(sequence < m_expectedSequence)
+				m_sequenceGaps++;
+			m_expectedSequence = std::max(m_expectedSequence, sequence + 1);
+		}
+
+		if(!m_connected)
+		{
+			memcpy(&m_peer, &m_receiveAddresses[m_nextReceived], header.msg_hdr.msg_namelen);
+			m_peerLength = header.msg_hdr.msg_namelen;
+		}
+
+		memcpy(buffer, data, length);
+		m_nextReceived++;
+		return length;
+	}
+}
+
+ssize_t UdpSocket::read(void* buffer, size_t buflen)
+{
+	ssize_t rc = readRecord(buffer, buflen);
+	if(rc > (ssize_t)buflen)
+	{
+		// Datagram doesn't fit: deliver its beginning and drop the rest, as recv() does
+		std::vector<char> datagram(rc);
+		rc = readRecord(datagram.data(), datagram.size());
+		if(rc < 0)
+			return rc;
+		memcpy(buffer, datagram.data(), buflen);
+		return buflen;
+	}
+	return rc;
+}
+
+ssize_t UdpSocket::sendDirect(const IoVec* parts, size_t count, size_t length)
+{
+	uint64_t sequence = m_sendSequence;
+	std::vector<iovec> iov;
+	iov.reserve(count + 1);
+	if(m_sequenceNumbers)
+		iov.push_back(iovec { &sequence, gs_sequenceHeaderSize });
+	for(size_t i = 0; i < count; i++)
+		iov.push_back(iovec { const_cast<void*>(parts[i].data), parts[i].length });
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov.data();
+	msg.msg_iovlen = iov.size();
+	if(!m_connected)
+	{
+		msg.msg_name = &m_peer;
+		msg.msg_namelen = m_peerLength;
+	}
+
+	while(true)
+	{
+		ssize_t rc = sendmsg(m_socket, &msg, MSG_NOSIGNAL);
+		if(rc < 0 && ((errno == EINTR) || (errno == ECONNREFUSED)))
+			continue;
+		if(rc < 0)
+			return recordError();
+		m_sendSequence++;
+		return length;
+	}
+}
+
+ssize_t UdpSocket::writeRecord(const IoVec* parts, size_t count)
+{
+	if(!m_connected && (m_peerLength == 0))
+		return eUnknown;
+
+	size_t length = 0;
+	for(size_t i = 0; i < count; i++)
+		length += parts[i].length;
+	if(length + (m_sequenceNumbers ? gs_sequenceHeaderSize : 0) >= gs_datagramSlotSize)
+		return eTooBigBuffer;
+
+	if(m_sendBatch <= 1)
+		return sendDirect(parts, count, length);
+
+	// Unconnected line sends every queued datagram to peer which was current when it was queued
+	size_t offset = m_sendBuffer.size();
+	if(!m_connected)
+		m_sendBuffer.insert(m_sendBuffer.end(), (const char*)&m_peer, (const char*)&m_peer + sizeof(m_peer));
+	size_t dataOffset = m_sendBuffer.size();
+	if(m_sequenceNumbers)
+	{
+		uint64_t sequence = m_sendSequence;
+		m_sendBuffer.insert(m_sendBuffer.end(), (const char*)&sequence, (const char*)&sequence + gs_sequenceHeaderSize);
+	}
+	m_sendSequence++;
+	for(size_t i = 0; i < count; i++)
+		m_sendBuffer.insert(m_sendBuffer.end(), (const char*)parts[i].data, (const char*)parts[i].data + parts[i].length);
+	m_sendQueue.push_back(std::make_pair(offset, m_sendBuffer.size() - dataOffset));
+
+	if(m_sendQueue.size() >= m_sendBatch)
+	{
+		ssize_t rc = flush();
+		if(rc < 0)
+			return rc;
+	}
+	return length;
+}
+
+ssize_t UdpSocket::write(void* buffer, size_t buflen)
+{
+	IoVec part { buffer, buflen };
+	return writeRecord(&part, 1);
+}
+
+ssize_t UdpSocket::flush()
+{
+	if(m_sendQueue.empty())
+		return 0;
+
+	size_t headerSize = m_connected ? 0 : sizeof(sockaddr_storage);
+	m_sendHeaders.resize(m_sendQueue.size());
+	m_sendParts.resize(m_sendQueue.size());
+	for(size_t i = 0; i < m_sendQueue.size(); i++)
+	{
+		char* datagram = m_sendBuffer.data() + m_sendQueue[i].first;
+		m_sendParts[i].iov_base = datagram + headerSize;
+		m_sendParts[i].iov_len = m_sendQueue[i].second;
+		memset(&m_sendHeaders[i], 0, sizeof(mmsghdr));
+		m_sendHeaders[i].msg_hdr.msg_iov = &m_sendParts[i];
+		m_sendHeaders[i].msg_hdr.msg_iovlen = 1;
+		if(!m_connected)
+		{
+			m_sendHeaders[i].msg_hdr.msg_name = datagram;
+			m_sendHeaders[i].msg_hdr.msg_namelen = ((sockaddr*)datagram)->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+		}
+	}
+
+	ssize_t result = 0;
+	size_t sent = 0;
+	while(sent < m_sendQueue.size())
+	{
+		int rc = sendmmsg(m_socket, m_sendHeaders.data() + sent, m_sendQueue.size() - sent, MSG_NOSIGNAL);
+		if(rc < 0)
+		{
+			// ECONNREFUSED reports ICMP for earlier datagram and is cleared by reporting it, so the same
+			// datagram is retried, as in sendDirect()
+			if((errno == EINTR) || (errno == ECONNREFUSED))
+				continue;
+			result = recordError();
+			break;
+		}
+		sent += rc;
+	}
+
+	m_sendQueue.clear();
+	m_sendBuffer.clear();
+	return result;
+}
+
+void UdpSocket::setOption(LineOption option, void* data)
+{
+	int value = *(int*)data;
+	bool v6 = familyOf(m_socket) == AF_INET6;
+	switch(option)
+	{
+		case LineOption::SendBatch:
+			flush();
+			m_sendBatch = std::max(value, 1);
+			break;
+
+		case LineOption::ReceiveBatch:
+			// Queued datagrams would be lost with receive buffers
+			if(m_nextReceived != m_received)
+				throw IoException("Unable to change receive batch while datagrams are queued");
+			m_receiveBatch = std::max(value, 1);
+			break;
+
+		case LineOption::SequenceNumbers:
+			m_sequenceNumbers = value != 0;
+			break;
+
+		case LineOption::MulticastTtl:
+			if(v6)
+				setIntOption(m_socket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, value);
+			else
+				setIntOption(m_socket, IPPROTO_IP, IP_MULTICAST_TTL, value);
+			break;
+
+		case LineOption::MulticastLoop:
+			if(v6)
+				setIntOption(m_socket, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, value);
+			else
+				setIntOption(m_socket, IPPROTO_IP, IP_MULTICAST_LOOP, value);
+			break;
+
+		case LineOption::BusyPoll:
+			setIntOption(m_socket, SOL_SOCKET, SO_BUSY_POLL, value);
+			break;
+
+		default:
+			setSocketOption(m_socket, option, data);
+	}
+}
+
+void UdpSocket::getOption(LineOption option, void* data)
+{
+	switch(option)
+	{
+		case LineOption::SequenceGaps:
+			*(int*)data = (int)m_sequenceGaps;
+			break;
+
+		default:
+			throw UnsupportedOption("");
+	}
+}
+
+UdpAcceptor::UdpAcceptor(const std::string& address, const LineOptions& options) : m_closed(false),
+	m_waiters(0)
+{
+	auto addresses = resolveAddress(address, true);
+
+	int lastError = 0;
+	for(const auto& resolved : addresses)
+	{
+		int s = socket(resolved.family(), SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if(s < 0)
+		{
+			lastError = errno;
+			continue;
+		}
+
+		std::unique_ptr<UdpSocket> line(new UdpSocket(s, false));
+		bool multicast = isMulticast(resolved);
+		if(multicast)
+		{
+			// Every subscriber of the group on this host binds the same port
+			setIntOption(s, SOL_SOCKET, SO_REUSEADDR, 1);
+		}
+
+		if(bind(s, (const sockaddr*)&resolved.address, resolved.length) < 0)
+		{
+			lastError = errno;
+			continue;
+		}
+
+		if(multicast)
+			joinMulticastGroup(s, resolved);
+		applyLineOptions(line.get(), options);
+		m_line = std::move(line);
+		return;
+	}
+
+	throw IoException("Unable to bind udp socket: " + address + "/" + std::to_string(lastError));
+}
+
+UdpAcceptor::~UdpAcceptor()
+{
+	// Waiting threads are woken up, and acceptor is kept alive until they leave
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_closed = true;
+	m_condition.notify_all();
+	m_condition.wait(lock, [&]() { return m_waiters == 0; });
+}
+
+IoLine* UdpAcceptor::waitConnection(int timeoutInMs)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if(m_line)
+		return m_line.release();
+
+	// Negative timeout waits forever, like other acceptors, until acceptor is destroyed
+	m_waiters++;
+	if(timeoutInMs < 0)
+		m_condition.wait(lock, [&]() { return m_closed; });
+	else if(timeoutInMs > 0)
+		m_condition.wait_for(lock, std::chrono::milliseconds(timeoutInMs), [&]() { return m_closed; });
+	m_waiters--;
+	if(m_closed)
+		m_condition.notify_all();
+	return nullptr;
+}
+
+UdpSocketFactory::~UdpSocketFactory()
+{
+}
+
+bool UdpSocketFactory::supportsScheme(const std::string& scheme)
+{
+	return scheme == "udp";
+}
+
+IoLine* UdpSocketFactory::createClient(const std::string& address)
+{
+	LineOptions options;
+	auto baseAddress = splitLineOptions(address, options);
+	auto addresses = resolveAddress(baseAddress, false);
+
+	int lastError = 0;
+	for(const auto& resolved : addresses)
+	{
+		int s = socket(resolved.family(), SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if(s < 0)
+		{
+			lastError = errno;
+			continue;
+		}
+
+		std::unique_ptr<UdpSocket> line(new UdpSocket(s, true));
+		if(::connect(s, (const sockaddr*)&resolved.address, resolved.length) < 0)
+		{
+			lastError = errno;
+			continue;
+		}
+
+		applyLineOptions(line.get(), options);
+		return line.release();
+	}
+
+	throw IoException("Unable to connect udp socket: " + baseAddress + "/" + std::to_string(lastError));
+}
+
+IoAcceptor* UdpSocketFactory::createServer(const std::string& address)
+{
+	LineOptions options;
+	auto baseAddress = splitLineOptions(address, options);
+	return new UdpAcceptor(baseAddress, options);
+}
+
+}
@@ -3,6 +3,18 @@
 #define IO_SOCKET_H 
 
 #include "cppio/ioline.h"
+#include "../common/lineoptions.h"
+#include "resolver.h"
+
+#include <deque>
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 namespace cppio
 {
@@ -10,7 +22,7 @@ namespace cppio
 class UnixSocket : public IoLine
 {
 public:
-	UnixSocket(const std::string& address);
+	UnixSocket(const std::string& address, int type = SOCK_STREAM);
 	UnixSocket(int fd, const std::string& address);
 	virtual ~UnixSocket();
 
@@ -18,24 +30,66 @@ public:
 
 	virtual ssize_t read(void* buffer, size_t buflen);
 	virtual ssize_t write(void* buffer, size_t buflen);
+	virtual ssize_t writeGathered(const IoVec* parts, size_t count);
+	virtual ssize_t sendFileRegion(int fd, uint64_t offset, size_t length);
 	virtual void setOption(LineOption option, void* data);
+	virtual bool isConnected();
+
+	virtual ssize_t writeWithDescriptors(const void* buffer, size_t buflen, const int* fds, size_t count);
+	virtual int takeDescriptor();
+
+	virtual void* getNativeHandle() { return &m_socket; }
+
+protected:
+	/*
+	 * recvmsg() which queues descriptors passed by peer (SCM_RIGHTS)
+	 */
+	ssize_t receive(void* buffer, size_t buflen, int flags);
+	ssize_t receive(iovec* parts, size_t count, int flags);
 
-private:
 	std::string m_address;
 	int m_socket;
+	std::deque<int> m_descriptors;
+};
+
+/*
+ * AF_UNIX/SOCK_SEQPACKET line: every write is delivered as one record. read() with buffer smaller than
+ * record discards the rest of it, so readRecord() should be used for reading. readRecord() returns
+ * eTooBigBuffer and drops record if it is bigger than line's own send buffer.
+ */
+class UnixSeqPacketSocket : public UnixSocket
+{
+public:
+	UnixSeqPacketSocket(const std::string& address);
+	UnixSeqPacketSocket(int fd, const std::string& address);
+	virtual ~UnixSeqPacketSocket();
+
+	virtual bool preservesBoundaries() const { return true; }
+	virtual ssize_t writeRecord(const IoVec* parts, size_t count);
+	virtual ssize_t readRecord(void* buffer, size_t buflen);
+
+private:
+	size_t m_maxRecordSize;
+	// Received record which didn't fit in caller's buffer
+	std::vector<char> m_pending;
 };
 
 class UnixSocketAcceptor : public IoAcceptor
 {
 public:
-	UnixSocketAcceptor(const std::string& address);
+	UnixSocketAcceptor(const std::string& address, const LineOptions& options = LineOptions(), int type = SOCK_STREAM);
 	virtual ~UnixSocketAcceptor();
 
 	virtual IoLine* waitConnection(int timeoutInMs);
+	virtual std::vector<IoLine*> waitConnections(size_t maxConnections, int timeoutInMs);
+
+	virtual void* getNativeHandle() { return &m_socket; }
 
 private:
 	std::string m_address;
 	int m_socket;
+	LineOptions m_options;
+	int m_type;
 };
 
 class UnixSocketFactory : public IoLineFactory
@@ -47,6 +101,18 @@ public:
 	virtual IoAcceptor* createServer(const std::string& address);
 };
 
+/*
+ * "seqpacket://" scheme. Address is a path, or "@name" for abstract namespace.
+ */
+class UnixSeqPacketFactory : public IoLineFactory
+{
+public:
+	virtual ~UnixSeqPacketFactory();
+	virtual bool supportsScheme(const std::string& scheme);
+	virtual IoLine* createClient(const std::string& address);
+	virtual IoAcceptor* createServer(const std::string& address);
+};
+
 class TcpSocket : public IoLine
 {
 public:
@@ -56,26 +122,74 @@ public:
 
 	virtual void connect();
 
+	/*
+	 * Non-blocking connect, racing resolved addresses as in RFC 8305 (happy eyeballs).
+	 * startConnect() returns true if connection is established immediately. Otherwise caller polls
+	 * descriptors from pollDescriptors() until nextAttemptTime() and passes results to processConnect(),
+	 * which returns true once connected. Both throw IoException when all addresses have failed.
+	 * startConnect() without arguments resolves address itself, which may block on name lookup.
+	 */
+	bool startConnect();
+	bool startConnect(const std::vector<ResolvedAddress>& addresses);
+	void pollDescriptors(std::vector<pollfd>& pfds) const;
+	std::chrono::steady_clock::time_point nextAttemptTime() const;
+	bool processConnect(const pollfd* pfds, size_t count);
+
 	virtual ssize_t read(void* buffer, size_t buflen);
 	virtual ssize_t write(void* buffer, size_t buflen);
+	virtual ssize_t writeShared(const std::shared_ptr<const std::vector<char>>& buffer, size_t offset, size_t buflen);
+	virtual ssize_t writeGathered(const IoVec* parts, size_t count);
+	virtual ssize_t sendFileRegion(int fd, uint64_t offset, size_t length);
 
 	virtual void setOption(LineOption option, void* data);
+	virtual bool isConnected();
+
+	virtual void* getNativeHandle() { return &m_socket; }
+
+	size_t pendingZeroCopyBuffers();
+
+private:
+	void reapZeroCopyCompletions();
+	void waitZeroCopyCompletions(int timeoutInMs);
+
+	bool startNextAttempt();
+	void setAttemptOption(int attempt, LineOption option, int value);
+	void completeConnect(int attempt);
+
 private:
 	std::string m_address;
 	int m_socket;
+	bool m_quickAck;
+
+	size_t m_zeroCopyThreshold;
+	uint32_t m_zeroCopySequence;
+	// Buffers which are still referenced by kernel, keyed by sequence number of send call
+	std::deque<std::pair<uint32_t, std::shared_ptr<const std::vector<char>>>> m_zeroCopyPending;
+
+	// Connection state
+	LineOptions m_deferredOptions;
+	std::vector<ResolvedAddress> m_addresses;
+	size_t m_nextAddress;
+	std::vector<int> m_attempts;
+	std::chrono::steady_clock::time_point m_nextAttemptTime;
+	int m_lastError;
 };
 
 class TcpSocketAcceptor : public IoAcceptor
 {
 public:
-	TcpSocketAcceptor(const std::string& address);
+	TcpSocketAcceptor(const std::string& address, const LineOptions& options = LineOptions());
 	virtual ~TcpSocketAcceptor();
 
 	virtual IoLine* waitConnection(int timeoutInMs);
+	virtual std::vector<IoLine*> waitConnections(size_t maxConnections, int timeoutInMs);
+
+	virtual void* getNativeHandle() { return &m_socket; }
 
 private:
 	std::string m_address;
 	int m_socket;
+	LineOptions m_options;
 };
 
 class TcpSocketFactory : public IoLineFactory
@@ -84,6 +198,98 @@ public:
 	virtual ~TcpSocketFactory();
 	virtual bool supportsScheme(const std::string& scheme);
 	virtual IoLine* createClient(const std::string& address);
+	virtual std::vector<IoLine*> createClients(const std::vector<std::string>& addresses, int timeoutInMs);
+	virtual IoAcceptor* createServer(const std::string& address);
+};
+
+/*
+ * One datagram per write()/writeRecord(). Client lines are connected to destination address, bound (server) line
+ * replies to the sender of last received datagram. Datagrams fetched by one recvmmsg() are queued in line, so
+ * socket may be not readable while line still has data to read.
+ */
+class UdpSocket : public IoLine
+{
+public:
+	UdpSocket(int fd, bool connected);
+	virtual ~UdpSocket();
+
+	virtual ssize_t read(void* buffer, size_t buflen);
+	virtual ssize_t write(void* buffer, size_t buflen);
+
+	virtual bool preservesBoundaries() const { return true; }
+	virtual ssize_t writeRecord(const IoVec* parts, size_t count);
+	virtual ssize_t readRecord(void* buffer, size_t buflen);
+	virtual ssize_t flush();
+
+	virtual void setOption(LineOption option, void* data);
+	virtual void getOption(LineOption option, void* data);
+
+	virtual void* getNativeHandle() { return &m_socket; }
+
+private:
+	ssize_t receiveBatch();
+	ssize_t sendDirect(const IoVec* parts, size_t count, size_t length);
+
+private:
+	int m_socket;
+	bool m_connected;
+
+	// Sender of last received datagram, destination for writes on unconnected line
+	sockaddr_storage m_peer;
+	socklen_t m_peerLength;
+
+	size_t m_receiveBatch;
+	std::vector<char> m_receiveBuffer;
+	std::vector<mmsghdr> m_receiveHeaders;
+	std::vector<iovec> m_receiveParts;
+	std::vector<sockaddr_storage> m_receiveAddresses;
+	size_t m_received;
+	size_t m_nextReceived;
+
+	// Queued datagrams are kept as (offset, length) in m_sendBuffer
+	size_t m_sendBatch;
+	std::vector<char> m_sendBuffer;
+	std::vector<std::pair<size_t, size_t>> m_sendQueue;
+	std::vector<mmsghdr> m_sendHeaders;
+	std::vector<iovec> m_sendParts;
+
+	// Sequence numbers are counted per line, so server line expects one sender
+	bool m_sequenceNumbers;
+	bool m_sequenceStarted;
+	uint64_t m_sendSequence;
+	uint64_t m_expectedSequence;
+	uint64_t m_sequenceGaps;
+};
+
+/*
+ * UDP has no connections: bound line is returned by first waitConnection(), later calls just wait for timeout
+ * (forever if it is negative, until acceptor is destroyed)
+ */
+class UdpAcceptor : public IoAcceptor
+{
+public:
+	UdpAcceptor(const std::string& address, const LineOptions& options = LineOptions());
+	virtual ~UdpAcceptor();
+
+	virtual IoLine* waitConnection(int timeoutInMs);
+
+private:
+	std::unique_ptr<UdpSocket> m_line;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_closed;
+	int m_waiters;
+};
+
+/*
+ * "udp://host:port". Server address may be multicast group, which is then joined on default interface.
+ */
+class UdpSocketFactory : public IoLineFactory
+{
+public:
+	virtual ~UdpSocketFactory();
+	virtual bool supportsScheme(const std::string& scheme);
+	virtual IoLine* createClient(const std::string& address);
 	virtual IoAcceptor* createServer(const std::string& address);
 };
 }
@@ -0,0 +1,426 @@
+#include "pipes.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+namespace cppio
+{
+
+static const int gs_handshakeTimeout = 1000;
+static const int gs_spliceDrainTimeout = 1000;
+
+static std::atomic<int> gs_clientCounter(0);
+
+static bool waitFd(int fd, short events, int timeoutInMs)
+{
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	int rc;
+	do
+	{
+		rc = ::poll(&pfd, 1, timeoutInMs);
+	} while(rc < 0 && errno == EINTR);
+	return rc != 0;
+}
+
+static void setBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if(flags >= 0)
+		fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+/*
+ * Writing to pipe without reader raises SIGPIPE. Unlike send(), write() has no MSG_NOSIGNAL, so signal is blocked
+ * for the duration of the call and consumed if it was caused by this write.
+ */
+template<typename Write>
+static ssize_t writeWithoutSigPipe(Write doWrite)
+{
+	sigset_t pipeSet;
+	sigset_t oldSet;
+	sigemptyset(&pipeSet);
+	sigaddset(&pipeSet, SIGPIPE);
+
+	sigset_t pending;
+	sigemptyset(&pending);
+	sigpending(&pending);
+	bool wasPending = sigismember(&pending, SIGPIPE);
+
+	pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+	ssize_t rc;
+	do
+	{
+		rc = doWrite();
+	} while(rc < 0 && errno == EINTR);
+	int error = errno;
+
+	if(rc < 0 && error == EPIPE && !wasPending)
+	{
+		timespec zero = { 0, 0 };
+		sigtimedwait(&pipeSet, nullptr, &zero);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+	errno = error;
+	return rc;
+}
+
+PipeLine::PipeLine(int readFd, int writeFd) : m_readFd(readFd),
+	m_writeFd(writeFd),
+	m_readTimeout(0),
+	m_writeTimeout(0),
+	m_vmspliceThreshold(0),
+	m_written(0)
+{
+}
+
+PipeLine::~PipeLine()
+{
+	// Pipe references spliced pages, so their memory can't be reused while reader hasn't consumed them
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(gs_spliceDrainTimeout);
+	releaseConsumedBuffers();
+	while(!m_spliced.empty() && isConnected() && (std::chrono::steady_clock::now() < deadline))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		releaseConsumedBuffers();
+	}
+
+	close(m_readFd);
+	close(m_writeFd);
+}
+
+std::pair<PipeLine*, PipeLine*> PipeLine::createPair()
+{
+	int first[2];
+	int second[2];
+	if(pipe2(first, O_CLOEXEC) < 0)
+		throw IoException("Unable to create pipe: " + std::to_string(errno));
+	if(pipe2(second, O_CLOEXEC) < 0)
+	{
+		close(first[0]);
+		close(first[1]);
+		throw IoException("Unable to create pipe: " + std::to_string(errno));
+	}
+	return std::make_pair(new PipeLine(first[0], second[1]), new PipeLine(second[0], first[1]));
+}
+
+ssize_t PipeLine::read(void* buffer, size_t buflen)
+{
+	if(m_readTimeout > 0 && !waitFd(m_readFd, POLLIN, m_readTimeout))
+		return eTimeout;
+
+	ssize_t rc;
+	do
+	{
+		rc = ::read(m_readFd, buffer, buflen);
+	} while(rc < 0 && errno == EINTR);
+
+	if(rc < 0)
+	{
+		if(errno == EAGAIN)
+			return eTimeout;
+		return eUnknown;
+	}
+	if(rc == 0)
+		return eConnectionLost;
+	return rc;
+}
+
+ssize_t PipeLine::writeData(const IoVec* parts, size_t count, bool splice)
+{
+	if(m_writeTimeout > 0 && !waitFd(m_writeFd, POLLOUT, m_writeTimeout))
+		return eTimeout;
+
+	const iovec* iov = reinterpret_cast<const iovec*>(parts);
+	ssize_t rc = writeWithoutSigPipe([&]() -> ssize_t {
+			if(!splice)
+				return ::writev(m_writeFd, iov, count);
+			return vmsplice(m_writeFd, iov, count, 0);
+		});
+
+	if(rc < 0)
+	{
+		if(errno == EPIPE)
+			return eConnectionLost;
+		if(errno == EAGAIN)
+			return eTimeout;
+		return eUnknown;
+	}
+	m_written += rc;
+	return rc;
+}
+
+ssize_t PipeLine::write(void* buffer, size_t buflen)
+{
+	IoVec part { buffer, buflen };
+	return writeData(&part, 1, false);
+}
+
+ssize_t PipeLine::writeShared(const std::shared_ptr<const std::vector<char>>& buffer, size_t offset, size_t buflen)
+{
+	releaseConsumedBuffers();
+	IoVec part { buffer->data() + offset, buflen };
+	if(m_vmspliceThreshold == 0 || buflen < m_vmspliceThreshold)
+		return writeData(&part, 1, false);
+
+	ssize_t rc = writeData(&part, 1, true);
+	if(rc > 0)
+		m_spliced.push_back(std::make_pair(m_written, buffer));
+	return rc;
+}
+
+ssize_t PipeLine::writeGathered(const IoVec* parts, size_t count)
+{
+	return writeData(parts, count, false);
+}
+
+void PipeLine::releaseConsumedBuffers()
+{
+	if(m_spliced.empty())
+		return;
+
+	int unread = 0;
+	if(ioctl(m_writeFd, FIONREAD, &unread) < 0)
+		return;
+
+	uint64_t consumed = m_written - unread;
+	while(!m_spliced.empty() && m_spliced.front().first <= consumed)
+		m_spliced.pop_front();
+}
+
+size_t PipeLine::pendingSplicedBuffers()
+{
+	releaseConsumedBuffers();
+	return m_spliced.size();
+}
+
+void PipeLine::setOption(LineOption option, void* data)
+{
+	int value = *reinterpret_cast<int*>(data);
+	switch(option)
+	{
+		case LineOption::ReceiveTimeout:
+			m_readTimeout = value;
+			break;
+
+		case LineOption::SendTimeout:
+			m_writeTimeout = value;
+			break;
+
+		case LineOption::VmspliceThreshold:
+			m_vmspliceThreshold = value;
+			break;
+
+		case LineOption::SendBufferSize:
+			if(fcntl(m_writeFd, F_SETPIPE_SZ, value) < 0)
+				throw IoException("Unable to set pipe size: " + std::to_string(errno));
+			break;
+
+		default:
+			throw UnsupportedOption("");
+	}
+}
+
+bool PipeLine::isConnected()
+{
+	pollfd pfds[2];
+	pfds[0].fd = m_readFd;
+	pfds[0].events = 0;
+	pfds[0].revents = 0;
+	pfds[1].fd = m_writeFd;
+	pfds[1].events = 0;
+	pfds[1].revents = 0;
+	if(::poll(pfds, 2, 0) < 0)
+		return false;
+	return ((pfds[0].revents | pfds[1].revents) & (POLLHUP | POLLERR)) == 0;
+}
+
+PipeAcceptor::PipeAcceptor(const std::string& path, const LineOptions& options) : m_path(path),
+	m_options(options)
+{
+	if(mkfifo(m_path.c_str(), 0600) < 0)
+		throw IoException("Unable to create fifo: " + m_path + "/" + std::to_string(errno));
+
+	// Opened for writing as well, so that FIFO is never at EOF between clients
+	m_fd = open(m_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if(m_fd < 0)
+	{
+		unlink(m_path.c_str());
+		throw IoException("Unable to open fifo: " + m_path + "/" + std::to_string(errno));
+	}
+}
+
+PipeAcceptor::~PipeAcceptor()
+{
+	close(m_fd);
+	unlink(m_path.c_str());
+}
+
+IoLine* PipeAcceptor::openClientPipes(const std::string& name)
+{
+	// Client has already opened its reading end, and blocks in opening its writing end until we open ours.
+	// Client removes FIFOs as soon as it is unblocked, so that end is opened last.
+	int writeFd = open((name + ".s2c").c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	int readFd = writeFd < 0 ? -1 : open((name + ".c2s").c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+	// Reading from FIFO which has no writer yet returns EOF, so client confirms that it is connected
+	char ack = 0;
+	bool connected = (readFd >= 0) && (writeFd >= 0) && waitFd(readFd, POLLIN, gs_handshakeTimeout) &&
+		(::read(readFd, &ack, 1) == 1);
+	if(!connected)
+	{
+		if(readFd >= 0)
+			close(readFd);
+		if(writeFd >= 0)
+			close(writeFd);
+		return nullptr;
+	}
+
+	setBlocking(readFd);
+	setBlocking(writeFd);
+	std::unique_ptr<PipeLine> line(new PipeLine(readFd, writeFd));
+	applyLineOptions(line.get(), m_options);
+	return line.release();
+}
+
+IoLine* PipeAcceptor::waitConnection(int timeoutInMs)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutInMs);
+	while(true)
+	{
+		auto newline = m_pending.find('\n');
+		while(newline != std::string::npos)
+		{
+			auto name = m_pending.substr(0, newline);
+			m_pending.erase(0, newline + 1);
+			IoLine* line = openClientPipes(name);
+			if(line)
+				return line;
+			newline = m_pending.find('\n');
+		}
+
+		int timeout = timeoutInMs;
+		if(timeoutInMs > 0)
+			timeout = std::max<int>(0, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+		if(!waitFd(m_fd, POLLIN, timeout))
+			return nullptr;
+
+		char buffer[PIPE_BUF];
+		ssize_t rc = ::read(m_fd, buffer, sizeof(buffer));
+		if(rc > 0)
+			m_pending.append(buffer, rc);
+		else if(timeoutInMs == 0)
+			return nullptr;
+	}
+}
+
+PipeLineFactory::~PipeLineFactory()
+{
+}
+
+bool PipeLineFactory::supportsScheme(const std::string& scheme)
+{
+	return scheme == "pipe";
+}
+
+IoLine* PipeLineFactory::createClient(const std::string& address)
+{
+	LineOptions options;
+	auto path = splitLineOptions(address, options);
+
+	std::unique_ptr<PipeLine> line;
+	if(path.substr(0, 3) == "fd:")
+	{
+		auto comma = path.find(',');
+		if(comma == std::string::npos)
+			throw IoException("Invalid pipe address: " + path);
+		int readFd = atoi(path.substr(3, comma - 3).c_str());
+		int writeFd = atoi(path.substr(comma + 1).c_str());
+		if(fcntl(readFd, F_GETFD) < 0 || fcntl(writeFd, F_GETFD) < 0)
+			throw IoException("Invalid pipe descriptors: " + path);
+		line.reset(new PipeLine(readFd, writeFd));
+	}
+	else
+	{
+		// Client's own FIFO pair; names are sent through server FIFO in one write, which is atomic below PIPE_BUF
+		auto name = path + "." + std::to_string(getpid()) + "." + std::to_string(gs_clientCounter.fetch_add(1));
+		auto request = name + "\n";
+		if(request.size() > PIPE_BUF)
+			throw IoException("Pipe address is too long: " + path);
+
+		int server = open(path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if(server < 0)
+			throw IoException("Unable to open fifo: " + path + "/" + std::to_string(errno));
+
+		int readFd = -1;
+		int writeFd = -1;
+		if(mkfifo((name + ".c2s").c_str(), 0600) == 0 && mkfifo((name + ".s2c").c_str(), 0600) == 0)
+			readFd = open((name + ".s2c").c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+		ssize_t rc = -1;
+		if(readFd >= 0)
+			rc = writeWithoutSigPipe([&]() { return ::write(server, request.data(), request.size()); });
+		close(server);
+
+		// Writing end can be opened only after server takes request and opens its reading end; ENXIO until then
+		if(rc == (ssize_t)request.size())
+		{
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(gs_handshakeTimeout);
+			while(((writeFd = open((name + ".c2s").c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0) &&
+					((errno == ENXIO) || (errno == EINTR)) && (std::chrono::steady_clock::now() < deadline))
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		int error = errno;
+		unlink((name + ".c2s").c_str());
+		unlink((name + ".s2c").c_str());
+
+		if(writeFd < 0)
+		{
+			if(readFd >= 0)
+				close(readFd);
+			throw IoException("Unable to connect to fifo: " + path + "/" + std::to_string(error));
+		}
+
+		char ack = 0;
+		if(writeWithoutSigPipe([&]() { return ::write(writeFd, &ack, 1); }) != 1)
+		{
+			close(readFd);
+			close(writeFd);
+			throw IoException("Unable to connect to fifo: " + path + "/" + std::to_string(errno));
+		}
+
+		setBlocking(readFd);
+		setBlocking(writeFd);
+		line.reset(new PipeLine(readFd, writeFd));
+	}
+
+	applyLineOptions(line.get(), options);
+	return line.release();
+}
+
+IoAcceptor* PipeLineFactory::createServer(const std::string& address)
+{
+	LineOptions options;
+	auto path = splitLineOptions(address, options);
+	if(path.substr(0, 3) == "fd:")
+		throw IoException("Inherited pipe descriptors can only be used by client");
+	return new PipeAcceptor(path, options);
+}
+
+}
@@ -0,0 +1,109 @@
+
+#ifndef POSIX_PIPES_H
+#define POSIX_PIPES_H
+
+#include "cppio/ioline.h"
+#include "../common/lineoptions.h"
+
+#include <deque>
+#include <cstdint>
+
+namespace cppio
+{
+
+/*
+ * Line over pair of pipes (or FIFOs), one for each direction. Pipes don't preserve message boundaries.
+ */
+class PipeLine : public IoLine
+{
+public:
+	/*
+	 * Takes ownership of both descriptors
+	 */
+	PipeLine(int readFd, int writeFd);
+	virtual ~PipeLine();
+
+	/*
+	 * Two connected lines, e.g. for parent and child process: after fork() each side deletes the line of other one
+	 */
+	static std::pair<PipeLine*, PipeLine*> createPair();
+
+	virtual ssize_t read(void* buffer, size_t buflen);
+	virtual ssize_t write(void* buffer, size_t buflen);
+
+	/*
+	 * With VmspliceThreshold option, buffers of at least that size are mapped into pipe with vmsplice() instead of
+	 * being copied. Buffer is referenced until reader has consumed it.
+	 */
+	virtual ssize_t writeShared(const std::shared_ptr<const std::vector<char>>& buffer, size_t offset, size_t buflen);
+	virtual ssize_t writeGathered(const IoVec* parts, size_t count);
+
+	virtual void setOption(LineOption option, void* data);
+	virtual bool isConnected();
+
+	/*
+	 * Read end, for polling. File regions are copied by default IoLine::sendFileRegion().
+	 */
+	virtual void* getNativeHandle() { return &m_readFd; }
+
+	/*
+	 * Number of spliced buffers which reader hasn't consumed yet
+	 */
+	size_t pendingSplicedBuffers();
+
+private:
+	ssize_t writeData(const IoVec* parts, size_t count, bool splice);
+	void releaseConsumedBuffers();
+
+private:
+	int m_readFd;
+	int m_writeFd;
+	int m_readTimeout;
+	int m_writeTimeout;
+
+	size_t m_vmspliceThreshold;
+	uint64_t m_written;
+	// Spliced buffers with stream position of their end
+	std::deque<std::pair<uint64_t, std::shared_ptr<const std::vector<char>>>> m_spliced;
+};
+
+/*
+ * Listens on FIFO at given path. Client creates its own pair of FIFOs and sends their name through this one,
+ * like NamedPipeAcceptor does on win32.
+ */
+class PipeAcceptor : public IoAcceptor
+{
+public:
+	PipeAcceptor(const std::string& path, const LineOptions& options);
+	virtual ~PipeAcceptor();
+
+	virtual IoLine* waitConnection(int timeoutInMs);
+
+	virtual void* getNativeHandle() { return &m_fd; }
+
+private:
+	IoLine* openClientPipes(const std::string& name);
+
+private:
+	std::string m_path;
+	int m_fd;
+	LineOptions m_options;
+	std::string m_pending;
+};
+
+/*
+ * "pipe:///path/to/fifo", or "pipe://fd:R,W" to wrap inherited descriptors (client only).
+ * Connecting to FIFO blocks until server takes connection in waitConnection().
+ */
+class PipeLineFactory : public IoLineFactory
+{
+public:
+	virtual ~PipeLineFactory();
+	virtual bool supportsScheme(const std::string& scheme);
+	virtual IoLine* createClient(const std::string& address);
+	virtual IoAcceptor* createServer(const std::string& address);
+};
+
+}
+
+#endif /* ifndef POSIX_PIPES_H */
@@ -0,0 +1,190 @@
+
+#include "resolver.h"
+
+#include "cppio/ioline.h"
+
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include <netdb.h>
+
+namespace cppio
+{
+
+struct CacheEntry
+{
+	std::vector<ResolvedAddress> addresses;
+	std::chrono::steady_clock::time_point expires;
+};
+
+static const std::chrono::seconds gs_cacheTtl(60);
+static std::mutex gs_cacheMutex;
+static std::map<std::string, CacheEntry> gs_cache;
+
+static void splitHostPort(const std::string& address, std::string& host, std::string& port)
+{
+	if(!address.empty() && address[0] == '[')
+	{
+		auto bracket = address.find(']');
+		if(bracket == std::string::npos || bracket + 1 >= address.size() || address[bracket + 1] != ':')
+			throw IoException("Invalid address: " + address);
+		host = address.substr(1, bracket - 1);
+		port = address.substr(bracket + 2);
+		return;
+	}
+
+	auto colon = address.rfind(':');
+	if(colon == std::string::npos)
+		throw IoException("Invalid address, port is missing: " + address);
+	host = address.substr(0, colon);
+	port = address.substr(colon + 1);
+}
+
+static std::vector<ResolvedAddress> interleaveFamilies(const std::vector<ResolvedAddress>& addresses)
+{
+	if(addresses.empty())
+		return addresses;
+
+	int firstFamily = addresses.front().family();
+	std::vector<ResolvedAddress> first;
+	std::vector<ResolvedAddress> other;
+	for(const auto& address : addresses)
+	{
+		if(address.family() == firstFamily)
+			first.push_back(address);
+		else
+			other.push_back(address);
+	}
+
+	std::vector<ResolvedAddress> result;
+	for(size_t i = 0; i < std::max(first.size(), other.size()); i++)
+	{
+		if(i < first.size())
+			result.push_back(first[i]);
+		if(i < other.size())
+			result.push_back(other[i]);
+	}
+	return result;
+}
+
+/*
+ * With numericOnly, returns false instead of doing name lookup if host is not an address literal
+ */
+static bool lookup(const std::string& host, const std::string& port, bool passive, bool numericOnly,
+		std::vector<ResolvedAddress>& result)
+{
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if(passive)
+		hints.ai_flags |= AI_PASSIVE;
+	if(numericOnly)
+		hints.ai_flags |= AI_NUMERICHOST;
+
+	addrinfo* info = nullptr;
+	int rc = getaddrinfo(host == "*" ? nullptr : host.c_str(), port.c_str(), &hints, &info);
+	if(numericOnly && (rc == EAI_NONAME))
+		return false;
+	if(rc != 0)
+		throw IoException("Unable to resolve " + host + ":" + port + ": " + gai_strerror(rc));
+
+	result.clear();
+	for(addrinfo* p = info; p != nullptr; p = p->ai_next)
+	{
+		ResolvedAddress address;
+		memset(&address.address, 0, sizeof(address.address));
+		memcpy(&address.address, p->ai_addr, p->ai_addrlen);
+		address.length = p->ai_addrlen;
+		result.push_back(address);
+	}
+	freeaddrinfo(info);
+	return true;
+}
+
+/*
+ * Expired entries are dropped on every miss, so that cache doesn't grow with names which are not used anymore.
+ * Called with gs_cacheMutex held.
+ */
+static bool findCached(const std::string& address, const std::chrono::steady_clock::time_point& now,
+		std::vector<ResolvedAddress>& addresses)
+{
+	auto it = gs_cache.find(address);
+	if(it != gs_cache.end() && it->second.expires > now)
+	{
+		addresses = it->second.addresses;
+		return true;
+	}
+
+	for(auto entry = gs_cache.begin(); entry != gs_cache.end();)
+	{
+		if(entry->second.expires <= now)
+			entry = gs_cache.erase(entry);
+		else
+			++entry;
+	}
+	return false;
+}
+
+static bool resolveClientAddress(const std::string& address, bool numericOnly, std::vector<ResolvedAddress>& addresses)
+{
+	std::string host;
+	std::string port;
+	splitHostPort(address, host, port);
+
+	auto now = std::chrono::steady_clock::now();
+	{
+		std::unique_lock<std::mutex> lock(gs_cacheMutex);
+		if(findCached(address, now, addresses))
+			return true;
+	}
+
+	if(!lookup(host, port, false, numericOnly, addresses))
+		return false;
+	addresses = interleaveFamilies(addresses);
+
+	std::unique_lock<std::mutex> lock(gs_cacheMutex);
+	auto& entry = gs_cache[address];
+	entry.addresses = addresses;
+	entry.expires = now + gs_cacheTtl;
+	return true;
+}
+
+std::vector<ResolvedAddress> resolveAddress(const std::string& address, bool passive)
+{
+	std::vector<ResolvedAddress> addresses;
+	if(passive)
+	{
+		std::string host;
+		std::string port;
+		splitHostPort(address, host, port);
+		lookup(host, port, passive, false, addresses);
+		return addresses;
+	}
+
+	resolveClientAddress(address, false, addresses);
+	return addresses;
+}
+
+bool resolveAddressWithoutLookup(const std::string& address, std::vector<ResolvedAddress>& addresses)
+{
+	return resolveClientAddress(address, true, addresses);
+}
+
+size_t resolverCacheSize()
+{
+	std::unique_lock<std::mutex> lock(gs_cacheMutex);
+	return gs_cache.size();
+}
+
+void clearResolverCache()
+{
+	std::unique_lock<std::mutex> lock(gs_cacheMutex);
+	gs_cache.clear();
+}
+
+}
@@ -0,0 +1,40 @@
+
+#ifndef POSIX_RESOLVER_H
+#define POSIX_RESOLVER_H
+
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+
+namespace cppio
+{
+
+struct ResolvedAddress
+{
+	sockaddr_storage address;
+	socklen_t length;
+
+	int family() const { return address.ss_family; }
+};
+
+/*
+ * Resolves "host:port", "[ipv6]:port" or "*:port" (any address, only with passive == true).
+ * Client lookups are cached for a minute and returned in RFC 8305 order: preferred address first,
+ * then alternating between address families.
+ * Throws IoException if address can't be resolved.
+ */
+std::vector<ResolvedAddress> resolveAddress(const std::string& address, bool passive);
+
+/*
+ * Resolves client address only if it doesn't need name lookup (address literal or cached name), returns false
+ * otherwise. Throws IoException if address is invalid.
+ */
+bool resolveAddressWithoutLookup(const std::string& address, std::vector<ResolvedAddress>& addresses);
+
+void clearResolverCache();
+size_t resolverCacheSize();
+
+}
+
+#endif /* ifndef POSIX_RESOLVER_H */
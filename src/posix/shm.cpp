@@ -0,0 +1,427 @@
+#include "shm.h"
+#include "io_socket.h"
+
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <chrono>
+#include <new>
+
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace cppio
+{
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Futex words should be lock-free atomics");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex word should be plain 32-bit integer");
+
+static const uint32_t gs_ringCapacity = 1 << 20;
+// Both ring headers are placed on the first page of segment, ring data follows
+static const size_t gs_headersSize = 4096;
+static_assert(2 * sizeof(ShmRingHeader) <= gs_headersSize, "Ring headers should fit first page");
+static const int gs_handshakeTimeout = 1000;
+// How often sleeping side checks that peer process is still alive
+static const int gs_livenessInterval = 100;
+
+static std::string rendezvousAddress(const std::string& name)
+{
+	return "@cppio-shm-" + name;
+}
+
+static size_t segmentSize(uint32_t capacity)
+{
+	return gs_headersSize + 2 * (size_t)capacity;
+}
+
+static ShmRingHeader* ringHeader(void* mapping, int index)
+{
+	return reinterpret_cast<ShmRingHeader*>((char*)mapping + index * sizeof(ShmRingHeader));
+}
+
+static char* ringData(void* mapping, int index, uint32_t capacity)
+{
+	return (char*)mapping + gs_headersSize + index * (size_t)capacity;
+}
+
+/*
+ * Segment is mapped by different processes, so futexes should not be process-private
+ */
+static void futexWait(std::atomic<uint32_t>* word, uint32_t expected, int timeoutInMs)
+{
+	timespec timeout;
+	timeout.tv_sec = timeoutInMs / 1000;
+	timeout.tv_nsec = (timeoutInMs % 1000) * 1000000L;
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+static void futexWake(std::atomic<uint32_t>* word)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/*
+ * Sleeps until ready() returns true. Sleeping side raises 'waiting' flag and the other side bumps 'sequence' and
+ * wakes it only if flag is set, so fast path costs no syscalls. Fences pair with the ones in notify().
+ * Returns 0, eTimeout or eConnectionLost if rendezvous socket shows that peer is gone.
+ */
+template<typename Predicate>
+static ssize_t waitForPeer(std::atomic<uint32_t>& sequence, std::atomic<uint32_t>& waiting, Predicate ready,
+		int timeoutInMs, IoLine* liveness)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutInMs);
+	while(true)
+	{
+		uint32_t current = sequence.load(std::memory_order_acquire);
+		waiting.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(ready())
+		{
+			waiting.store(0, std::memory_order_relaxed);
+			return 0;
+		}
+
+		int slice = gs_livenessInterval;
+		if(timeoutInMs > 0)
+		{
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if(left <= 0)
+			{
+				waiting.store(0, std::memory_order_relaxed);
+				return eTimeout;
+			}
+			slice = std::min<int>(slice, left);
+		}
+
+		futexWait(&sequence, current, slice);
+		waiting.store(0, std::memory_order_relaxed);
+		if(sequence.load(std::memory_order_acquire) == current && !ready() && liveness && !liveness->isConnected())
+			return eConnectionLost;
+	}
+}
+
+static void notify(std::atomic<uint32_t>& sequence, std::atomic<uint32_t>& waiting)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(waiting.load(std::memory_order_relaxed))
+	{
+		sequence.fetch_add(1, std::memory_order_release);
+		futexWake(&sequence);
+	}
+}
+
+/*
+ * Returns received descriptor or -1 if peer hasn't sent it in time
+ */
+static int receiveDescriptor(UnixSocket* socket, int timeoutInMs)
+{
+	pollfd pfd;
+	pfd.fd = *static_cast<int*>(socket->getNativeHandle());
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if(::poll(&pfd, 1, timeoutInMs) <= 0)
+		return -1;
+
+	char byte;
+	if(socket->read(&byte, 1) != 1)
+		return -1;
+	return socket->takeDescriptor();
+}
+
+static void* mapSegment(int fd, size_t size)
+{
+	void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if(mapping == MAP_FAILED)
+		return nullptr;
+	return mapping;
+}
+
+ShmRing::ShmRing(ShmRingHeader* header, char* data) : m_header(header),
+	m_data(data),
+	m_mask(header->capacity - 1)
+{
+}
+
+ssize_t ShmRing::read(void* buffer, size_t buflen, int timeoutInMs, IoLine* liveness)
+{
+	uint64_t tail = m_header->tail.load(std::memory_order_relaxed);
+	while(true)
+	{
+		uint64_t head = m_header->head.load(std::memory_order_acquire);
+		if(head != tail)
+		{
+			size_t length = std::min<uint64_t>(head - tail, buflen);
+			size_t offset = tail & m_mask;
+			size_t first = std::min<size_t>(length, m_mask + 1 - offset);
+			memcpy(buffer, m_data + offset, first);
+			memcpy((char*)buffer + first, m_data, length - first);
+
+			m_header->tail.store(tail + length, std::memory_order_release);
+			notify(m_header->spaceSequence, m_header->writerWaiting);
+			return length;
+		}
+
+		if(m_header->closed.load(std::memory_order_acquire))
+			return eConnectionLost;
+
+		ssize_t rc = waitForPeer(m_header->dataSequence, m_header->readerWaiting, [&]() {
+					return m_header->head.load(std::memory_order_acquire) != tail || m_header->closed.load(std::memory_order_acquire);
+				}, timeoutInMs, liveness);
+		if(rc < 0)
+			return rc;
+	}
+}
+
+ssize_t ShmRing::write(const void* buffer, size_t buflen, int timeoutInMs, IoLine* liveness)
+{
+	uint64_t head = m_header->head.load(std::memory_order_relaxed);
+	while(true)
+	{
+		if(m_header->closed.load(std::memory_order_acquire))
+			return eConnectionLost;
+
+		uint64_t tail = m_header->tail.load(std::memory_order_acquire);
+		size_t space = m_mask + 1 - (head - tail);
+		if(space > 0)
+		{
+			size_t length = std::min(space, buflen);
+			size_t offset = head & m_mask;
+			size_t first = std::min<size_t>(length, m_mask + 1 - offset);
+			memcpy(m_data + offset, buffer, first);
+			memcpy(m_data, (const char*)buffer + first, length - first);
+
+			m_header->head.store(head + length, std::memory_order_release);
+			notify(m_header->dataSequence, m_header->readerWaiting);
+			return length;
+		}
+
+		ssize_t rc = waitForPeer(m_header->spaceSequence, m_header->writerWaiting, [&]() {
+					return m_header->tail.load(std::memory_order_acquire) != tail || m_header->closed.load(std::memory_order_acquire);
+				}, timeoutInMs, liveness);
+		if(rc < 0)
+			return rc;
+	}
+}
+
+void ShmRing::close()
+{
+	m_header->closed.store(1, std::memory_order_release);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	m_header->dataSequence.fetch_add(1, std::memory_order_release);
+	futexWake(&m_header->dataSequence);
+	m_header->spaceSequence.fetch_add(1, std::memory_order_release);
+	futexWake(&m_header->spaceSequence);
+}
+
+bool ShmRing::isClosed() const
+{
+	return m_header->closed.load(std::memory_order_acquire) != 0;
+}
+
+ShmLine::ShmLine(UnixSocket* socket, void* mapping, size_t mappingSize, bool server) : m_socket(socket),
+	m_mapping(mapping),
+	m_mappingSize(mappingSize),
+	m_readTimeout(0),
+	m_writeTimeout(0)
+{
+	// Ring 0 carries data from client to server, ring 1 - from server to client
+	uint32_t capacity = ringHeader(mapping, 0)->capacity;
+	std::unique_ptr<ShmRing> toServer(new ShmRing(ringHeader(mapping, 0), ringData(mapping, 0, capacity)));
+	std::unique_ptr<ShmRing> toClient(new ShmRing(ringHeader(mapping, 1), ringData(mapping, 1, capacity)));
+	if(server)
+	{
+		m_in = std::move(toServer);
+		m_out = std::move(toClient);
+	}
+	else
+	{
+		m_in = std::move(toClient);
+		m_out = std::move(toServer);
+	}
+}
+
+ShmLine::~ShmLine()
+{
+	m_in->close();
+	m_out->close();
+	munmap(m_mapping, m_mappingSize);
+}
+
+ssize_t ShmLine::read(void* buffer, size_t buflen)
+{
+	return m_in->read(buffer, buflen, m_readTimeout, m_socket.get());
+}
+
+ssize_t ShmLine::write(void* buffer, size_t buflen)
+{
+	return m_out->write(buffer, buflen, m_writeTimeout, m_socket.get());
+}
+
+void ShmLine::setOption(LineOption option, void* data)
+{
+	switch(option)
+	{
+		case LineOption::ReceiveTimeout:
+			m_readTimeout = *reinterpret_cast<int*>(data);
+			break;
+
+		case LineOption::SendTimeout:
+			m_writeTimeout = *reinterpret_cast<int*>(data);
+			break;
+
+		default:
+			throw UnsupportedOption("");
+	}
+}
+
+bool ShmLine::isConnected()
+{
+	return !m_in->isClosed() && !m_out->isClosed() && m_socket->isConnected();
+}
+
+ShmAcceptor::ShmAcceptor(const std::string& name, const LineOptions& options) : m_acceptor(new UnixSocketAcceptor(rendezvousAddress(name))),
+	m_options(options)
+{
+}
+
+ShmAcceptor::~ShmAcceptor()
+{
+}
+
+IoLine* ShmAcceptor::waitConnection(int timeoutInMs)
+{
+	auto lines = waitConnections(1, timeoutInMs);
+	if(lines.empty())
+		return nullptr;
+	return lines.front();
+}
+
+std::vector<IoLine*> ShmAcceptor::waitConnections(size_t maxConnections, int timeoutInMs)
+{
+	std::vector<IoLine*> lines;
+	for(auto line : m_acceptor->waitConnections(maxConnections, timeoutInMs))
+	{
+		// Client sends segment right after connect, so it is normally already queued
+		std::unique_ptr<UnixSocket> socket(static_cast<UnixSocket*>(line));
+		int fd = receiveDescriptor(socket.get(), gs_handshakeTimeout);
+		if(fd < 0)
+			continue;
+
+		struct stat st;
+		void* mapping = nullptr;
+		size_t size = 0;
+		if(fstat(fd, &st) == 0 && (size_t)st.st_size > gs_headersSize)
+		{
+			size = st.st_size;
+			mapping = mapSegment(fd, size);
+		}
+		::close(fd);
+		if(!mapping)
+			continue;
+
+		uint32_t capacity = ringHeader(mapping, 0)->capacity;
+		if(capacity == 0 || (capacity & (capacity - 1)) != 0 || ringHeader(mapping, 1)->capacity != capacity ||
+				segmentSize(capacity) != size)
+		{
+			munmap(mapping, size);
+			continue;
+		}
+
+		std::unique_ptr<ShmLine> shmLine(new ShmLine(socket.release(), mapping, size, true));
+		try
+		{
+			applyLineOptions(shmLine.get(), m_options);
+		}
+		catch(const IoException& e)
+		{
+			for(auto l : lines)
+				delete l;
+			throw;
+		}
+		lines.push_back(shmLine.release());
+	}
+	return lines;
+}
+
+void* ShmAcceptor::getNativeHandle()
+{
+	return m_acceptor->getNativeHandle();
+}
+
+ShmLineFactory::~ShmLineFactory()
+{
+}
+
+bool ShmLineFactory::supportsScheme(const std::string& scheme)
+{
+	return scheme == "shm";
+}
+
+IoLine* ShmLineFactory::createClient(const std::string& address)
+{
+	LineOptions options;
+	auto name = splitLineOptions(address, options);
+
+	size_t size = segmentSize(gs_ringCapacity);
+	int fd = memfd_create(("cppio-shm-" + name).c_str(), MFD_CLOEXEC);
+	if(fd < 0)
+		throw IoException("Unable to create shared memory segment: " + std::to_string(errno));
+
+	void* mapping = nullptr;
+	if(ftruncate(fd, size) == 0)
+		mapping = mapSegment(fd, size);
+	if(!mapping)
+	{
+		::close(fd);
+		throw IoException("Unable to map shared memory segment: " + std::to_string(errno));
+	}
+
+	for(int i = 0; i < 2; i++)
+	{
+		auto header = new(ringHeader(mapping, i)) ShmRingHeader();
+		header->head.store(0);
+		header->tail.store(0);
+		header->dataSequence.store(0);
+		header->readerWaiting.store(0);
+		header->spaceSequence.store(0);
+		header->writerWaiting.store(0);
+		header->closed.store(0);
+		header->capacity = gs_ringCapacity;
+	}
+
+	std::unique_ptr<ShmLine> line;
+	try
+	{
+		std::unique_ptr<UnixSocket> socket(new UnixSocket(rendezvousAddress(name)));
+		socket->connect();
+		char byte = 0;
+		if(socket->writeWithDescriptors(&byte, 1, &fd, 1) != 1)
+			throw IoException("Unable to pass shared memory segment");
+		line.reset(new ShmLine(socket.release(), mapping, size, false));
+	}
+	catch(const IoException& e)
+	{
+		::close(fd);
+		munmap(mapping, size);
+		throw;
+	}
+	::close(fd);
+
+	applyLineOptions(line.get(), options);
+	return line.release();
+}
+
+IoAcceptor* ShmLineFactory::createServer(const std::string& address)
+{
+	LineOptions options;
+	auto name = splitLineOptions(address, options);
+	return new ShmAcceptor(name, options);
+}
+
+}
@@ -0,0 +1,108 @@
+
+#ifndef POSIX_SHM_H
+#define POSIX_SHM_H
+
+#include "cppio/ioline.h"
+#include "../common/lineoptions.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace cppio
+{
+
+class UnixSocket;
+class UnixSocketAcceptor;
+
+/*
+ * Single-producer single-consumer byte ring placed in shared memory.
+ * Positions are monotonic byte counters, capacity is power of two.
+ * Waiting side sleeps on futex words, so that peer can wake it from another process.
+ */
+struct ShmRingHeader
+{
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+	alignas(64) std::atomic<uint32_t> dataSequence;
+	std::atomic<uint32_t> readerWaiting;
+	std::atomic<uint32_t> spaceSequence;
+	std::atomic<uint32_t> writerWaiting;
+	std::atomic<uint32_t> closed;
+	uint32_t capacity;
+};
+
+class ShmRing
+{
+public:
+	ShmRing(ShmRingHeader* header, char* data);
+
+	ssize_t read(void* buffer, size_t buflen, int timeoutInMs, IoLine* liveness);
+	ssize_t write(const void* buffer, size_t buflen, int timeoutInMs, IoLine* liveness);
+
+	void close();
+	bool isClosed() const;
+
+private:
+	ShmRingHeader* m_header;
+	char* m_data;
+	uint64_t m_mask;
+};
+
+class ShmLine : public IoLine
+{
+public:
+	/*
+	 * Takes ownership of rendezvous socket and of mapping of segment with two rings
+	 */
+	ShmLine(UnixSocket* socket, void* mapping, size_t mappingSize, bool server);
+	virtual ~ShmLine();
+
+	virtual ssize_t read(void* buffer, size_t buflen);
+	virtual ssize_t write(void* buffer, size_t buflen);
+	virtual void setOption(LineOption option, void* data);
+	virtual bool isConnected();
+
+private:
+	std::unique_ptr<UnixSocket> m_socket;
+	void* m_mapping;
+	size_t m_mappingSize;
+
+	std::unique_ptr<ShmRing> m_in;
+	std::unique_ptr<ShmRing> m_out;
+
+	int m_readTimeout;
+	int m_writeTimeout;
+};
+
+class ShmAcceptor : public IoAcceptor
+{
+public:
+	ShmAcceptor(const std::string& name, const LineOptions& options = LineOptions());
+	virtual ~ShmAcceptor();
+
+	virtual IoLine* waitConnection(int timeoutInMs);
+	virtual std::vector<IoLine*> waitConnections(size_t maxConnections, int timeoutInMs);
+
+	virtual void* getNativeHandle();
+
+private:
+	std::unique_ptr<UnixSocketAcceptor> m_acceptor;
+	LineOptions m_options;
+};
+
+/*
+ * "shm://name" scheme. Connection is set up through abstract unix socket: client creates memfd segment with
+ * pair of rings and passes it to server; after that data goes through shared memory only.
+ */
+class ShmLineFactory : public IoLineFactory
+{
+public:
+	virtual ~ShmLineFactory();
+	virtual bool supportsScheme(const std::string& scheme);
+	virtual IoLine* createClient(const std::string& address);
+	virtual IoAcceptor* createServer(const std::string& address);
+};
+
+}
+
+#endif /* ifndef POSIX_SHM_H */
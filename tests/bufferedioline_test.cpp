@@ -0,0 +1,162 @@
+
+#include "catch.hpp"
+
+#include "cppio/bufferedioline.h"
+#include "cppio/message.h"
+
+#include <thread>
+#ifdef __MINGW32__
+#ifndef _GLIBCXX_HAS_GTHREADS
+#include "mingw.thread.h"
+#endif
+#endif
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
+using namespace cppio;
+
+namespace
+{
+class RecordingLine : public IoLine
+{
+public:
+	RecordingLine(std::vector<char>& written, std::vector<char>& toRead, int& writes, int& reads) :
+		m_written(written), m_toRead(toRead), m_writes(writes), m_reads(reads), m_readOffset(0)
+	{
+	}
+
+	virtual ssize_t read(void* buffer, size_t buflen)
+	{
+		m_reads++;
+		size_t length = std::min(buflen, m_toRead.size() - m_readOffset);
+		if(length == 0)
+			return eConnectionLost;
+		memcpy(buffer, m_toRead.data() + m_readOffset, length);
+		m_readOffset += length;
+		return length;
+	}
+
+	virtual ssize_t write(void* buffer, size_t buflen)
+	{
+		m_writes++;
+		m_written.insert(m_written.end(), (char*)buffer, (char*)buffer + buflen);
+		return buflen;
+	}
+
+	virtual void setOption(LineOption option, void* data)
+	{
+	}
+
+private:
+	std::vector<char>& m_written;
+	std::vector<char>& m_toRead;
+	int& m_writes;
+	int& m_reads;
+	size_t m_readOffset;
+};
+}
+
+TEST_CASE("BufferedIoLine", "[io]")
+{
+	std::vector<char> written;
+	std::vector<char> toRead;
+	int writes = 0;
+	int reads = 0;
+
+	SECTION("Small writes are coalesced")
+	{
+		BufferedIoLine line(std::unique_ptr<IoLine>(new RecordingLine(written, toRead, writes, reads)), 16, 16);
+
+		for(int i = 0; i < 10; i++)
+			REQUIRE(line.write((void*)"abc", 3) == 3);
+
+		REQUIRE(writes == 1);
+		REQUIRE(written.size() == 15);
+
+		REQUIRE(line.flush() == 0);
+		REQUIRE(writes == 2);
+		REQUIRE(std::string(written.begin(), written.end()) == "abcabcabcabcabcabcabcabcabcabc");
+	}
+
+	SECTION("Big write is passed through")
+	{
+		BufferedIoLine line(std::unique_ptr<IoLine>(new RecordingLine(written, toRead, writes, reads)), 16, 16);
+
+		std::vector<char> big(100, 'x');
+		REQUIRE(line.write((void*)"abc", 3) == 3);
+		REQUIRE(line.write(big.data(), big.size()) == 100);
+
+		REQUIRE(writes == 2);
+		REQUIRE(written.size() == 103);
+		REQUIRE(memcmp(written.data(), "abc", 3) == 0);
+	}
+
+	SECTION("Buffered data is sent on destruction")
+	{
+		{
+			BufferedIoLine line(std::unique_ptr<IoLine>(new RecordingLine(written, toRead, writes, reads)), 16, 16);
+			line.write((void*)"abc", 3);
+			REQUIRE(writes == 0);
+		}
+		REQUIRE(writes == 1);
+		REQUIRE(written.size() == 3);
+	}
+
+	SECTION("Buffered data is sent after latency")
+	{
+		BufferedIoLine line(std::unique_ptr<IoLine>(new RecordingLine(written, toRead, writes, reads)), 1024, 16, 10);
+
+		line.write((void*)"abc", 3);
+		line.write((void*)"def", 3);
+
+		auto start = std::chrono::steady_clock::now();
+		while(writes == 0 && std::chrono::steady_clock::now() - start < std::chrono::seconds(2))
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		REQUIRE(line.flush() == 0);
+		REQUIRE(writes == 1);
+		REQUIRE(std::string(written.begin(), written.end()) == "abcdef");
+	}
+
+	SECTION("Reads are buffered")
+	{
+		Message msg;
+		for(int i = 0; i < 10; i++)
+			msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+
+		{
+			BufferedIoLine line(std::unique_ptr<IoLine>(new RecordingLine(toRead, written, writes, reads)));
+			MessageProtocol proto(&line);
+			proto.sendMessage(msg);
+			proto.sendMessage(msg);
+		}
+
+		BufferedIoLine line(std::unique_ptr<IoLine>(new RecordingLine(written, toRead, writes, reads)));
+		MessageProtocol proto(&line);
+
+		Message recv1;
+		Message recv2;
+		proto.readMessage(recv1);
+		proto.readMessage(recv2);
+
+		REQUIRE(reads == 1);
+		REQUIRE(line.bufferedReadSize() == 0);
+		REQUIRE(recv1.size() == 10);
+		REQUIRE(recv2.size() == 10);
+		REQUIRE(recv2.frame(9) == msg.frame(9));
+	}
+
+	SECTION("Message boundary preserving line is rejected")
+	{
+		class RecordLine : public RecordingLine
+		{
+		public:
+			using RecordingLine::RecordingLine;
+			virtual bool preservesBoundaries() const { return true; }
+		};
+
+		REQUIRE_THROWS_AS(BufferedIoLine(std::unique_ptr<IoLine>(new RecordLine(written, toRead, writes, reads))), const IoException&);
+	}
+}
+
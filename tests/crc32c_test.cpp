@@ -0,0 +1,58 @@
+
+#include "catch.hpp"
+
+#include "common/crc32c.h"
+
+#include <vector>
+#include <cstring>
+
+using namespace cppio;
+
+TEST_CASE("CRC32C", "[crc]")
+{
+	SECTION("Known values")
+	{
+		REQUIRE(crc32c(0, "123456789", 9) == 0xe3069283);
+		REQUIRE(crc32cSoftware(0, "123456789", 9) == 0xe3069283);
+		REQUIRE(crc32c(0, "", 0) == 0);
+
+		// RFC 3720, B.4
+		std::vector<char> zeros(32, 0);
+		REQUIRE(crc32c(0, zeros.data(), zeros.size()) == 0x8a9136aa);
+		std::vector<char> ones(32, (char)0xff);
+		REQUIRE(crc32c(0, ones.data(), ones.size()) == 0x62a8ab43);
+		std::vector<char> ascending(32);
+		for(size_t i = 0; i < ascending.size(); i++)
+			ascending[i] = i;
+		REQUIRE(crc32c(0, ascending.data(), ascending.size()) == 0x46dd794e);
+	}
+
+	SECTION("Big and unaligned buffers")
+	{
+		// Big enough for both long and short interleaved blocks
+		std::vector<char> data(100000 + 3);
+		uint32_t state = 1;
+		for(auto& c : data)
+		{
+			state = state * 1103515245 + 12345;
+			c = state >> 16;
+		}
+
+		for(size_t offset = 0; offset < 3; offset++)
+		{
+			const char* begin = data.data() + offset;
+			size_t length = data.size() - offset;
+			uint32_t expected = crc32cSoftware(0, begin, length);
+			REQUIRE(crc32c(0, begin, length) == expected);
+
+			uint32_t pieces = 0;
+			for(size_t done = 0; done < length; done += 777)
+				pieces = crc32c(pieces, begin + done, std::min<size_t>(777, length - done));
+			REQUIRE(pieces == expected);
+
+			std::vector<char> copy(length);
+			REQUIRE(crc32cCopy(0, copy.data(), begin, length) == expected);
+			REQUIRE(memcmp(copy.data(), begin, length) == 0);
+		}
+	}
+}
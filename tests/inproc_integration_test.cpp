@@ -5,6 +5,7 @@
 #include "cppio/iolinemanager.h"
 
 #include <numeric>
+#include <array>
 #include <thread>
 #ifdef __MINGW32__
 #ifndef _GLIBCXX_HAS_GTHREADS
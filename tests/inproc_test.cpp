@@ -5,6 +5,7 @@
 #include "cppio/iolinemanager.h"
 
 #include <numeric>
+#include <array>
 #include <cstring>
 #include <memory>
 
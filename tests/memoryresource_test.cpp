@@ -0,0 +1,235 @@
+
+#include "catch.hpp"
+
+#include "cppio/memoryresource.h"
+#include "cppio/message.h"
+
+#include <thread>
+#ifdef __MINGW32__
+#ifndef _GLIBCXX_HAS_GTHREADS
+#include "mingw.thread.h"
+#endif
+#endif
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+using namespace cppio;
+
+namespace
+{
+class CountingResource : public MemoryResource
+{
+public:
+	CountingResource() : allocations(0), deallocations(0), bytes(0) {}
+
+	int allocations;
+	int deallocations;
+	size_t bytes;
+
+protected:
+	virtual void* doAllocate(size_t size, size_t alignment)
+	{
+		allocations++;
+		bytes += size;
+		return newDeleteResource()->allocate(size, alignment);
+	}
+
+	virtual void doDeallocate(void* p, size_t size, size_t alignment)
+	{
+		deallocations++;
+		bytes -= size;
+		newDeleteResource()->deallocate(p, size, alignment);
+	}
+};
+}
+
+TEST_CASE("Memory resources", "[memory]")
+{
+	SECTION("New/delete resource alignment")
+	{
+		void* p = newDeleteResource()->allocate(100, 64);
+		REQUIRE(reinterpret_cast<uintptr_t>(p) % 64 == 0);
+		memset(p, 0, 100);
+		newDeleteResource()->deallocate(p, 100, 64);
+	}
+
+	SECTION("Monotonic buffer")
+	{
+		char buffer[64];
+		CountingResource upstream;
+		{
+			MonotonicBufferResource arena(buffer, sizeof(buffer), &upstream);
+			void* first = arena.allocate(16, 16);
+			REQUIRE(first >= (void*)buffer);
+			REQUIRE(first < (void*)(buffer + sizeof(buffer)));
+			REQUIRE(reinterpret_cast<uintptr_t>(first) % 16 == 0);
+			REQUIRE(upstream.allocations == 0);
+
+			void* second = arena.allocate(1000, 8);
+			REQUIRE(reinterpret_cast<uintptr_t>(second) % 8 == 0);
+			REQUIRE(upstream.allocations == 1);
+
+			arena.release();
+			REQUIRE(upstream.deallocations == 1);
+			REQUIRE(arena.allocate(16, 16) == first);
+
+			arena.allocate(1000, 8);
+		}
+		REQUIRE(upstream.bytes == 0);
+	}
+
+	SECTION("Frames and messages")
+	{
+		CountingResource resource;
+		std::vector<char> big(1000, 'x');
+		{
+			Message msg(&resource);
+			REQUIRE(msg.resource() == &resource);
+			msg.reserve(3);
+			REQUIRE(resource.allocations == 1);
+
+			msg.emplaceFrame(big.data(), big.size(), &resource);
+			msg.emplaceFrame("\x01\x02", 2, &resource);
+			REQUIRE(resource.allocations == 2);
+
+			msg.resize(3);
+			REQUIRE(msg.frame(2).resource() == &resource);
+			msg.frame(2).assign(big.data(), big.size());
+			REQUIRE(resource.allocations == 3);
+
+			// Storage is reused for smaller payloads
+			msg.frame(2).assign(big.data(), 100);
+			REQUIRE(resource.allocations == 3);
+
+			Message copy = msg;
+			REQUIRE(copy.resource() == defaultResource());
+			REQUIRE(copy.frame(0).resource() == defaultResource());
+			REQUIRE(copy.frame(0) == msg.frame(0));
+			REQUIRE(resource.allocations == 3);
+
+			Frame moved(std::move(msg.frame(0)));
+			REQUIRE(moved.resource() == &resource);
+			REQUIRE(moved.size() == big.size());
+		}
+		REQUIRE(resource.allocations == resource.deallocations);
+		REQUIRE(resource.bytes == 0);
+	}
+
+	SECTION("Default resource")
+	{
+		CountingResource resource;
+		MemoryResource* previous = setDefaultResource(&resource);
+		REQUIRE(previous == bufferPoolResource());
+		{
+			std::vector<char> big(1000, 'x');
+			Frame frame(big.data(), big.size());
+			REQUIRE(frame.resource() == &resource);
+			Message msg = Message::readMessage("\x01\x00\x00\x00\x02\x00\x00\x00\x55\xaa", 10);
+			REQUIRE(msg.resource() == &resource);
+		}
+		REQUIRE(setDefaultResource(nullptr) == &resource);
+		REQUIRE(defaultResource() == bufferPoolResource());
+		REQUIRE(resource.allocations > 0);
+		REQUIRE(resource.bytes == 0);
+	}
+}
+
+
+TEST_CASE("Buffer pool", "[memory]")
+{
+	MemoryResource* pool = bufferPoolResource();
+	REQUIRE(defaultResource() == pool);
+
+	SECTION("Blocks are reused by same thread")
+	{
+		void* p = pool->allocate(1000, 1);
+		pool->deallocate(p, 1000, 1);
+		void* q = pool->allocate(1024, 1);
+		REQUIRE(p == q);
+		pool->deallocate(q, 1024, 1);
+	}
+
+	SECTION("Blocks freed by other thread are returned to owner")
+	{
+		std::vector<void*> blocks;
+		for(int i = 0; i < 4; i++)
+			blocks.push_back(pool->allocate(3000, 1));
+
+		std::thread worker([&]() {
+				for(auto block : blocks)
+					pool->deallocate(block, 3000, 1);
+			});
+		worker.join();
+
+		for(int i = 0; i < 4; i++)
+		{
+			void* block = pool->allocate(3000, 1);
+			REQUIRE(std::find(blocks.begin(), blocks.end(), block) != blocks.end());
+		}
+		for(auto block : blocks)
+			pool->deallocate(block, 3000, 1);
+	}
+
+	SECTION("Cache of exited thread is taken over")
+	{
+		void* freed = nullptr;
+		std::thread first([&]() {
+				freed = pool->allocate(5000, 1);
+				pool->deallocate(freed, 5000, 1);
+			});
+		first.join();
+
+		void* reused = nullptr;
+		std::thread second([&]() {
+				reused = pool->allocate(5000, 1);
+				pool->deallocate(reused, 5000, 1);
+			});
+		second.join();
+
+		REQUIRE(freed == reused);
+	}
+
+	SECTION("Big and overaligned blocks")
+	{
+		void* big = pool->allocate(4 * 1024 * 1024, 1);
+		memset(big, 0, 4 * 1024 * 1024);
+		pool->deallocate(big, 4 * 1024 * 1024, 1);
+
+		void* aligned = pool->allocate(100, 64);
+		REQUIRE(reinterpret_cast<uintptr_t>(aligned) % 64 == 0);
+		pool->deallocate(aligned, 100, 64);
+	}
+
+	SECTION("Frames received on one thread and freed on another")
+	{
+		std::vector<char> payload(500, 'x');
+		std::vector<char> wire;
+		for(int i = 0; i < 1000; i++)
+		{
+			Message msg;
+			msg.addFrame(Frame(payload.data(), payload.size()));
+			msg.addFrame(Frame::fromValue((uint32_t)i));
+			size_t offset = wire.size();
+			wire.resize(offset + msg.messageSize());
+			msg.writeMessage(wire.data() + offset);
+		}
+
+		std::vector<Message> messages;
+		size_t offset = 0;
+		while(offset < wire.size())
+		{
+			messages.push_back(Message::readMessage(wire.data() + offset, wire.size() - offset));
+			offset += messages.back().messageSize();
+		}
+
+		std::thread consumer([&]() {
+				messages.clear();
+			});
+		consumer.join();
+
+		Message msg = Message::readMessage(wire.data(), wire.size());
+		REQUIRE(msg.frame(0).resource() == pool);
+		REQUIRE(msg.frame(0) == Frame(payload.data(), payload.size()));
+	}
+}
@@ -3,8 +3,12 @@
 #include "catch.hpp"
 
 #include "cppio/message.h"
+#include "common/crc32c.h"
 
 #include <cstring>
+#include <array>
+#include <algorithm>
+#include <cstdint>
 
 using namespace cppio;
 
@@ -36,3 +40,270 @@ TEST_CASE("Message deserialization", "[io]")
 	REQUIRE(memcmp(secondFrame.data(), "\x55\xaa", 2) == 0);
 }
 
+
+TEST_CASE("Frame storage", "[io]")
+{
+	std::vector<char> small(Frame::InlineCapacity, 'a');
+	std::vector<char> big(Frame::InlineCapacity + 1, 'b');
+
+	Frame smallFrame(small.data(), small.size());
+	Frame bigFrame(big.data(), big.size());
+
+	REQUIRE(smallFrame.data() >= (const void*)&smallFrame);
+	REQUIRE(smallFrame.data() < (const void*)(&smallFrame + 1));
+	REQUIRE((bigFrame.data() < (const void*)&bigFrame || bigFrame.data() >= (const void*)(&bigFrame + 1)));
+
+	Frame movedSmall(std::move(smallFrame));
+	Frame movedBig(std::move(bigFrame));
+	REQUIRE(smallFrame.size() == 0);
+	REQUIRE(bigFrame.size() == 0);
+	REQUIRE(movedSmall.size() == small.size());
+	REQUIRE(memcmp(movedSmall.data(), small.data(), small.size()) == 0);
+	REQUIRE(movedBig.size() == big.size());
+	REQUIRE(memcmp(movedBig.data(), big.data(), big.size()) == 0);
+
+	Frame copy = movedSmall;
+	REQUIRE(copy == movedSmall);
+	copy = movedBig;
+	REQUIRE(copy == movedBig);
+	copy = Frame::fromValue((uint32_t)42);
+	REQUIRE(copy.size() == 4);
+	REQUIRE(*reinterpret_cast<const uint32_t*>(copy.data()) == 42);
+	REQUIRE(!(copy == movedBig));
+}
+
+TEST_CASE("Compact message", "[io]")
+{
+	CompactMessage msg;
+	msg << (uint8_t)1 << (uint16_t)2 << (uint32_t)3 << std::string("foo");
+	msg.addFrame("", 0);
+
+	REQUIRE(msg.size() == 5);
+	REQUIRE(msg.get<uint8_t>(0) == 1);
+	REQUIRE(msg.get<uint16_t>(1) == 2);
+	REQUIRE(msg.get<uint32_t>(2) == 3);
+	REQUIRE(msg.get<std::string>(3) == "foo");
+	REQUIRE(msg.frame(4).size() == 0);
+
+	Message converted = msg.toMessage();
+	REQUIRE(converted.messageSize() == msg.messageSize());
+
+	std::vector<char> buf(converted.messageSize());
+	converted.writeMessage(buf.data());
+	REQUIRE(memcmp(buf.data(), msg.data(), buf.size()) == 0);
+
+	CompactMessage fromMessage(converted);
+	REQUIRE(fromMessage.messageSize() == msg.messageSize());
+	REQUIRE(memcmp(fromMessage.data(), msg.data(), msg.messageSize()) == 0);
+
+	CompactMessage parsed = CompactMessage::readMessage(buf.data(), buf.size());
+	REQUIRE(parsed.size() == 5);
+	REQUIRE(parsed.frame(3) == FrameView("foo", 3));
+
+	REQUIRE_THROWS(CompactMessage::readMessage(buf.data(), buf.size() - 1));
+}
+
+TEST_CASE("Message view", "[io]")
+{
+	const char* buffer = "\x02\x00\x00\x00\x04\x00\x00\x00\x01\x02\x03\x04\x02\x00\x00\x00\x55\xaa";
+	MessageView view(buffer, 18);
+
+	REQUIRE(view.size() == 2);
+	REQUIRE(view.messageSize() == 18);
+	REQUIRE(view.frame(0).data() == buffer + 8);
+	REQUIRE(view.frame(0).size() == 4);
+	REQUIRE(view.frame(1).data() == buffer + 16);
+	REQUIRE(view.get<uint16_t>(1) == 0xaa55);
+
+	Message msg = view.toMessage();
+	REQUIRE(msg.size() == 2);
+	REQUIRE(memcmp(msg.frame(1).data(), "\x55\xaa", 2) == 0);
+
+	REQUIRE_THROWS(view.reset(buffer, 17));
+	REQUIRE(view.size() == 0);
+	REQUIRE_THROWS(view.reset(buffer, 6));
+	REQUIRE_THROWS(view.reset("\xff\xff\xff\xff", 4));
+	REQUIRE_THROWS(Message::readMessage(buffer, 17));
+
+	const char* bufferV2 = "\x07\x00\x00\x00\x02\x04\x01\x02\x03\x04\x00";
+	view.reset(bufferV2, 11, WireFormat::V2);
+	REQUIRE(view.size() == 2);
+	REQUIRE(view.messageSize() == 11);
+	REQUIRE(view.frame(0).data() == bufferV2 + 6);
+	REQUIRE(view.frame(0).size() == 4);
+	REQUIRE(view.frame(1).size() == 0);
+
+	REQUIRE_THROWS(view.reset(bufferV2, 10, WireFormat::V2));
+	REQUIRE_THROWS(view.reset("\x02\x00\x00\x00\x01\x80", 6, WireFormat::V2));
+	REQUIRE_THROWS(view.reset("\x06\x00\x00\x00\x01\xff\xff\xff\xff\x7f", 10, WireFormat::V2));
+}
+
+TEST_CASE("Message construction without copies", "[io]")
+{
+	std::vector<char> big(1000, 'x');
+	const void* bigData = big.data();
+
+	Message msg;
+	msg.reserve(3);
+	msg.addFrame(Frame(std::move(big)));
+	REQUIRE(msg.frame(0).data() == bigData);
+
+	msg.emplaceFrame("\x01\x02", 2);
+	msg.emplaceFrame(Frame::fromValue((uint32_t)3));
+	REQUIRE(msg.size() == 3);
+	REQUIRE(msg.get<uint32_t>(2) == 3);
+
+	MessageBuilder builder(3, msg.messageSize());
+	for(int i = 0; i < 2; i++)
+	{
+		builder.clear();
+		memset(builder.appendFrame(1000), 'x', 1000);
+		builder.addFrame("\x01\x02", 2) << (uint32_t)3;
+	}
+	REQUIRE(builder.size() == 3);
+
+	std::vector<char> buf(msg.messageSize());
+	msg.writeMessage(buf.data());
+	REQUIRE(builder.message().messageSize() == buf.size());
+	REQUIRE(memcmp(builder.message().data(), buf.data(), buf.size()) == 0);
+}
+
+TEST_CASE("Shared message", "[io]")
+{
+	Message msg;
+	msg << (uint32_t)42 << std::string("foo");
+
+	SharedMessage shared(msg);
+	SharedMessage copy = shared;
+	REQUIRE(copy.data() == shared.data());
+	REQUIRE(copy.size() == 2);
+	REQUIRE(copy.frame(1) == FrameView("foo", 3));
+
+	std::vector<char> buf(msg.messageSize());
+	msg.writeMessage(buf.data());
+	REQUIRE(shared.messageSize() == buf.size());
+	REQUIRE(memcmp(shared.data(), buf.data(), buf.size()) == 0);
+
+	CompactMessage compact(msg);
+	SharedMessage fromCompact(compact);
+	REQUIRE(fromCompact.messageSize() == buf.size());
+	REQUIRE(fromCompact.frame(0) == shared.frame(0));
+	REQUIRE(shared.toMessage().get<std::string>(1) == "foo");
+
+	// Encoding in other format is built once and shared by copies
+	REQUIRE(shared.buffer(WireFormat::V1) == shared.buffer());
+	auto v2 = shared.buffer(WireFormat::V2);
+	REQUIRE(v2);
+	REQUIRE(copy.buffer(WireFormat::V2) == v2);
+	MessageView view;
+	view.reset(v2, v2->size(), WireFormat::V2);
+	REQUIRE(view.size() == 2);
+	REQUIRE(view.frame(1) == FrameView("foo", 3));
+
+	// Checksums are kept with encodings, whether encoding was built with checksum or before it was asked for
+	uint32_t v1Checksum = 0;
+	uint32_t v2Checksum = 0;
+	REQUIRE(copy.buffer(WireFormat::V1, &v1Checksum) == shared.buffer());
+	REQUIRE(v1Checksum == crc32c(0, buf.data(), buf.size()));
+	REQUIRE(copy.buffer(WireFormat::V2, &v2Checksum) == v2);
+	REQUIRE(v2Checksum == crc32c(0, v2->data(), v2->size()));
+
+	SharedMessage other(msg);
+	uint32_t otherChecksum = 0;
+	auto otherV2 = other.buffer(WireFormat::V2, &otherChecksum);
+	REQUIRE(*otherV2 == *v2);
+	REQUIRE(otherChecksum == v2Checksum);
+}
+
+namespace
+{
+enum class Side : uint8_t
+{
+	Buy = 1,
+	Sell = 2
+};
+
+struct Quote
+{
+	double price;
+	int32_t volume;
+};
+}
+
+TEST_CASE("Message packing", "[io]")
+{
+	Quote quote { 12.5, -3 };
+
+	Message msg;
+	msg.pack((int8_t)-1, (int64_t)-1234567890123LL, (uint64_t)42, 0.5f, Side::Sell, quote, std::string("foo"));
+	msg << (uint16_t)7;
+	REQUIRE(msg.size() == 8);
+	REQUIRE(msg.frame(1).size() == 8);
+	REQUIRE(msg.frame(5).size() == sizeof(Quote));
+
+	auto values = msg.unpack<int8_t, int64_t, uint64_t, float, Side, Quote, std::string>();
+	REQUIRE(std::get<0>(values) == -1);
+	REQUIRE(std::get<1>(values) == -1234567890123LL);
+	REQUIRE(std::get<2>(values) == 42);
+	REQUIRE(std::get<3>(values) == 0.5f);
+	REQUIRE((std::get<4>(values) == Side::Sell));
+	REQUIRE(std::get<5>(values).price == 12.5);
+	REQUIRE(std::get<5>(values).volume == -3);
+	REQUIRE(std::get<6>(values) == "foo");
+	REQUIRE(std::get<0>(msg.unpack<uint16_t>(7)) == 7);
+	REQUIRE(msg.get<std::string>(6) == "foo");
+
+	REQUIRE_THROWS(msg.unpack<uint32_t>(0));
+	REQUIRE_THROWS((msg.unpack<uint16_t, uint16_t>(7)));
+
+	CompactMessage compact;
+	compact.pack((int8_t)-1, (int64_t)-1234567890123LL, (uint64_t)42, 0.5f, Side::Sell, quote, std::string("foo"), (uint16_t)7);
+	std::vector<char> buf(msg.messageSize());
+	msg.writeMessage(buf.data());
+	REQUIRE(compact.messageSize() == buf.size());
+	REQUIRE(memcmp(compact.data(), buf.data(), buf.size()) == 0);
+
+	MessageView view(buf.data(), buf.size());
+	REQUIRE(std::get<1>(view.unpack<std::string, uint16_t>(6)) == 7);
+
+#if __cplusplus >= 201703L
+	Message viewMsg;
+	viewMsg.pack(std::string_view("bar"));
+	REQUIRE(std::get<0>(viewMsg.unpack<std::string_view>()) == "bar");
+#endif
+}
+
+TEST_CASE("Array frames", "[io]")
+{
+	std::vector<double> prices(1000);
+	for(size_t i = 0; i < prices.size(); i++)
+		prices[i] = i * 0.25;
+	std::vector<int32_t> volumes = { 1, -2, 3 };
+
+	Message msg;
+	msg.addFrame(Frame::fromArray(prices));
+	msg.addFrame(Frame::fromArray(volumes.data(), volumes.size()));
+	msg.pack(ArrayView<const double>(prices));
+	REQUIRE(msg.frame(0).size() == prices.size() * sizeof(double));
+	REQUIRE(msg.frame(1).size() == 12);
+
+	auto view = msg.getArray<double>(0);
+	REQUIRE(view.size() == prices.size());
+	REQUIRE(view.data() == msg.frame(0).data());
+	REQUIRE(std::equal(view.begin(), view.end(), prices.begin()));
+	REQUIRE(msg.getArray<int32_t>(1)[1] == -2);
+
+	auto unpacked = std::get<0>(msg.unpack<ArrayView<const double>>(2));
+	REQUIRE(unpacked.size() == prices.size());
+	REQUIRE(unpacked[999] == prices[999]);
+
+	REQUIRE_THROWS(msg.getArray<double>(1));
+
+	// Payload of wire buffer at odd offset can't be viewed as doubles
+	std::vector<char> buf(msg.messageSize() + 1);
+	msg.writeMessage(buf.data() + 1);
+	MessageView wireView(buf.data() + 1, buf.size() - 1);
+	REQUIRE(reinterpret_cast<uintptr_t>(wireView.frame(0).data()) % alignof(double) != 0);
+	REQUIRE_THROWS(wireView.getArray<double>(0));
+	REQUIRE(wireView.getArray<char>(0).size() == prices.size() * sizeof(double));
+}
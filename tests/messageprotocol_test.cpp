@@ -9,10 +9,13 @@
 #ifdef __MINGW32__
 #ifndef _GLIBCXX_HAS_GTHREADS
 #include "mingw.thread.h"
+#include "mingw.mutex.h"
 #endif
 #endif
+#include <mutex>
 #include <cstring>
 #include <numeric>
+#include <algorithm>
 
 using namespace cppio;
 
@@ -182,5 +185,395 @@ TEST_CASE("MessageProtocol", "[io]")
 
 		REQUIRE(std::equal(buf.begin(), buf.end(), recv_buf.begin()));
 	}
-}
 
+	SECTION("Compact message")
+	{
+		CompactMessage msg;
+		msg << (uint32_t)42 << std::string("foo");
+		std::vector<char> big(100000, 'x');
+		msg.addFrame(big.data(), big.size());
+		Message recv_msg;
+
+		auto acceptor = std::unique_ptr<IoAcceptor>(manager.createServer("inproc://foo"));
+		std::thread clientThread([&](){
+				auto client = std::unique_ptr<IoLine>(manager.createClient("inproc://foo"));
+				MessageProtocol proto(client.get());
+				proto.sendMessage(msg);
+				});
+
+		std::thread serverThread([&](){
+				auto server = std::unique_ptr<IoLine>(acceptor->waitConnection(100));
+				MessageProtocol proto(server.get());
+				proto.readMessage(recv_msg);
+				});
+
+		clientThread.join();
+		serverThread.join();
+
+		REQUIRE(recv_msg.size() == 3);
+		REQUIRE(recv_msg.get<uint32_t>(0) == 42);
+		REQUIRE(recv_msg.get<std::string>(1) == "foo");
+		REQUIRE(recv_msg.frame(2) == Frame(big.data(), big.size()));
+	}
+
+	SECTION("Message view")
+	{
+		Message msg;
+		msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+		msg.addFrame(Frame());
+		std::vector<char> big(100000, 'x');
+		msg.addFrame(Frame(big.data(), big.size()));
+		MessageView first;
+		MessageView second;
+
+		auto acceptor = std::unique_ptr<IoAcceptor>(manager.createServer("inproc://foo"));
+		std::thread clientThread([&](){
+				auto client = std::unique_ptr<IoLine>(manager.createClient("inproc://foo"));
+				MessageProtocol proto(client.get());
+				proto.sendMessage(msg);
+				proto.sendMessage(msg);
+				});
+
+		std::thread serverThread([&](){
+				auto server = std::unique_ptr<IoLine>(acceptor->waitConnection(100));
+				MessageProtocol proto(server.get());
+				proto.readMessageView(first);
+				proto.readMessageView(second);
+				});
+
+		clientThread.join();
+		serverThread.join();
+
+		// First view holds its buffer, so second message is read to another one
+		REQUIRE(first.data() != second.data());
+		REQUIRE(first.size() == 3);
+		REQUIRE(second.size() == 3);
+		REQUIRE(memcmp(first.frame(0).data(), "\x01\x02\x03\x04", 4) == 0);
+		REQUIRE(first.frame(1).size() == 0);
+		REQUIRE(first.frame(2) == FrameView(big.data(), big.size()));
+		REQUIRE(second.frame(2) == first.frame(2));
+	}
+
+	SECTION("Reading into recycled messages")
+	{
+		Message msg;
+		msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+		std::vector<char> big(1000, 'x');
+		msg.addFrame(Frame(big.data(), big.size()));
+		Message shortMsg;
+		shortMsg.addFrame(Frame("\x05\x06", 2));
+
+		MessagePool pool;
+		const void* bigFrameData[2] = { nullptr, nullptr };
+		bool contentsMatch = true;
+		size_t shortSize = 0;
+
+		auto acceptor = std::unique_ptr<IoAcceptor>(manager.createServer("inproc://foo"));
+		std::thread clientThread([&](){
+				auto client = std::unique_ptr<IoLine>(manager.createClient("inproc://foo"));
+				MessageProtocol proto(client.get());
+				proto.sendMessage(msg);
+				proto.sendMessage(msg);
+				proto.sendMessage(shortMsg);
+				});
+
+		std::thread serverThread([&](){
+				auto server = std::unique_ptr<IoLine>(acceptor->waitConnection(100));
+				MessageProtocol proto(server.get());
+				for(int i = 0; i < 2; i++)
+				{
+					Message m = pool.acquire();
+					proto.readMessageInto(m);
+					contentsMatch = contentsMatch && (m.size() == 2) && (m.frame(0) == msg.frame(0)) && (m.frame(1) == msg.frame(1));
+					bigFrameData[i] = m.frame(1).data();
+					pool.release(std::move(m));
+				}
+				Message m = pool.acquire();
+				proto.readMessageInto(m);
+				shortSize = m.size();
+				contentsMatch = contentsMatch && (m.frame(0) == shortMsg.frame(0));
+				});
+
+		clientThread.join();
+		serverThread.join();
+
+		REQUIRE(contentsMatch);
+		REQUIRE(bigFrameData[0] == bigFrameData[1]);
+		REQUIRE(shortSize == 1);
+		REQUIRE(pool.size() == 0);
+	}
+
+	SECTION("Shared message fan-out")
+	{
+		Message msg;
+		msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+		std::vector<char> big(100000, 'x');
+		msg.addFrame(Frame(big.data(), big.size()));
+		SharedMessage shared(msg);
+
+		const int clients = 4;
+		auto acceptor = std::unique_ptr<IoAcceptor>(manager.createServer("inproc://foo"));
+		std::vector<std::thread> senders;
+		for(int i = 0; i < clients; i++)
+		{
+			senders.push_back(std::thread([&](){
+					auto client = std::unique_ptr<IoLine>(manager.createClient("inproc://foo"));
+					MessageProtocol proto(client.get());
+					proto.sendMessage(shared);
+					proto.sendMessage(shared);
+					}));
+		}
+
+		int received = 0;
+		bool contentsMatch = true;
+		std::vector<std::thread> receivers;
+		std::mutex mutex;
+		for(int i = 0; i < clients; i++)
+		{
+			auto server = std::shared_ptr<IoLine>(acceptor->waitConnection(1000));
+			receivers.push_back(std::thread([&, server](){
+					MessageProtocol proto(server.get());
+					for(int j = 0; j < 2; j++)
+					{
+						Message recv_msg;
+						proto.readMessage(recv_msg);
+						std::lock_guard<std::mutex> lock(mutex);
+						contentsMatch = contentsMatch && (recv_msg.size() == 2) && (recv_msg.frame(1) == msg.frame(1));
+						received++;
+					}
+					}));
+		}
+
+		for(auto& thread : senders)
+			thread.join();
+		for(auto& thread : receivers)
+			thread.join();
+
+		REQUIRE(received == 2 * clients);
+		REQUIRE(contentsMatch);
+	}
+
+	SECTION("Aligned frames")
+	{
+		Message msg;
+		msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+		std::vector<double> prices(1000, 1.5);
+		msg.addFrame(Frame::fromArray(prices));
+		bool aligned = true;
+		bool contentsMatch = true;
+
+		auto acceptor = std::unique_ptr<IoAcceptor>(manager.createServer("inproc://foo"));
+		std::thread clientThread([&](){
+				auto client = std::unique_ptr<IoLine>(manager.createClient("inproc://foo"));
+				MessageProtocol proto(client.get());
+				proto.sendMessage(msg);
+				proto.sendMessage(msg);
+				});
+
+		std::thread serverThread([&](){
+				auto server = std::unique_ptr<IoLine>(acceptor->waitConnection(100));
+				MessageProtocol proto(server.get());
+				proto.setFrameAlignment(64);
+				Message m;
+				for(int i = 0; i < 2; i++)
+				{
+					proto.readMessageInto(m);
+					for(size_t j = 0; j < m.size(); j++)
+						aligned = aligned && (reinterpret_cast<uintptr_t>(m.frame(j).data()) % 64 == 0);
+					auto view = m.getArray<double>(1);
+					contentsMatch = contentsMatch && (m.frame(0) == msg.frame(0)) &&
+						std::equal(view.begin(), view.end(), prices.begin());
+				}
+				});
+
+		clientThread.join();
+		serverThread.join();
+
+		REQUIRE(aligned);
+		REQUIRE(contentsMatch);
+
+		MessageProtocol proto(nullptr);
+		REQUIRE_THROWS(proto.setFrameAlignment(48));
+	}
+
+	SECTION("Wire format v2")
+	{
+		Message msg;
+		msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+		msg.addFrame(Frame());
+		std::vector<char> big(100000);
+		std::iota(big.begin(), big.end(), 0);
+		msg.addFrame(Frame(big.data(), big.size()));
+		CompactMessage compact(msg);
+		SharedMessage shared(msg);
+
+		WireFormat clientFormat = WireFormat::V1;
+		WireFormat serverFormat = WireFormat::V1;
+		bool contentsMatch = true;
+		size_t viewSize = 0;
+
+		auto acceptor = std::unique_ptr<IoAcceptor>(manager.createServer("inproc://foo"));
+		std::thread clientThread([&](){
+				auto client = std::unique_ptr<IoLine>(manager.createClient("inproc://foo"));
+				MessageProtocol proto(client.get());
+				proto.negotiateWireFormat();
+				clientFormat = proto.wireFormat();
+				proto.sendMessage(msg);
+				proto.sendMessage(compact);
+				proto.sendMessage(shared);
+				proto.sendMessage(msg);
+				});
+
+		std::thread serverThread([&](){
+				auto server = std::unique_ptr<IoLine>(acceptor->waitConnection(100));
+				MessageProtocol proto(server.get());
+				proto.negotiateWireFormat(WireFormat::V2);
+				serverFormat = proto.wireFormat();
+				Message m;
+				for(int i = 0; i < 3; i++)
+				{
+					proto.readMessageInto(m);
+					contentsMatch = contentsMatch && (m.size() == 3) && (m.frame(0) == msg.frame(0)) &&
+						(m.frame(1).size() == 0) && (m.frame(2) == msg.frame(2));
+				}
+				MessageView view;
+				proto.readMessageView(view);
+				viewSize = view.messageSize();
+				contentsMatch = contentsMatch && (view.size() == 3) && (view.frame(2) == FrameView(big.data(), big.size()));
+				});
+
+		clientThread.join();
+		serverThread.join();
+
+		REQUIRE(clientFormat == WireFormat::V2);
+		REQUIRE(serverFormat == WireFormat::V2);
+		REQUIRE(contentsMatch);
+		// Length prefix, one-byte frame count, 1 + 1 + 3 bytes of frame lengths
+		REQUIRE(viewSize == 4 + 1 + 5 + 4 + big.size());
+	}
+
+	SECTION("Wire format negotiation falls back to older format")
+	{
+		WireFormat clientFormat = WireFormat::V2;
+		WireFormat serverFormat = WireFormat::V2;
+		Message recv_msg;
+
+		auto acceptor = std::unique_ptr<IoAcceptor>(manager.createServer("inproc://foo"));
+		std::thread clientThread([&](){
+				auto client = std::unique_ptr<IoLine>(manager.createClient("inproc://foo"));
+				MessageProtocol proto(client.get());
+				proto.negotiateWireFormat(WireFormat::V1);
+				clientFormat = proto.wireFormat();
+				Message msg;
+				msg.addFrame(Frame("\x05\x06", 2));
+				proto.sendMessage(msg);
+				});
+
+		std::thread serverThread([&](){
+				auto server = std::unique_ptr<IoLine>(acceptor->waitConnection(100));
+				MessageProtocol proto(server.get());
+				proto.negotiateWireFormat(WireFormat::V2);
+				serverFormat = proto.wireFormat();
+				proto.readMessage(recv_msg);
+				});
+
+		clientThread.join();
+		serverThread.join();
+
+		REQUIRE(clientFormat == WireFormat::V1);
+		REQUIRE(serverFormat == WireFormat::V1);
+		REQUIRE(recv_msg.size() == 1);
+		REQUIRE(recv_msg.frame(0) == Frame("\x05\x06", 2));
+	}
+
+	SECTION("Checksums")
+	{
+		Message msg;
+		msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+		msg.addFrame(Frame());
+		std::vector<char> big(100000);
+		std::iota(big.begin(), big.end(), 0);
+		msg.addFrame(Frame(big.data(), big.size()));
+		CompactMessage compact(msg);
+		SharedMessage shared(msg);
+
+		for(WireFormat format : { WireFormat::V1, WireFormat::V2 })
+		{
+			int received = 0;
+			bool contentsMatch = true;
+
+			auto acceptor = std::unique_ptr<IoAcceptor>(manager.createServer("inproc://foo"));
+			std::thread clientThread([&](){
+					auto client = std::unique_ptr<IoLine>(manager.createClient("inproc://foo"));
+					MessageProtocol proto(client.get());
+					proto.setWireFormat(format);
+					proto.setChecksums(true);
+					proto.sendMessage(msg);
+					proto.sendMessage(compact);
+					proto.sendMessage(shared);
+					proto.sendMessage(msg);
+					});
+
+			std::thread serverThread([&](){
+					auto server = std::unique_ptr<IoLine>(acceptor->waitConnection(100));
+					MessageProtocol proto(server.get());
+					proto.setWireFormat(format);
+					proto.setChecksums(true);
+					Message m;
+					for(int i = 0; i < 3; i++)
+					{
+						if(proto.readMessageInto(m) == 1)
+							received++;
+						contentsMatch = contentsMatch && (m.size() == 3) && (m.frame(0) == msg.frame(0)) &&
+							(m.frame(2) == msg.frame(2));
+					}
+					MessageView view;
+					if(proto.readMessageView(view) == 1)
+						received++;
+					contentsMatch = contentsMatch && (view.size() == 3) && (view.frame(2) == FrameView(big.data(), big.size()));
+					});
+
+			clientThread.join();
+			serverThread.join();
+
+			REQUIRE(received == 4);
+			REQUIRE(contentsMatch);
+		}
+	}
+
+	SECTION("Checksum mismatch")
+	{
+		Message msg;
+		msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+		std::vector<char> corrupted(msg.messageSize() + 4, 0);
+		msg.writeMessage(corrupted.data());
+		ssize_t firstResult = 0;
+		ssize_t secondResult = 0;
+		Message second;
+
+		auto acceptor = std::unique_ptr<IoAcceptor>(manager.createServer("inproc://foo"));
+		std::thread clientThread([&](){
+				auto client = std::unique_ptr<IoLine>(manager.createClient("inproc://foo"));
+				client->write(corrupted.data(), corrupted.size());
+				MessageProtocol proto(client.get());
+				proto.setChecksums(true);
+				proto.sendMessage(msg);
+				});
+
+		std::thread serverThread([&](){
+				auto server = std::unique_ptr<IoLine>(acceptor->waitConnection(100));
+				MessageProtocol proto(server.get());
+				proto.setChecksums(true);
+				Message first;
+				firstResult = proto.readMessage(first);
+				secondResult = proto.readMessage(second);
+				});
+
+		clientThread.join();
+		serverThread.join();
+
+		REQUIRE(firstResult == eChecksumMismatch);
+		REQUIRE(secondResult == 1);
+		REQUIRE(second.frame(0) == msg.frame(0));
+	}
+}
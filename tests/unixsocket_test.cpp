@@ -2,11 +2,26 @@
 #include "catch.hpp"
 
 #include "cppio/iolinemanager.h"
+#include "cppio/message.h"
+#include "cppio/bufferedioline.h"
 #include "posix/io_socket.h"
+#include "posix/shm.h"
+#include "posix/pipes.h"
+#include "common/inproc.h"
 
 #include <numeric>
+#include <array>
+#include <cstring>
 #include <thread>
+#include <atomic>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 using namespace cppio;
 
@@ -20,7 +35,7 @@ static void checkIo(const std::shared_ptr<IoLineManager>& manager, const std::st
 	auto client = std::unique_ptr<IoLine>(manager->createClient(endpoint));
 	REQUIRE(client);
 
-	auto socket = std::unique_ptr<IoLine>(server->waitConnection(100));
+	auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
 
 	int rc = client->write(buf.data(), 1024);
 	REQUIRE(rc == 1024);
@@ -49,7 +64,7 @@ static void threadedCheckIo(const std::shared_ptr<IoLineManager>& manager, const
 
 	std::thread serverThread([&]() {
 			auto server = std::unique_ptr<IoAcceptor>(manager->createServer(endpoint));
-			auto socket = std::unique_ptr<IoLine>(server->waitConnection(100));
+			auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
 			socket->read(recv_buf.data(), 1024);
 			});
 
@@ -78,7 +93,7 @@ static void checkConnectionLoss(const std::shared_ptr<IoLineManager>& manager, c
 
 	std::thread serverThread([&]() {
 			auto server = std::unique_ptr<IoAcceptor>(manager->createServer(endpoint));
-			auto socket = std::unique_ptr<IoLine>(server->waitConnection(100));
+			auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
 			ssize_t rc = socket->read(recv_buf.data(), 1024);
 			if(rc == eConnectionLost)
 				hasConnectionLoss = true;
@@ -129,3 +144,1160 @@ TEST_CASE("TCP socket", "[io]")
 	}
 }
 
+TEST_CASE("Line options in address", "[io]")
+{
+	LineOptions options;
+	auto base = splitLineOptions("127.0.0.1:6000?nodelay=1&sndbuf=65536&quickack", options);
+
+	REQUIRE(base == "127.0.0.1:6000");
+	REQUIRE(options.size() == 3);
+	REQUIRE(options[0] == std::make_pair(LineOption::NoDelay, 1));
+	REQUIRE(options[1] == std::make_pair(LineOption::SendBufferSize, 65536));
+	REQUIRE(options[2] == std::make_pair(LineOption::QuickAck, 1));
+
+	REQUIRE_THROWS(splitLineOptions("127.0.0.1:6000?foo=1", options));
+}
+
+TEST_CASE("TCP socket options", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+
+	SECTION("Check I/O with options")
+	{
+		threadedCheckIo(manager, "tcp://127.0.0.1:6000?nodelay=1&sndbuf=262144&rcvbuf=262144&quickack=1");
+	}
+
+	SECTION("Set options on line")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("tcp://127.0.0.1:6000"));
+		auto client = std::unique_ptr<IoLine>(manager->createClient("tcp://127.0.0.1:6000"));
+		REQUIRE(client);
+
+		int enable = 1;
+		client->setOption(LineOption::NoDelay, &enable);
+		client->setOption(LineOption::Cork, &enable);
+		int disable = 0;
+		client->setOption(LineOption::Cork, &disable);
+		int timeout = 5000;
+		client->setOption(LineOption::UserTimeout, &timeout);
+		int sndbuf = 65536;
+		client->setOption(LineOption::SendBufferSize, &sndbuf);
+
+		int fd = *(int*)client->getNativeHandle();
+		int value = 0;
+		socklen_t len = sizeof(value);
+		REQUIRE(getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, &len) == 0);
+		REQUIRE(value != 0);
+		REQUIRE(getsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &value, &len) == 0);
+		REQUIRE(value == timeout);
+		// Kernel doubles requested size to account for bookkeeping overhead
+		REQUIRE(getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &value, &len) == 0);
+		REQUIRE(value == 2 * sndbuf);
+	}
+
+	SECTION("Unknown option")
+	{
+		auto client = std::unique_ptr<IoLine>(manager->createClient("tcp://127.0.0.1:6000?foo=1"));
+		REQUIRE(!client);
+	}
+}
+
+TEST_CASE("TCP zero-copy send", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+
+	const int messages = 8;
+	std::vector<char> payload(256 * 1024);
+	std::iota(payload.begin(), payload.end(), 0);
+
+	std::vector<Message> received(messages);
+	std::atomic<bool> startReading(false);
+
+	auto server = std::unique_ptr<IoAcceptor>(manager->createServer("tcp://127.0.0.1:6000"));
+	std::thread serverThread([&]() {
+			auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
+			while(!startReading)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			MessageProtocol proto(socket.get());
+			for(int i = 0; i < messages; i++)
+				proto.readMessage(received[i]);
+			});
+
+	// Send buffer holds whole first message, which can't be transmitted while server doesn't read
+	auto client = std::unique_ptr<IoLine>(manager->createClient("tcp://127.0.0.1:6000?zerocopy=65536&sndbuf=1048576"));
+	REQUIRE(client);
+	auto socket = static_cast<TcpSocket*>(client.get());
+	{
+		// Shared message hands its buffer to writeShared(), which keeps it until kernel reports completion
+		MessageProtocol proto(client.get());
+		for(int i = 0; i < messages; i++)
+		{
+			payload[0] = i;
+			Message msg;
+			msg.addFrame(Frame(payload.data(), payload.size()));
+			REQUIRE(proto.sendMessage(SharedMessage(msg)) == 1);
+			if(i == 0)
+			{
+				REQUIRE(socket->pendingZeroCopyBuffers() > 0);
+				startReading = true;
+			}
+		}
+	}
+
+	serverThread.join();
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while(socket->pendingZeroCopyBuffers() > 0 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	REQUIRE(socket->pendingZeroCopyBuffers() == 0);
+
+	for(int i = 0; i < messages; i++)
+	{
+		payload[0] = i;
+		REQUIRE(received[i].size() == 1);
+		REQUIRE(received[i].frame(0) == Frame(payload.data(), payload.size()));
+	}
+}
+
+/*
+ * Shared and compact messages are sent with checksum in one write; big message takes several writes
+ */
+static void checkChecksummedSends(const std::shared_ptr<IoLineManager>& manager, const std::string& endpoint,
+		WireFormat format)
+{
+	std::vector<char> big(1024 * 1024);
+	std::iota(big.begin(), big.end(), 0);
+	Message msg;
+	msg.addFrame(Frame("\x01\x02", 2));
+	msg.addFrame(Frame(big.data(), big.size()));
+	SharedMessage shared(msg);
+	CompactMessage compact(msg);
+
+	std::vector<Message> received(3);
+	std::vector<ssize_t> results(3);
+
+	auto server = std::unique_ptr<IoAcceptor>(manager->createServer(endpoint));
+	std::thread serverThread([&]() {
+			auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
+			MessageProtocol proto(socket.get());
+			proto.setWireFormat(format);
+			proto.setChecksums(true);
+			for(size_t i = 0; i < received.size(); i++)
+				results[i] = proto.readMessage(received[i]);
+			});
+
+	auto client = std::unique_ptr<IoLine>(manager->createClient(endpoint));
+	REQUIRE(client);
+	MessageProtocol proto(client.get());
+	proto.setWireFormat(format);
+	proto.setChecksums(true);
+	REQUIRE(proto.sendMessage(shared) == 1);
+	REQUIRE(proto.sendMessage(compact) == 1);
+	REQUIRE(proto.sendMessage(shared) == 1);
+
+	serverThread.join();
+
+	for(size_t i = 0; i < received.size(); i++)
+	{
+		REQUIRE(results[i] == 1);
+		REQUIRE(received[i].size() == 2);
+		REQUIRE(received[i].frame(0) == msg.frame(0));
+		REQUIRE(received[i].frame(1) == msg.frame(1));
+	}
+}
+
+TEST_CASE("Checksummed shared and compact messages", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<UnixSocketFactory>(new UnixSocketFactory));
+	manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+	manager->registerFactory(std::unique_ptr<PipeLineFactory>(new PipeLineFactory));
+
+	SECTION("Unix socket")
+	{
+		checkChecksummedSends(manager, "local:///tmp/foo", WireFormat::V1);
+		checkChecksummedSends(manager, "local:///tmp/foo", WireFormat::V2);
+	}
+
+	SECTION("TCP socket with zero-copy")
+	{
+		checkChecksummedSends(manager, "tcp://127.0.0.1:6000?zerocopy=65536", WireFormat::V1);
+	}
+
+	SECTION("Pipe with vmsplice")
+	{
+		checkChecksummedSends(manager, "pipe:///tmp/foo-pipe?vmsplice=4096", WireFormat::V2);
+	}
+}
+
+static void checkFileFrames(const std::shared_ptr<IoLineManager>& manager, const std::string& endpoint,
+		WireFormat format = WireFormat::V1, bool checksums = false, bool buffered = false)
+{
+	char path[] = "/tmp/cppio-file-frameXXXXXX";
+	int fd = mkstemp(path);
+	REQUIRE(fd >= 0);
+	unlink(path);
+
+	std::vector<char> contents(1024 * 1024);
+	std::iota(contents.begin(), contents.end(), 0);
+	REQUIRE(write(fd, contents.data(), contents.size()) == (ssize_t)contents.size());
+
+	Message msg;
+	msg.addFrame(Frame("\x01\x02", 2));
+	msg.addFrame(Frame::fromFile(fd, 1000, 500000));
+	msg.addFrame(Frame("\x03", 1));
+	msg.addFrame(Frame::fromFile(fd, 0, 10));
+
+	Message recv_msg;
+
+	auto server = std::unique_ptr<IoAcceptor>(manager->createServer(endpoint));
+	std::thread serverThread([&]() {
+			auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
+			MessageProtocol proto(socket.get());
+			proto.setWireFormat(format);
+			proto.setChecksums(checksums);
+			proto.readMessage(recv_msg);
+			});
+
+	auto client = std::unique_ptr<IoLine>(manager->createClient(endpoint));
+	REQUIRE(client);
+	if(buffered)
+		client.reset(new BufferedIoLine(std::move(client)));
+	MessageProtocol proto(client.get());
+	proto.setWireFormat(format);
+	proto.setChecksums(checksums);
+	REQUIRE(proto.sendMessage(msg) == 1);
+	REQUIRE(client->flush() == 0);
+
+	serverThread.join();
+	close(fd);
+
+	REQUIRE(recv_msg.size() == 4);
+	REQUIRE(recv_msg.frame(0) == Frame("\x01\x02", 2));
+	REQUIRE(recv_msg.frame(1) == Frame(contents.data() + 1000, 500000));
+	REQUIRE(recv_msg.frame(2) == Frame("\x03", 1));
+	REQUIRE(recv_msg.frame(3) == Frame(contents.data(), 10));
+}
+
+TEST_CASE("File region frames", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<UnixSocketFactory>(new UnixSocketFactory));
+	manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+	manager->registerFactory(std::unique_ptr<InprocLineFactory>(new InprocLineFactory));
+	manager->registerFactory(std::unique_ptr<PipeLineFactory>(new PipeLineFactory));
+
+	SECTION("Unix socket")
+	{
+		checkFileFrames(manager, "local:///tmp/foo");
+	}
+
+	SECTION("TCP socket")
+	{
+		checkFileFrames(manager, "tcp://127.0.0.1:6000");
+	}
+
+	SECTION("Inproc")
+	{
+		checkFileFrames(manager, "inproc://foo");
+	}
+
+	SECTION("Unix socket, wire format v2")
+	{
+		checkFileFrames(manager, "local:///tmp/foo", WireFormat::V2);
+	}
+
+	SECTION("Unix socket with checksums")
+	{
+		checkFileFrames(manager, "local:///tmp/foo", WireFormat::V1, true);
+	}
+
+	SECTION("Pipe")
+	{
+		checkFileFrames(manager, "pipe:///tmp/foo-pipe");
+	}
+
+	SECTION("Buffered TCP socket")
+	{
+		checkFileFrames(manager, "tcp://127.0.0.1:6000", WireFormat::V1, false, true);
+	}
+}
+
+static void checkAcceptTimeouts(const std::shared_ptr<IoLineManager>& manager, const std::string& endpoint)
+{
+	auto server = std::unique_ptr<IoAcceptor>(manager->createServer(endpoint));
+	REQUIRE(server);
+
+	auto start = std::chrono::steady_clock::now();
+	auto line = std::unique_ptr<IoLine>(server->waitConnection(50));
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	REQUIRE(!line);
+	REQUIRE(elapsed >= std::chrono::milliseconds(40));
+	REQUIRE(elapsed < std::chrono::milliseconds(1000));
+
+	std::vector<std::unique_ptr<IoLine>> clients;
+	for(int i = 0; i < 5; i++)
+	{
+		clients.emplace_back(manager->createClient(endpoint));
+		REQUIRE(clients.back());
+	}
+
+	start = std::chrono::steady_clock::now();
+	REQUIRE(server->waitConnections(0, 1000).empty());
+	REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500));
+
+	auto accepted = server->waitConnections(3, 1000);
+	REQUIRE(accepted.size() == 3);
+	for(auto l : accepted)
+		delete l;
+
+	accepted = server->waitConnections(10, 1000);
+	REQUIRE(accepted.size() == 2);
+	for(auto l : accepted)
+		delete l;
+
+	REQUIRE(server->waitConnections(10, 0).empty());
+}
+
+TEST_CASE("Acceptor timeouts and batching", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<UnixSocketFactory>(new UnixSocketFactory));
+	manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+
+	SECTION("Unix socket")
+	{
+		checkAcceptTimeouts(manager, "local:///tmp/foo");
+	}
+
+	SECTION("TCP socket")
+	{
+		checkAcceptTimeouts(manager, "tcp://127.0.0.1:6000");
+	}
+
+	SECTION("Accept failure is reported")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("tcp://127.0.0.1:6000"));
+		auto client = std::unique_ptr<IoLine>(manager->createClient("tcp://127.0.0.1:6000"));
+		REQUIRE(client);
+
+		pid_t pid = fork();
+		REQUIRE(pid >= 0);
+		if(pid == 0)
+		{
+			// No descriptor is left for accepted socket, so accept() fails with EMFILE
+			alarm(5);
+			int lowest = dup(0);
+			close(lowest);
+			rlimit limit { (rlim_t)lowest, (rlim_t)lowest };
+			setrlimit(RLIMIT_NOFILE, &limit);
+			try
+			{
+				delete server->waitConnection(1000);
+			}
+			catch(const IoException& e)
+			{
+				_exit(0);
+			}
+			_exit(1);
+		}
+
+		int status = 0;
+		waitpid(pid, &status, 0);
+		REQUIRE(WIFEXITED(status));
+		REQUIRE(WEXITSTATUS(status) == 0);
+	}
+}
+
+TEST_CASE("Concurrent connect with deadline", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<UnixSocketFactory>(new UnixSocketFactory));
+	manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+
+	auto tcpServer = std::unique_ptr<IoAcceptor>(manager->createServer("tcp://127.0.0.1:6000"));
+	auto localServer = std::unique_ptr<IoAcceptor>(manager->createServer("local:///tmp/foo"));
+
+	SECTION("Batch")
+	{
+		std::vector<std::string> addresses;
+		for(int i = 0; i < 20; i++)
+			addresses.push_back("tcp://127.0.0.1:6000?nodelay=1");
+		addresses.push_back("local:///tmp/foo");
+		// Host name which is not cached is looked up in background
+		addresses.push_back("tcp://localhost:6000");
+		addresses.push_back("tcp://127.0.0.1:6001");
+		addresses.push_back("foo://bar");
+		addresses.push_back("tcp://no-such-host.invalid:6000");
+
+		clearResolverCache();
+		auto lines = manager->createClients(addresses, 1000);
+		REQUIRE(lines.size() == addresses.size());
+		for(int i = 0; i < 22; i++)
+		{
+			REQUIRE(lines[i]);
+			delete lines[i];
+		}
+		REQUIRE(!lines[22]);
+		REQUIRE(!lines[23]);
+		REQUIRE(!lines[24]);
+
+		auto accepted = tcpServer->waitConnections(100, 1000);
+		REQUIRE(accepted.size() == 21);
+		for(auto l : accepted)
+			delete l;
+	}
+
+	SECTION("Deadline")
+	{
+		// Non-routable address: attempt either fails right away or times out
+		auto start = std::chrono::steady_clock::now();
+		auto line = std::unique_ptr<IoLine>(manager->createClient("tcp://192.0.2.1:6000", 200));
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		REQUIRE(!line);
+		REQUIRE(elapsed < std::chrono::milliseconds(1000));
+
+		line = std::unique_ptr<IoLine>(manager->createClient("tcp://127.0.0.1:6000", 1000));
+		REQUIRE(line);
+	}
+
+	SECTION("Zero timeout")
+	{
+		// Factory without asynchronous connect still makes one attempt
+		auto line = std::unique_ptr<IoLine>(manager->createClient("local:///tmp/foo", 0));
+		REQUIRE(line);
+
+		auto leased = manager->leaseClient("local:///tmp/foo", 0);
+		REQUIRE(leased);
+		manager->releaseClient(leased, false);
+	}
+}
+
+TEST_CASE("TCP address resolution", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+
+	SECTION("Host name")
+	{
+		threadedCheckIo(manager, "tcp://localhost:6000");
+	}
+
+	SECTION("IPv6 literal")
+	{
+		threadedCheckIo(manager, "tcp://[::1]:6000");
+	}
+
+	SECTION("Wildcard server accepts IPv4 and IPv6 clients")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("tcp://*:6000"));
+		REQUIRE(server);
+
+		auto client4 = std::unique_ptr<IoLine>(manager->createClient("tcp://127.0.0.1:6000"));
+		auto client6 = std::unique_ptr<IoLine>(manager->createClient("tcp://[::1]:6000"));
+		REQUIRE(client4);
+		REQUIRE(client6);
+
+		auto accepted = server->waitConnections(2, 1000);
+		REQUIRE(accepted.size() == 2);
+		for(auto l : accepted)
+			delete l;
+	}
+
+	SECTION("Unresolvable host")
+	{
+		REQUIRE(!manager->createClient("tcp://no-such-host.invalid:6000"));
+		REQUIRE(!manager->createClient("tcp://[::1:6000"));
+	}
+}
+
+TEST_CASE("Resolver", "[io]")
+{
+	clearResolverCache();
+
+	auto addresses = resolveAddress("[::1]:80", false);
+	REQUIRE(addresses.size() == 1);
+	REQUIRE(addresses[0].family() == AF_INET6);
+
+	addresses = resolveAddress("127.0.0.1:80", false);
+	REQUIRE(addresses.size() == 1);
+	REQUIRE(addresses[0].family() == AF_INET);
+	REQUIRE(ntohs(((sockaddr_in*)&addresses[0].address)->sin_port) == 80);
+
+	REQUIRE_THROWS(resolveAddress("127.0.0.1", false));
+
+	std::vector<ResolvedAddress> resolved;
+	REQUIRE(resolveAddressWithoutLookup("127.0.0.1:81", resolved));
+	REQUIRE(resolved.size() == 1);
+	REQUIRE(!resolveAddressWithoutLookup("localhost:80", resolved));
+	resolveAddress("localhost:80", false);
+	REQUIRE(resolveAddressWithoutLookup("localhost:80", resolved));
+	REQUIRE(!resolved.empty());
+	REQUIRE(resolverCacheSize() == 4);
+}
+
+TEST_CASE("Client pool", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+
+	PoolLimits limits;
+	limits.maxActivePerEndpoint = 2;
+	limits.maxIdlePerEndpoint = 1;
+	manager->setPoolLimits(limits);
+
+	auto server = std::unique_ptr<IoAcceptor>(manager->createServer("tcp://127.0.0.1:6000"));
+
+	SECTION("Reuse")
+	{
+		auto line = manager->leaseClient("tcp://127.0.0.1:6000", 1000);
+		REQUIRE(line);
+		auto peer = std::unique_ptr<IoLine>(server->waitConnection(1000));
+		manager->releaseClient(line);
+
+		REQUIRE(manager->leaseClient("tcp://127.0.0.1:6000", 1000) == line);
+		manager->releaseClient(line);
+	}
+
+	SECTION("Active limit")
+	{
+		auto line1 = manager->leaseClient("tcp://127.0.0.1:6000", 1000);
+		auto line2 = manager->leaseClient("tcp://127.0.0.1:6000", 1000);
+		REQUIRE(line1);
+		REQUIRE(line2);
+		REQUIRE(line1 != line2);
+
+		REQUIRE(!manager->leaseClient("tcp://127.0.0.1:6000", 50));
+
+		std::thread releaser([&]() {
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				manager->releaseClient(line1);
+				});
+		auto line3 = manager->leaseClient("tcp://127.0.0.1:6000", 1000);
+		releaser.join();
+		REQUIRE(line3 == line1);
+
+		manager->releaseClient(line2);
+		manager->releaseClient(line3);
+	}
+
+	SECTION("Broken idle line is not reused")
+	{
+		auto line = manager->leaseClient("tcp://127.0.0.1:6000", 1000);
+		REQUIRE(line);
+		auto peer = std::unique_ptr<IoLine>(server->waitConnection(1000));
+		manager->releaseClient(line);
+
+		peer.reset();
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+		auto fresh = manager->leaseClient("tcp://127.0.0.1:6000", 1000);
+		REQUIRE(fresh);
+		REQUIRE(fresh->isConnected());
+		manager->releaseClient(fresh, false);
+	}
+}
+
+static void checkSeqPacket(const std::shared_ptr<IoLineManager>& manager, const std::string& endpoint,
+		WireFormat format = WireFormat::V1, bool checksums = false)
+{
+	auto server = std::unique_ptr<IoAcceptor>(manager->createServer(endpoint));
+	REQUIRE(server);
+	auto client = std::unique_ptr<IoLine>(manager->createClient(endpoint));
+	REQUIRE(client);
+	REQUIRE(client->preservesBoundaries());
+	auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
+	REQUIRE(socket);
+	REQUIRE(socket->preservesBoundaries());
+
+	std::vector<char> big(100000);
+	std::iota(big.begin(), big.end(), 0);
+
+	std::vector<Message> messages(3);
+	messages[0].addFrame(Frame("\x01\x02\x03\x04", 4));
+	messages[0].addFrame(Frame("", 0));
+	messages[0].addFrame(Frame("\x05", 1));
+	messages[1].addFrame(Frame(big.data(), big.size()));
+
+	MessageProtocol clientProto(client.get());
+	clientProto.setWireFormat(format);
+	clientProto.setChecksums(checksums);
+	for(const auto& msg : messages)
+		REQUIRE(clientProto.sendMessage(msg) == 1);
+
+	MessageProtocol serverProto(socket.get());
+	serverProto.setWireFormat(format);
+	serverProto.setChecksums(checksums);
+	for(const auto& msg : messages)
+	{
+		Message recv_msg;
+		REQUIRE(serverProto.readMessage(recv_msg) == 1);
+		REQUIRE(recv_msg.size() == msg.size());
+		for(size_t i = 0; i < msg.size(); i++)
+			REQUIRE(recv_msg.frame(i) == msg.frame(i));
+	}
+
+	// Record which doesn't fit is kept until it is read with bigger buffer
+	IoVec part { big.data(), 1000 };
+	REQUIRE(client->writeRecord(&part, 1) == 1000);
+	std::vector<char> record(1000);
+	REQUIRE(socket->readRecord(record.data(), 10) == 1000);
+	REQUIRE(socket->readRecord(record.data(), record.size()) == 1000);
+	REQUIRE(std::equal(record.begin(), record.end(), big.begin()));
+
+	client.reset();
+	Message recv_msg;
+	REQUIRE(serverProto.readMessage(recv_msg) == eConnectionLost);
+}
+
+TEST_CASE("Unix seqpacket socket", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<UnixSeqPacketFactory>(new UnixSeqPacketFactory));
+
+	SECTION("Path")
+	{
+		checkSeqPacket(manager, "seqpacket:///tmp/foo-seqpacket");
+		REQUIRE(access("/tmp/foo-seqpacket", F_OK) != 0);
+	}
+
+	SECTION("Abstract namespace")
+	{
+		checkSeqPacket(manager, "seqpacket://@cppio-test-seqpacket");
+	}
+
+	SECTION("Wire format v2")
+	{
+		checkSeqPacket(manager, "seqpacket://@cppio-test-seqpacket", WireFormat::V2);
+	}
+
+	SECTION("Checksums")
+	{
+		checkSeqPacket(manager, "seqpacket://@cppio-test-seqpacket", WireFormat::V1, true);
+		checkSeqPacket(manager, "seqpacket://@cppio-test-seqpacket", WireFormat::V2, true);
+	}
+
+	SECTION("Long path is rejected")
+	{
+		REQUIRE(!manager->createServer("seqpacket:///tmp/" + std::string(200, 'x')));
+	}
+}
+
+
+TEST_CASE("Shared memory line", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<ShmLineFactory>(new ShmLineFactory));
+
+	SECTION("Check I/O")
+	{
+		checkIo(manager, "shm://cppio-test");
+	}
+
+	SECTION("Check Connection loss")
+	{
+		checkConnectionLoss(manager, "shm://cppio-test");
+	}
+
+	SECTION("Message larger than ring")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("shm://cppio-test"));
+		auto client = std::unique_ptr<IoLine>(manager->createClient("shm://cppio-test"));
+		REQUIRE(client);
+		auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
+		REQUIRE(socket);
+
+		std::vector<char> big(3 * 1024 * 1024 + 17);
+		std::iota(big.begin(), big.end(), 0);
+		Message msg;
+		msg.addFrame(Frame(big.data(), big.size()));
+		msg.addFrame(Frame("\x01\x02", 2));
+
+		std::thread sender([&]() {
+				MessageProtocol proto(client.get());
+				proto.sendMessage(msg);
+				});
+
+		Message recv_msg;
+		MessageProtocol proto(socket.get());
+		REQUIRE(proto.readMessage(recv_msg) > 0);
+		sender.join();
+
+		REQUIRE(recv_msg.size() == 2);
+		REQUIRE(recv_msg.frame(0) == msg.frame(0));
+		REQUIRE(recv_msg.frame(1) == msg.frame(1));
+	}
+
+	SECTION("Receive timeout")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("shm://cppio-test"));
+		auto client = std::unique_ptr<IoLine>(manager->createClient("shm://cppio-test?receive_timeout=50"));
+		REQUIRE(client);
+		auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
+		REQUIRE(socket);
+
+		char c;
+		REQUIRE(client->read(&c, 1) == eTimeout);
+		REQUIRE(client->isConnected());
+	}
+
+	SECTION("Another process")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("shm://cppio-test"));
+		pid_t pid = fork();
+		REQUIRE(pid >= 0);
+		if(pid == 0)
+		{
+			// Echo one message and exit without closing line, so that server has to notice dead peer
+			std::unique_ptr<IoLine> client(manager->createClient("shm://cppio-test"));
+			MessageProtocol proto(client.get());
+			Message msg;
+			if(proto.readMessage(msg) > 0)
+				proto.sendMessage(msg);
+			_exit(0);
+		}
+
+		auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
+		REQUIRE(socket);
+
+		Message msg;
+		msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+		MessageProtocol proto(socket.get());
+		REQUIRE(proto.sendMessage(msg) > 0);
+
+		Message recv_msg;
+		REQUIRE(proto.readMessage(recv_msg) > 0);
+		REQUIRE(recv_msg.size() == 1);
+		REQUIRE(recv_msg.frame(0) == msg.frame(0));
+
+		Message last_msg;
+		REQUIRE(proto.readMessage(last_msg) == eConnectionLost);
+		waitpid(pid, nullptr, 0);
+	}
+}
+
+static int createSealedBlob(const std::vector<char>& data)
+{
+	int fd = memfd_create("cppio-test-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	REQUIRE(fd >= 0);
+	REQUIRE(write(fd, data.data(), data.size()) == (ssize_t)data.size());
+	REQUIRE(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0);
+	return fd;
+}
+
+static void checkDescriptorFrames(const std::shared_ptr<IoLineManager>& manager, const std::string& endpoint)
+{
+	auto server = std::unique_ptr<IoAcceptor>(manager->createServer(endpoint));
+	auto client = std::unique_ptr<IoLine>(manager->createClient(endpoint));
+	REQUIRE(client);
+	auto socket = std::unique_ptr<IoLine>(server->waitConnection(1000));
+	REQUIRE(socket);
+
+	std::vector<char> blob(1000000);
+	std::iota(blob.begin(), blob.end(), 0);
+	int fd = createSealedBlob(blob);
+
+	Message msg;
+	msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+	msg.addFrame(Frame::fromDescriptor(fd));
+	msg.addFrame(Frame::fromDescriptor(fd));
+	msg.addFrame(Frame("\x05", 1));
+	close(fd);
+	REQUIRE(msg.frame(1).isDescriptor());
+	REQUIRE(msg.frame(1).size() == 0);
+
+	MessageProtocol clientProto(client.get());
+	REQUIRE(clientProto.sendMessage(msg) == 1);
+	REQUIRE(clientProto.sendMessage(msg) == 1);
+
+	MessageProtocol serverProto(socket.get());
+	for(int i = 0; i < 2; i++)
+	{
+		Message recv_msg;
+		REQUIRE(serverProto.readMessage(recv_msg) == 1);
+		REQUIRE(recv_msg.size() == 4);
+		REQUIRE(recv_msg.frame(0) == msg.frame(0));
+		REQUIRE(recv_msg.frame(3) == msg.frame(3));
+		for(size_t j = 1; j < 3; j++)
+		{
+			int received = recv_msg.frame(j).descriptor();
+			REQUIRE(received >= 0);
+			REQUIRE(received != msg.frame(j).descriptor());
+			REQUIRE((fcntl(received, F_GET_SEALS) & F_SEAL_WRITE) != 0);
+
+			std::vector<char> contents(blob.size());
+			REQUIRE(pread(received, contents.data(), contents.size(), 0) == (ssize_t)contents.size());
+			REQUIRE(Frame(std::move(contents)) == Frame(blob.data(), blob.size()));
+		}
+	}
+
+	// View can't hold descriptors: message is skipped as a whole and its descriptors are closed
+	Message plain;
+	plain.addFrame(Frame("\x06", 1));
+	REQUIRE(clientProto.sendMessage(msg) == 1);
+	REQUIRE(clientProto.sendMessage(plain) == 1);
+
+	MessageView view;
+	REQUIRE(serverProto.readMessageView(view) == eUnknown);
+	REQUIRE(socket->takeDescriptor() == -1);
+	REQUIRE(serverProto.readMessageView(view) == 1);
+	REQUIRE(view.size() == 1);
+	REQUIRE(view.frame(0).size() == 1);
+	REQUIRE(*(const char*)view.frame(0).data() == 6);
+}
+
+TEST_CASE("Descriptor frames", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<UnixSocketFactory>(new UnixSocketFactory));
+	manager->registerFactory(std::unique_ptr<UnixSeqPacketFactory>(new UnixSeqPacketFactory));
+	manager->registerFactory(std::unique_ptr<TcpSocketFactory>(new TcpSocketFactory));
+
+	SECTION("Unix socket")
+	{
+		checkDescriptorFrames(manager, "local:///tmp/foo-descriptors");
+	}
+
+	SECTION("Unix seqpacket socket")
+	{
+		checkDescriptorFrames(manager, "seqpacket://@cppio-test-descriptors");
+	}
+
+	SECTION("Descriptor is closed with last frame copy")
+	{
+		int fd = createSealedBlob(std::vector<char>(16));
+		int dupfd = -1;
+		{
+			Frame frame = Frame::fromDescriptor(fd);
+			Frame copy = frame;
+			dupfd = copy.descriptor();
+			REQUIRE(dupfd != fd);
+			REQUIRE(fcntl(dupfd, F_GETFD) >= 0);
+		}
+		REQUIRE(fcntl(dupfd, F_GETFD) < 0);
+		close(fd);
+	}
+
+	SECTION("Not supported by TCP lines")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("tcp://127.0.0.1:6000"));
+		auto client = std::unique_ptr<IoLine>(manager->createClient("tcp://127.0.0.1:6000"));
+		REQUIRE(client);
+
+		int fd = createSealedBlob(std::vector<char>(16));
+		Message msg;
+		msg.addFrame(Frame::fromDescriptor(fd));
+		close(fd);
+
+		MessageProtocol proto(client.get());
+		REQUIRE_THROWS(proto.sendMessage(msg));
+	}
+}
+
+TEST_CASE("UDP socket", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<UdpSocketFactory>(new UdpSocketFactory));
+
+	SECTION("Message per datagram, reply to sender")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("udp://127.0.0.1:6100?receive_timeout=1000"));
+		REQUIRE(server);
+		auto serverLine = std::unique_ptr<IoLine>(server->waitConnection(100));
+		REQUIRE(serverLine);
+		REQUIRE(serverLine->preservesBoundaries());
+		REQUIRE(!server->waitConnection(0));
+
+		auto client = std::unique_ptr<IoLine>(manager->createClient("udp://127.0.0.1:6100?receive_timeout=1000"));
+		REQUIRE(client);
+
+		Message msg;
+		msg.addFrame(Frame("\x01\x02\x03\x04", 4));
+		msg.addFrame(Frame("\x05", 1));
+
+		MessageProtocol clientProto(client.get());
+		REQUIRE(clientProto.sendMessage(msg) == 1);
+
+		MessageProtocol serverProto(serverLine.get());
+		Message recv_msg;
+		REQUIRE(serverProto.readMessage(recv_msg) == 1);
+		REQUIRE(recv_msg.size() == 2);
+		REQUIRE(recv_msg.frame(0) == msg.frame(0));
+		REQUIRE(recv_msg.frame(1) == msg.frame(1));
+
+		REQUIRE(serverProto.sendMessage(msg) == 1);
+		Message reply;
+		REQUIRE(clientProto.readMessage(reply) == 1);
+		REQUIRE(reply.size() == 2);
+
+		char c;
+		REQUIRE(serverLine->read(&c, 1) == eTimeout);
+	}
+
+	SECTION("Batched send and receive")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("udp://127.0.0.1:6100?recv_batch=32&receive_timeout=1000"));
+		auto serverLine = std::unique_ptr<IoLine>(server->waitConnection(100));
+		REQUIRE(serverLine);
+		auto client = std::unique_ptr<IoLine>(manager->createClient("udp://127.0.0.1:6100?send_batch=8"));
+		REQUIRE(client);
+
+		MessageProtocol clientProto(client.get());
+		for(uint32_t i = 0; i < 20; i++)
+		{
+			Message msg;
+			msg << i;
+			REQUIRE(clientProto.sendMessage(msg) == 1);
+		}
+		REQUIRE(client->flush() == 0);
+
+		MessageProtocol serverProto(serverLine.get());
+		for(uint32_t i = 0; i < 20; i++)
+		{
+			Message recv_msg;
+			REQUIRE(serverProto.readMessage(recv_msg) == 1);
+			REQUIRE(recv_msg.get<uint32_t>(0) == i);
+		}
+	}
+
+	SECTION("Batch is not cut by refusal of earlier datagram")
+	{
+		// Nobody listens yet, so ICMP port unreachable for the first datagram is reported by next send
+		auto client = std::unique_ptr<IoLine>(manager->createClient("udp://127.0.0.1:6100?send_batch=8"));
+		REQUIRE(client);
+		MessageProtocol clientProto(client.get());
+		Message msg;
+		msg << (uint32_t)0;
+		REQUIRE(clientProto.sendMessage(msg) == 1);
+		REQUIRE(client->flush() == 0);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("udp://127.0.0.1:6100?receive_timeout=1000"));
+		auto serverLine = std::unique_ptr<IoLine>(server->waitConnection(100));
+		REQUIRE(serverLine);
+		for(uint32_t i = 1; i <= 3; i++)
+		{
+			Message next;
+			next << i;
+			REQUIRE(clientProto.sendMessage(next) == 1);
+		}
+		REQUIRE(client->flush() == 0);
+
+		MessageProtocol serverProto(serverLine.get());
+		for(uint32_t i = 1; i <= 3; i++)
+		{
+			Message recv_msg;
+			REQUIRE(serverProto.readMessage(recv_msg) == 1);
+			REQUIRE(recv_msg.get<uint32_t>(0) == i);
+		}
+	}
+
+	SECTION("Acceptor waits forever with negative timeout")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("udp://127.0.0.1:6100"));
+		auto serverLine = std::unique_ptr<IoLine>(server->waitConnection(100));
+		REQUIRE(serverLine);
+
+		std::atomic<bool> returned(false);
+		std::thread waiter([&]() {
+				REQUIRE(!server->waitConnection(-1));
+				returned = true;
+				});
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		REQUIRE(!returned);
+		server.reset();
+		waiter.join();
+		REQUIRE(returned);
+	}
+
+	SECTION("Sequence gaps")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("udp://127.0.0.1:6100?sequence&receive_timeout=1000"));
+		auto serverLine = std::unique_ptr<IoLine>(server->waitConnection(100));
+		REQUIRE(serverLine);
+		auto client = std::unique_ptr<IoLine>(manager->createClient("udp://127.0.0.1:6100"));
+		REQUIRE(client);
+
+		for(uint64_t sequence : { 10, 11, 13, 16, 12 })
+		{
+			std::array<char, 9> datagram;
+			memcpy(datagram.data(), &sequence, 8);
+			datagram[8] = (char)sequence;
+			REQUIRE(client->write(datagram.data(), datagram.size()) == 9);
+		}
+
+		for(int i = 0; i < 5; i++)
+		{
+			char c = 0;
+			REQUIRE(serverLine->read(&c, 1) == 1);
+		}
+
+		// 12 is counted both as lost and as late, 14 and 15 are lost
+		int gaps = 0;
+		serverLine->getOption(LineOption::SequenceGaps, &gaps);
+		REQUIRE(gaps == 4);
+	}
+
+	SECTION("Multicast")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("udp://239.255.12.34:6101?receive_timeout=1000"));
+		if(!server)
+		{
+			WARN("Unable to join multicast group, skipping");
+			return;
+		}
+		auto serverLine = std::unique_ptr<IoLine>(server->waitConnection(100));
+		auto client = std::unique_ptr<IoLine>(manager->createClient("udp://239.255.12.34:6101?multicast_loop=1&multicast_ttl=0"));
+		REQUIRE(client);
+
+		std::array<char, 4> buf { { 1, 2, 3, 4 } };
+		std::array<char, 4> recv_buf {};
+		if(client->write(buf.data(), buf.size()) < 0)
+		{
+			WARN("Multicast is not routed, skipping");
+			return;
+		}
+		ssize_t rc = serverLine->read(recv_buf.data(), recv_buf.size());
+		if(rc == eTimeout)
+		{
+			WARN("Multicast is not routed, skipping");
+			return;
+		}
+		REQUIRE(rc == 4);
+		REQUIRE(buf == recv_buf);
+	}
+}
+
+TEST_CASE("Pipe line", "[io]")
+{
+	auto manager = std::make_shared<IoLineManager>();
+	manager->registerFactory(std::unique_ptr<PipeLineFactory>(new PipeLineFactory));
+
+	SECTION("Check I/O")
+	{
+		threadedCheckIo(manager, "pipe:///tmp/foo-pipe");
+		REQUIRE(access("/tmp/foo-pipe", F_OK) != 0);
+	}
+
+	SECTION("Check Connection loss")
+	{
+		checkConnectionLoss(manager, "pipe:///tmp/foo-pipe");
+	}
+
+	SECTION("Several clients")
+	{
+		auto server = std::unique_ptr<IoAcceptor>(manager->createServer("pipe:///tmp/foo-pipe"));
+		REQUIRE(server);
+
+		std::vector<std::unique_ptr<IoLine>> clients(3);
+		std::vector<std::thread> threads;
+		for(size_t i = 0; i < clients.size(); i++)
+			threads.emplace_back([&, i]() { clients[i].reset(manager->createClient("pipe:///tmp/foo-pipe")); });
+
+		std::vector<std::unique_ptr<IoLine>> lines;
+		for(size_t i = 0; i < clients.size(); i++)
+			lines.emplace_back(server->waitConnection(1000));
+		for(auto& thread : threads)
+			thread.join();
+
+		for(size_t i = 0; i < clients.size(); i++)
+		{
+			REQUIRE(clients[i]);
+			REQUIRE(lines[i]);
+			char c = (char)i;
+			REQUIRE(clients[i]->write(&c, 1) == 1);
+		}
+
+		// Clients are accepted in any order, but every line is connected to exactly one of them
+		std::vector<bool> seen(clients.size());
+		for(auto& line : lines)
+		{
+			char c = -1;
+			REQUIRE(line->read(&c, 1) == 1);
+			REQUIRE((size_t)c < seen.size());
+			REQUIRE(!seen[c]);
+			seen[c] = true;
+		}
+	}
+
+	SECTION("Server that never answers")
+	{
+		// Request is taken by a reader that doesn't open client's FIFO, so connection times out instead of blocking
+		unlink("/tmp/foo-pipe");
+		REQUIRE(mkfifo("/tmp/foo-pipe", 0600) == 0);
+		int reader = open("/tmp/foo-pipe", O_RDONLY | O_NONBLOCK);
+		REQUIRE(reader >= 0);
+		auto start = std::chrono::steady_clock::now();
+		REQUIRE(!std::unique_ptr<IoLine>(manager->createClient("pipe:///tmp/foo-pipe")));
+		REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+		close(reader);
+		unlink("/tmp/foo-pipe");
+	}
+
+	SECTION("Inherited descriptors and vmsplice")
+	{
+		int toChild[2];
+		int toParent[2];
+		REQUIRE(pipe(toChild) == 0);
+		REQUIRE(pipe(toParent) == 0);
+
+		pid_t pid = fork();
+		REQUIRE(pid >= 0);
+		if(pid == 0)
+		{
+			close(toChild[1]);
+			close(toParent[0]);
+			std::unique_ptr<IoLine> line(manager->createClient("pipe://fd:" + std::to_string(toChild[0]) + "," +
+						std::to_string(toParent[1]) + "?vmsplice=4096"));
+			MessageProtocol proto(line.get());
+			Message msg;
+			if(proto.readMessage(msg) > 0)
+				proto.sendMessage(msg);
+			_exit(0);
+		}
+		close(toChild[0]);
+		close(toParent[1]);
+
+		std::unique_ptr<IoLine> line(manager->createClient("pipe://fd:" + std::to_string(toParent[0]) + "," +
+					std::to_string(toChild[1]) + "?vmsplice=4096&receive_timeout=5000"));
+		REQUIRE(line);
+
+		std::vector<char> big(1000000);
+		std::iota(big.begin(), big.end(), 0);
+		Message msg;
+		msg.addFrame(Frame(big.data(), big.size()));
+		msg.addFrame(Frame("\x01\x02", 2));
+
+		MessageProtocol proto(line.get());
+		REQUIRE(proto.sendMessage(msg) == 1);
+
+		Message recv_msg;
+		REQUIRE(proto.readMessage(recv_msg) == 1);
+		REQUIRE(recv_msg.size() == 2);
+		REQUIRE(recv_msg.frame(0) == msg.frame(0));
+		REQUIRE(recv_msg.frame(1) == msg.frame(1));
+
+		// Child has read whole message, so spliced send buffer is released
+		REQUIRE(static_cast<PipeLine*>(line.get())->pendingSplicedBuffers() == 0);
+		waitpid(pid, nullptr, 0);
+	}
+
+	SECTION("Pair")
+	{
+		auto pair = PipeLine::createPair();
+		std::unique_ptr<IoLine> first(pair.first);
+		std::unique_ptr<IoLine> second(pair.second);
+
+		std::array<char, 4> buf { { 1, 2, 3, 4 } };
+		std::array<char, 4> recv_buf {};
+		REQUIRE(first->write(buf.data(), buf.size()) == 4);
+		REQUIRE(second->read(recv_buf.data(), recv_buf.size()) == 4);
+		REQUIRE(buf == recv_buf);
+
+		second.reset();
+		REQUIRE(!first->isConnected());
+		REQUIRE(first->write(buf.data(), buf.size()) == eConnectionLost);
+	}
+}